@@ -35,6 +35,7 @@ chmod +x configure
 	--add-module=../../source/nginx_polaris_limit_module \
 	--add-module=../polaris_client \
     --with-stream \
+    --with-threads \
     --with-cpp=g++
 make
 popd
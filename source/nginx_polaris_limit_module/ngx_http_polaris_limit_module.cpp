@@ -14,6 +14,53 @@
 #include "ngx_http_polaris_limit_module.h"
 #include "polaris/log.h"
 
+typedef struct {
+    ngx_flag_t                          remote;                             // 是否有location启用了远端限流
+
+    ngx_str_t                           config_path;                        // polaris.yaml路径
+
+    ngx_str_t                           polaris_config;                     // 展开环境变量后的SDK配置
+
+    time_t                              config_mtime;                       // 读取时配置文件的修改时间
+
+    ngx_msec_t                          config_watch;                       // 检查配置文件变化的间隔，0表示不检查
+
+    ngx_msec_t                          prewarm;                            // worker启动时等待规则加载的上限，默认0表示不预先拉取
+
+    LimitServiceMap                    *services;                           // 本次配置中的限流服务
+
+    ngx_shm_zone_t                     *stat_zone;                          // 限流统计，没有启用限流的服务时为NULL
+
+    ngx_flag_t                          shed;                               // 是否有location启用了排队丢弃
+
+    ngx_flag_t                          enabled;                            // 是否有location启用了限流，没有时不挂载处理函数
+
+    ngx_flag_t                          agent;                              // 是否由一个worker代理所有worker访问限流服务
+
+    ngx_shm_zone_t                     *agent_zone;                         // 代理请求槽和规则，没有启用代理时为NULL
+
+    ngx_shm_zone_t                     *early_zone;                         // 记录被限流客户端的共享内存，NULL表示不提前拒绝
+
+    ngx_http_complex_value_t           *early_key;                          // 识别客户端的key，默认$binary_remote_addr
+
+    ngx_msec_t                          early_hold;                         // 客户端被限流后至少提前拒绝多久
+
+} ngx_http_polaris_limit_main_conf_t;
+
+/// CoDel丢弃状态，每个worker独立
+typedef struct {
+    ngx_msec_t                          first_above_time;                   // 排队时间超过目标后，开始允许丢弃的时间
+
+    ngx_msec_t                          drop_next;                          // 下一次丢弃的时间
+
+    ngx_uint_t                          count;                              // 本轮丢弃的请求数
+
+    ngx_uint_t                          last_count;
+
+    ngx_flag_t                          dropping;
+
+} ngx_http_polaris_limit_codel_t;
+
 typedef struct {
     ngx_int_t                           enable;                             // 是否启用限流
 
@@ -23,17 +70,240 @@ typedef struct {
 
     std::string                         service_name;                       // 服务名
 
+    LimitServiceContext                *service;                            // 服务在worker内的状态
+
+    ngx_uint_t                          mode;                               // 限流模式
+
+    ngx_shm_zone_t                     *shm_zone;                           // 本地限流使用的共享内存
+
+    ngx_polaris_limit_gcra_t            gcra;                               // 本地限流速率
+
+    ngx_polaris_limit_concurrency_conf_t concurrency;                       // 并发限流上限的范围
+
+    ngx_http_complex_value_t           *key;                                // 本地限流的key
+
+    ngx_http_complex_value_t           *tenant;                             // 租户，每个租户在key的限额内再按份额限流
+
+    ngx_polaris_limit_gcra_t            tenant_gcra;                        // 按tenant_share计算的租户速率
+
+    ngx_uint_t                          tenant_share;                       // 租户可使用的速率百分比
+
+    ngx_uint_t                          tenant_borrow;                      // 租户超出份额后可借用的全局burst百分比
+
+    uint64_t                            salt;                               // 区分不同location的限流桶
+
+    ngx_http_complex_value_t           *heavy_key;                          // 自动识别高频key，如$http_x_api_key
+
+    ngx_flag_t                          early;                              // 被限流的客户端记入polaris_rate_limiting_early
+
+    ngx_uint_t                          heavy_share;                        // 单个key超过本location流量的百分比时限流
+
+    ngx_flag_t                          async;                              // 是否在线程池中获取配额
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;                        // 异步获取配额使用的线程池
+#endif
+
+    ngx_msec_t                          timeout;                            // 获取配额的时间预算，0表示使用SDK配置
+
+    ngx_uint_t                          fail;                               // 获取配额出错时的处理方式
+
+    ngx_uint_t                          lease;                              // 批量租用配额占规则总配额的百分比，0表示不租用
+
+    ngx_uint_t                          degrade_nodes;                      // 远端不可达时按规则配额除以节点数在本机限流，0表示放通
+
+    ngx_radix_tree_t                   *acl;                                // IPv4放行和拒绝名单
+
+#if (NGX_HAVE_INET6)
+    ngx_radix_tree_t                   *acl6;                               // IPv6放行和拒绝名单
+#endif
+
+    ngx_uint_t                          status_format;                      // 统计接口的默认输出格式
+
+    ngx_msec_t                          delay;                              // 超出配额时最多排队等待的时间，0表示直接拒绝
+
+    ngx_uint_t                          queue;                              // 每个worker中最多排队的请求数
+
+    ngx_uint_t                          delayed;                            // 本worker中正在排队的请求数
+
+    ngx_http_complex_value_t           *priority;                           // 请求的优先级，0最高
+
+    ngx_http_complex_value_t           *cost;                               // 请求消耗的配额数，如按路由或$content_length计算
+
+    ngx_uint_t                          npriorities;
+
+    ngx_uint_t                          reserve[NGX_HTTP_POLARIS_LIMIT_MAX_PRIORITIES];     // 各优先级不能使用的配额百分比
+
+    ngx_msec_t                          shed_target;                        // 可接受的排队时间，0表示不丢弃
+
+    ngx_msec_t                          shed_interval;                      // 排队时间持续超过目标多久后开始丢弃
+
+    ngx_http_polaris_limit_codel_t      codel;                              // 本worker中的CoDel状态
+
 } ngx_http_polaris_limit_conf_t;
 
+#define NGX_HTTP_POLARIS_LIMIT_ASYNC_NONE           0
+#define NGX_HTTP_POLARIS_LIMIT_ASYNC_FETCH          1                       // 线程池中拉取规则
+#define NGX_HTTP_POLARIS_LIMIT_ASYNC_FETCH_DONE     2
+#define NGX_HTTP_POLARIS_LIMIT_ASYNC_QUOTA          3                       // 线程池中获取配额
+#define NGX_HTTP_POLARIS_LIMIT_ASYNC_QUOTA_DONE     4
+
+#define NGX_HTTP_POLARIS_LIMIT_DELAY_NONE           0
+#define NGX_HTTP_POLARIS_LIMIT_DELAY_PARKED         1                       // 在定时器上排队
+#define NGX_HTTP_POLARIS_LIMIT_DELAY_WOKEN          2                       // 排队结束，重新运行phase
+
+typedef struct {
+    ngx_int_t                           remaining;                          // 剩余配额，-1表示未知
+
+    ngx_msec_t                          retry_after;                        // 被限流时建议的重试间隔
+
+    ngx_uint_t                          async_state;                        // 异步获取配额的阶段
+
+    polaris::ReturnCode                 async_ret;                          // 线程池中调用SDK的返回码
+
+    polaris::QuotaResultCode            async_result;                       // 线程池中获取到的配额结果
+
+    int64_t                             lease_amount;                       // 本次向远端租用的配额数
+
+    int64_t                             cost;                               // 当前请求消耗的配额数
+
+    polaris::QuotaResultInfo            lease_info;                         // 远端返回的规则配额信息
+
+    ngx_str_t                           lease_key;                          // 租约key，异步返回后更新租约
+
+    ngx_uint_t                          delay_state;                        // 超出配额后排队的阶段
+
+    ngx_msec_t                          delay_start;                        // 第一次排队的时间
+
+    ngx_flag_t                          delay_reserved;                     // 本地限流已预占配额，排队结束后直接放行
+
+    ngx_http_polaris_limit_conf_t      *delay_conf;                         // 排队计数所在的location配置
+
+    ngx_flag_t                          decided;                            // 已经对该客户端请求做出判断
+
+    ngx_flag_t                          entered;                            // 已经进入过PREACCESS阶段，之后是排队或异步返回后重新运行
+
+    ngx_flag_t                          quota_limited;                      // 配额判断为限流，只有这种情况记入提前拒绝
+
+#if (NGX_THREADS)
+    ngx_thread_task_t                  *task;
+#endif
+
+} ngx_http_polaris_limit_ctx_t;
+
+/// 并发槽在请求内存池释放时归还
+typedef struct {
+    ngx_http_request_t                 *request;
+
+    ngx_polaris_limit_concurrency_t    *slot;
+
+    ngx_polaris_limit_concurrency_conf_t *conf;
+
+    uint64_t                            start;                              // 占用并发槽的时间，单位微秒
+
+} ngx_http_polaris_limit_inflight_t;
+
+#if (NGX_THREADS)
+/// 线程池任务上下文，线程中只访问这里的数据，不访问请求
+typedef struct {
+    polaris::LimitApi                  *limit_api;
+
+    LimitServiceContext                *service;
+
+    polaris::QuotaRequest              *quota_request;                      // 与agent_call都为NULL时表示只拉取规则
+
+    LimitAgentQuotaCall                *agent_call;                         // 通过主机代理获取配额
+
+    ngx_msec_t                          timeout;
+
+    int64_t                             amount;                             // 租用的配额数，返回实际批准的数量
+
+    int64_t                             cost;                               // 批量租用被拒绝时只获取当前请求的配额
+
+    ngx_flag_t                          with_info;                          // 是否需要返回规则配额信息
+
+    polaris::ReturnCode                 ret;
+
+    polaris::QuotaResultCode            result;
+
+    polaris::QuotaResultInfo            info;
+
+    ngx_polaris_limit_stat_t           *stat;                               // 在线程中记录SDK调用耗时
+
+} ngx_http_polaris_limit_task_ctx_t;
+#endif
+
 static ngx_int_t ngx_http_polaris_limit_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_polaris_limit_local_handler(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat);
+static ngx_msec_t ngx_http_polaris_limit_sojourn(ngx_http_request_t *r);
+static ngx_flag_t ngx_http_polaris_limit_codel_drop(ngx_http_polaris_limit_conf_t *plcf, ngx_msec_t sojourn);
+static void ngx_http_polaris_limit_lag_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_polaris_limit_concurrency_handler(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static void ngx_http_polaris_limit_concurrency_cleanup(void *data);
+static ngx_int_t ngx_http_polaris_limit_quota_decision(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, polaris::ReturnCode ret, polaris::QuotaResultCode result, const polaris::QuotaResultInfo& info);
+static ngx_int_t ngx_http_polaris_limit_delay(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, const polaris::QuotaResultInfo& info);
+static ngx_int_t ngx_http_polaris_limit_park(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_http_polaris_limit_ctx_t *ctx, ngx_polaris_limit_stat_t *stat, ngx_msec_t delay, ngx_flag_t reserved);
+static void ngx_http_polaris_limit_delay_handler(ngx_http_request_t *r);
+static void ngx_http_polaris_limit_delay_cleanup(void *data);
+static ngx_polaris_limit_stat_t *ngx_http_polaris_limit_stat(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static ngx_flag_t ngx_http_polaris_limit_with_info(ngx_http_polaris_limit_conf_t *plcf);
+static ngx_int_t ngx_http_polaris_limit_failure(ngx_http_polaris_limit_conf_t *plcf, ngx_int_t legacy_rc);
+static polaris::ReturnCode ngx_http_polaris_limit_get_quota(polaris::LimitApi *limit_api, polaris::QuotaRequest& quota_request,
+    int64_t& amount, int64_t cost, polaris::QuotaResultCode& result, polaris::QuotaResultInfo& info, ngx_flag_t with_info,
+    ngx_polaris_limit_stat_t *stat);
+static void ngx_http_polaris_limit_quota_update(ngx_http_polaris_limit_conf_t *plcf, const std::string& quota_key,
+    polaris::ReturnCode ret, polaris::QuotaResultCode result, int64_t amount, int64_t cost, const polaris::QuotaResultInfo& info);
+static polaris::ReturnCode ngx_http_polaris_limit_agent_get_quota(LimitAgentQuotaCall& call, int64_t& amount,
+    polaris::QuotaResultCode& result, polaris::QuotaResultInfo& info, ngx_polaris_limit_stat_t *stat);
+static ngx_int_t ngx_http_polaris_limit_agent_refresh(LimitServiceContext *service);
+static void ngx_http_polaris_limit_agent_quota(LimitAgentQuotaCall& call, LimitAgentQuotaReply& reply);
+static bool ngx_http_polaris_limit_agent_rule(ngx_uint_t index, std::string& name, const void*& version,
+    std::string& label_keys, std::string& rule);
+static ngx_int_t ngx_http_polaris_limit_degrade(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, const std::string& quota_key, int64_t cost);
+static ngx_uint_t ngx_http_polaris_limit_reserve(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static int64_t ngx_http_polaris_limit_cost(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static ngx_int_t ngx_http_polaris_limit_heavy(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static ngx_int_t ngx_http_polaris_limit_evaluate(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static ngx_http_polaris_limit_ctx_t *ngx_http_polaris_limit_get_ctx(ngx_http_request_t *r);
+static ngx_flag_t ngx_http_polaris_limit_decided(ngx_http_request_t *r);
+static void ngx_http_polaris_limit_ctx_cleanup(void *data);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_polaris_limit_post_task(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    polaris::LimitApi *limit_api, polaris::QuotaRequest *quota_request, LimitAgentQuotaCall *agent_call,
+    const std::string& lease_key, int64_t amount, int64_t cost);
+static void ngx_http_polaris_limit_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_polaris_limit_thread_event_handler(ngx_event_t *ev);
+#endif
+static ngx_int_t ngx_http_polaris_limit_set_retry_after(ngx_http_request_t *r, ngx_msec_t retry_after);
+static void ngx_http_polaris_limit_caller_addr(ngx_http_request_t *r, ngx_addr_t *addr);
+static uintptr_t ngx_http_polaris_limit_acl_find(ngx_http_polaris_limit_conf_t *plcf, struct sockaddr *sockaddr);
+static char *ngx_http_polaris_limit_acl_add(ngx_conf_t *cf, ngx_http_polaris_limit_conf_t *plcf, ngx_str_t *value, uintptr_t action);
 static char *ngx_http_polaris_limit_conf_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_polaris_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_polaris_limit_early(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_polaris_limit_early_reject(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf);
+static void ngx_http_polaris_limit_early_record(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_http_polaris_limit_ctx_t *ctx);
+static char *ngx_http_polaris_limit_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_polaris_limit_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_polaris_limit_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_polaris_limit_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_polaris_limit_init(ngx_conf_t *cf);
+static void *ngx_http_polaris_limit_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_polaris_limit_init_main_conf(ngx_conf_t *cf, void *conf);
+static void ngx_http_polaris_limit_watch_handler(ngx_event_t *ev);
+static void ngx_http_polaris_limit_prewarm(ngx_cycle_t *cycle, ngx_msec_t prewarm);
+static void ngx_http_polaris_limit_prewarm_handler(ngx_event_t *ev);
+static std::string get_polaris_conf_path();
+static ngx_int_t ngx_http_polaris_limit_init_process(ngx_cycle_t *cycle);
+static void ngx_http_polaris_limit_exit_process(ngx_cycle_t *cycle);
 static void *ngx_http_polaris_limit_create_conf(ngx_conf_t *cf);
 static char *ngx_http_polaris_limit_merge_conf(ngx_conf_t *cf, void *parent, void *child);
-static void split_query(std::string& s, std::map<std::string, std::string>& v);
-static void parse_query_token(const std::string& token, std::map<std::string, std::string>& v);
-static void get_labels_from_request(ngx_http_request_t* r, const std::set<std::string>*& label_keys,
-                                      std::map<std::string, std::string>& keyword_map);
 static void join_map_str(const std::map<std::string, std::string>& labels, std::string& labels_str);
 
 static ngx_command_t ngx_http_polaris_limit_commands[] = {
@@ -43,15 +313,65 @@ static ngx_command_t ngx_http_polaris_limit_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
+    { ngx_string("polaris_rate_limiting_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_polaris_limit_zone,
+      0,
+      0,
+      NULL },
+    { ngx_string("polaris_rate_limiting_early"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE123,
+      ngx_http_polaris_limit_early,
+      0,
+      0,
+      NULL },
+    { ngx_string("polaris_rate_limiting_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_polaris_limit_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("polaris_rate_limiting_config_watch"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_polaris_limit_main_conf_t, config_watch),
+      NULL },
+    { ngx_string("polaris_rate_limiting_prewarm"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_polaris_limit_main_conf_t, prewarm),
+      NULL },
+    { ngx_string("polaris_rate_limiting_agent"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_polaris_limit_main_conf_t, agent),
+      NULL },
     ngx_null_command
 };
 
+static ngx_event_t  ngx_http_polaris_limit_watch_event;
+static ngx_event_t  ngx_http_polaris_limit_lag_event;
+static ngx_event_t  ngx_http_polaris_limit_prewarm_event;
+static ngx_msec_t   ngx_http_polaris_limit_loop_lag;                        // 最近一次检测到的事件循环延迟
+static ngx_polaris_limit_agent_ctx_t *ngx_http_polaris_limit_agent;         // 非NULL时本worker通过代理访问限流服务
+
+static ngx_http_variable_t ngx_http_polaris_limit_vars[] = {
+    { ngx_string("polaris_rate_limit_remaining"), NULL,
+      ngx_http_polaris_limit_variable, 0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("polaris_rate_limit_retry_after"), NULL,
+      ngx_http_polaris_limit_variable, 1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    ngx_http_null_variable
+};
+
 static ngx_http_module_t ngx_http_polaris_limit_module_ctx = {
-    NULL,                                       /* preconfiguration */
+    ngx_http_polaris_limit_add_variables,       /* preconfiguration */
     ngx_http_polaris_limit_init,                /* postconfiguration */
 
-    NULL,                                       /* create main configuration */
-    NULL,                                       /* init main configuration */
+    ngx_http_polaris_limit_create_main_conf,    /* create main configuration */
+    ngx_http_polaris_limit_init_main_conf,      /* init main configuration */
 
     NULL,                                       /* create server configuration */
     NULL,                                       /* merge server configuration */
@@ -67,203 +387,2656 @@ ngx_module_t ngx_http_polaris_limit_module = {
     NGX_HTTP_MODULE,                            /* module type */
     NULL,                                       /* init master */
     NULL,                                       /* init module */
-    NULL,                                       /* init process */
+    ngx_http_polaris_limit_init_process,        /* init process */
     NULL,                                       /* init thread */
     NULL,                                       /* exit thread */
-    NULL,                                       /* exit process */
+    ngx_http_polaris_limit_exit_process,        /* exit process */
     NULL,                                       /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
-/* 处理函数 */
-static ngx_int_t ngx_http_polaris_limit_handler(ngx_http_request_t *r) {
-    ngx_http_polaris_limit_conf_t          *plcf;
-    polaris::QuotaRequest                   quota_request;
-    polaris::ReturnCode                     ret;
-    polaris::QuotaResultCode                result;
-    std::map<std::string, std::string>      labels;
-    const std::set<std::string>            *label_keys;
+/* 处理函数，一个客户端请求只判断一次，内部跳转、error_page和子请求沿用第一次的结果 */
+static ngx_int_t ngx_http_polaris_limit_handler(ngx_http_request_t *r) {
+    ngx_http_polaris_limit_conf_t          *plcf;
+    ngx_http_polaris_limit_ctx_t           *ctx;
+    ngx_int_t                               rc;
+
+    plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_http_polaris_limit_module));
+
+    if (plcf->enable == 0) {
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] RateLimit not enabled");
+      return NGX_DECLINED;
+    }
+
+    if (ngx_http_polaris_limit_decided(r)) {
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] request already evaluated");
+      return NGX_DECLINED;
+    }
+
+    if (plcf->early) {
+      ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+      if (ctx == NULL || !ctx->entered) {
+        rc = ngx_http_polaris_limit_early_reject(r, plcf);
+        if (rc != NGX_DECLINED) {
+          return rc;
+        }
+      }
+    }
+
+    rc = ngx_http_polaris_limit_evaluate(r, plcf);
+    if (rc == NGX_AGAIN || rc == NGX_DONE) {
+      ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+      ctx->entered = 1;
+      return rc;                                                // 排队或等待线程池，之后重新运行phase
+    }
+
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (ctx != NULL) {
+      ctx->decided = 1;
+      if (plcf->early && ctx->quota_limited) {
+        ngx_http_polaris_limit_early_record(r, plcf, ctx);
+      }
+    }
+    return rc;
+}
+
+/* 在本location仍处于限流期内的客户端，不提取标签、不获取配额，按限流状态码结束请求。
+   记录按location区分，需要在找到location之后判断，因此在PREACCESS阶段最先执行，而不是POST_READ */
+static ngx_int_t ngx_http_polaris_limit_early_reject(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+    ngx_str_t                           key;
+    ngx_msec_t                          left;
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_http_polaris_limit_module));
+    if (lmcf->early_zone == NULL || ngx_http_complex_value(r, lmcf->early_key, &key) != NGX_OK || key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    left = ngx_polaris_limit_verdict_get(reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(lmcf->early_zone->data),
+        ngx_polaris_limit_hash_key(NGX_HTTP_POLARIS_LIMIT_EARLY_SALT ^ plcf->salt, key.data, key.len));
+    if (left == 0) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] early reject, limited for %M ms", left);
+    ngx_polaris_limit_stat_count(ngx_http_polaris_limit_stat(r, plcf), NGX_POLARIS_LIMIT_STAT_LIMITED);
+    if (ngx_http_polaris_limit_set_retry_after(r, left) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    return plcf->status_code;                                   // 经过过滤模块和访问日志，与获取配额后限流的响应一致
+}
+
+/* 被本location的配额限流的客户端在hold或建议的重试间隔内提前拒绝，只影响本location */
+static void ngx_http_polaris_limit_early_record(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_http_polaris_limit_ctx_t *ctx) {
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+    ngx_str_t                           key;
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_http_polaris_limit_module));
+    if (lmcf->early_zone == NULL || ngx_http_complex_value(r, lmcf->early_key, &key) != NGX_OK || key.len == 0) {
+        return;
+    }
+
+    ngx_polaris_limit_verdict_set(reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(lmcf->early_zone->data),
+        ngx_polaris_limit_hash_key(NGX_HTTP_POLARIS_LIMIT_EARLY_SALT ^ plcf->salt, key.data, key.len),
+        ngx_max(lmcf->early_hold, ctx->retry_after));
+}
+
+/* 规则JSON的哈希作为规则版本，读取失败时为空串的哈希 */
+static uint64_t ngx_http_polaris_limit_rule_version(const std::string &json_rule) {
+    return ngx_polaris_limit_hash_key(0, reinterpret_cast<u_char *>(const_cast<char *>(json_rule.data())), json_rule.size());
+}
+
+/* 按location配置判断请求是否被限流 */
+static ngx_int_t ngx_http_polaris_limit_evaluate(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_http_polaris_limit_ctx_t           *ctx;
+    polaris::QuotaRequest                  *quota_request = NULL;
+    LimitAgentQuotaCall                    *agent_call = NULL;
+    polaris::ReturnCode                     ret;
+    polaris::QuotaResultCode                result;
+    polaris::QuotaResultInfo                info = polaris::QuotaResultInfo();
+    std::map<std::string, std::string>      labels;
+    RuleCandidates                          candidates;                 // method匹配的规则
+    std::string                             json_rule;
+    ngx_flag_t                              stale;
+    ngx_flag_t                              fetched = 0;                // json_rule已是本次读取的规则
+    std::string                             lease_key;                  // 租约和按优先级保留配额共用
+    int64_t                                 amount = 1;
+    int64_t                                 cost;
+    ngx_uint_t                              reserve;
+    const std::set<std::string>            *label_keys;
+    ngx_addr_t                              caller;
+    ngx_polaris_limit_stat_t               *stat;
+    uint64_t                                start;
+    ngx_flag_t                              first;
+
+    stat = ngx_http_polaris_limit_stat(r, plcf);
+
+    ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+    first = (ctx == NULL || !ctx->entered);
+    if (ctx != NULL && ctx->delay_state == NGX_HTTP_POLARIS_LIMIT_DELAY_WOKEN && ctx->delay_reserved) {
+      ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_PASSED);
+      return NGX_DECLINED;                                      // 排队时已预占本地配额
+    }
+
+    if (plcf->acl != NULL
+#if (NGX_HAVE_INET6)
+        || plcf->acl6 != NULL
+#endif
+       ) {
+      ngx_http_polaris_limit_caller_addr(r, &caller);
+      uintptr_t action = ngx_http_polaris_limit_acl_find(plcf, caller.sockaddr);
+      if (action == NGX_HTTP_POLARIS_LIMIT_ACL_BYPASS) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] caller %V bypassed", &caller.name);
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_PASSED);
+        return NGX_DECLINED;
+      }
+      if (action == NGX_HTTP_POLARIS_LIMIT_ACL_BLOCK) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] caller %V blocked", &caller.name);
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_LIMITED);
+        return plcf->status_code;
+      }
+    }
+
+    // 只在请求第一次进入时判断，排队或异步获取配额后重新运行phase不再丢弃
+    if (plcf->shed_target && first && !r->internal
+        && ngx_http_polaris_limit_codel_drop(plcf, ngx_http_polaris_limit_sojourn(r))) {
+      ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "[PolarisRateLimiting] shed request, queueing over %M ms, loop lag %M ms",
+          plcf->shed_target, ngx_http_polaris_limit_loop_lag);
+      ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_SHED);
+      return plcf->status_code;
+    }
+
+    if (plcf->heavy_key != NULL && first && ngx_http_polaris_limit_heavy(r, plcf) == NGX_BUSY) {
+      ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_LIMITED);
+      return plcf->status_code;
+    }
+
+    if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL) {
+      ngx_int_t rc = ngx_http_polaris_limit_local_handler(r, plcf, stat);
+      if (rc != NGX_AGAIN) {
+        ngx_polaris_limit_stat_count(stat, rc == NGX_DECLINED ? NGX_POLARIS_LIMIT_STAT_PASSED : NGX_POLARIS_LIMIT_STAT_LIMITED);
+      }
+      return rc;
+    }
+
+    if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY) {
+      ngx_int_t rc = ngx_http_polaris_limit_concurrency_handler(r, plcf);
+      ngx_polaris_limit_stat_count(stat, rc == NGX_DECLINED ? NGX_POLARIS_LIMIT_STAT_PASSED : NGX_POLARIS_LIMIT_STAT_LIMITED);
+      return rc;
+    }
+
+    if (ctx != NULL && ctx->async_state == NGX_HTTP_POLARIS_LIMIT_ASYNC_QUOTA_DONE) {
+      if (ctx->lease_key.len) {
+        lease_key.assign(reinterpret_cast<char *>(ctx->lease_key.data), ctx->lease_key.len);
+        ngx_http_polaris_limit_quota_update(plcf, lease_key, ctx->async_ret, ctx->async_result, ctx->lease_amount, ctx->cost,
+            ctx->lease_info);
+        if (plcf->degrade_nodes && ctx->async_ret == polaris::kReturnTimeout) {
+          return ngx_http_polaris_limit_degrade(r, plcf, stat, lease_key, ctx->cost);
+        }
+      }
+      return ngx_http_polaris_limit_quota_decision(r, plcf, stat, ctx->async_ret, ctx->async_result, ctx->lease_info);  // 线程池已返回结果
+    }
+
+    polaris::LimitApi* limit_api = Limit_API_SINGLETON.GetLimitApi();
+    LimitServiceContext *service = plcf->service;
+    if (ngx_http_polaris_limit_agent != NULL) {
+        if (ngx_http_polaris_limit_agent_refresh(service) != NGX_OK) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] agent rule not published");
+            return NGX_DECLINED;                                // 代理未就绪时放通
+        }
+        label_keys = service->agent_label_keys;
+        ret = polaris::kReturnOk;
+    } else if (NULL == limit_api) {
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] RateLimit api not ready");
+      return NGX_DECLINED;                                      // 未就绪时放通
+    } else if (plcf->async) {
+        if (ctx != NULL && ctx->async_state == NGX_HTTP_POLARIS_LIMIT_ASYNC_FETCH_DONE) {
+            ret = ctx->async_ret;
+            if (ret == polaris::kReturnOk) {
+                ret = limit_api->FetchRuleLabelKeys(service->service_key, 0, label_keys);
+            }
+        } else {
+            ret = limit_api->FetchRuleLabelKeys(service->service_key, 0, label_keys);  // 只查本地缓存，不等待
+#if (NGX_THREADS)
+            if (ret == polaris::kReturnTimeout) {
+                return ngx_http_polaris_limit_post_task(r, plcf, limit_api, NULL, NULL, lease_key, amount, 1);  // 规则未加载，到线程池中等待
+            }
+#endif
+        }
+    } else {
+        start = ngx_polaris_limit_stat_now_us();
+        if (plcf->timeout) {
+            ret = limit_api->FetchRuleLabelKeys(service->service_key, plcf->timeout, label_keys);
+        } else {
+            ret = limit_api->FetchRuleLabelKeys(service->service_key, label_keys);
+        }
+        ngx_polaris_limit_stat_latency(stat, rule_latency, start);
+    }
+
+    if (ret != 0) {
+       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[PolarisRateLimiting] fail to fetchRuleLabelKeys return is: %d", ret);
+       ngx_polaris_limit_stat_count(stat, ret == polaris::kReturnTimeout ? NGX_POLARIS_LIMIT_STAT_TIMEOUT : NGX_POLARIS_LIMIT_STAT_ERROR);
+       return ngx_http_polaris_limit_failure(plcf, NGX_DECLINED);
+    }
+
+    stale = service->label_plan.IsStale(label_keys);
+    if (!stale && ngx_http_polaris_limit_agent == NULL
+        && static_cast<ngx_msec_int_t>(ngx_current_msec - service->rule_checked) >= 0)
+    {
+        // 旧规则释放后新规则的label keys可能分配在同一地址，定期按规则内容确认版本
+        if (limit_api->FetchRule(service->service_key, 0, json_rule) != polaris::kReturnOk) {
+            json_rule.clear();
+        }
+        fetched = 1;
+        service->rule_checked = ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_RULE_CHECK;
+        stale = ngx_http_polaris_limit_rule_version(json_rule) != service->rule_version;
+    }
+
+    if (stale) {
+      service->label_plan.Build(label_keys);                  // 规则版本变化，重建label提取计划
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "[PolarisRateLimiting] rebuild label extraction plan for %s/%s, labels count %uz",
+          plcf->service_namespace.c_str(), plcf->service_name.c_str(), service->label_plan.Size());
+
+      std::vector<RuleMatchSpec> rules;
+      if (ngx_http_polaris_limit_agent != NULL) {
+        json_rule = service->agent_rule;
+      } else if (!fetched && limit_api->FetchRule(service->service_key, 0, json_rule) != polaris::kReturnOk) {
+        json_rule.clear();
+      }
+      service->rule_version = ngx_http_polaris_limit_rule_version(json_rule);
+      service->rule_checked = ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_RULE_CHECK;
+      if (!json_rule.empty() && ParseRules(json_rule, rules)) {
+        service->rule_matcher.Build(rules, ngx_cycle->log);
+      } else {
+        service->rule_matcher.BuildMatchAll();                // 规则无法解析时不过滤
+      }
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "[PolarisRateLimiting] rebuild rule matcher for %s/%s, "
+          "rules %uz, exact %uz, prefix %uz, regex %uz, match all %d", plcf->service_namespace.c_str(), plcf->service_name.c_str(),
+          rules.size(), service->rule_matcher.ExactCount(), service->rule_matcher.PrefixCount(),
+          service->rule_matcher.RegexCount(), service->rule_matcher.MatchAll());
+    }
+
+    service->rule_matcher.MatchMethod(r->uri.data, r->uri.len, candidates);
+    if (candidates.Empty()) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] no rule matches uri %V", &r->uri);
+        return NGX_DECLINED;                                    // 没有规则匹配，不访问远端
+    }
+
+    if (service->label_plan.NeedCallerIp()) {
+        ngx_http_polaris_limit_caller_addr(r, &caller);
+        service->label_plan.Extract(r, &caller.name, labels);   // 按提取计划从http请求中获取labels
+    } else {
+        service->label_plan.Extract(r, NULL, labels);
+    }
+    if (!service->rule_matcher.MatchLabels(candidates, labels)) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] no rule matches labels of uri %V", &r->uri);
+        return NGX_DECLINED;
+    }
+    std::string uri(reinterpret_cast<char *>(r->uri.data), r->uri.len);
+
+    if (plcf->lease || plcf->npriorities || plcf->degrade_nodes) {
+        lease_key = uri;
+        lease_key += "?";
+        join_map_str(labels, lease_key);
+    }
+
+    cost = ngx_http_polaris_limit_cost(r, plcf);
+    amount = cost;
+
+    reserve = ngx_http_polaris_limit_reserve(r, plcf);
+    if (reserve && service->pressure_table.Shed(lease_key, reserve, ngx_current_msec)) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] quota under %ui%% reserved for %s",
+            reserve, lease_key.c_str());
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_LIMITED);
+        return plcf->status_code;                               // 剩余配额留给更高优先级的请求
+    }
+
+    if (plcf->degrade_nodes && service->degrade_expire
+        && static_cast<ngx_msec_int_t>(service->degrade_expire - ngx_current_msec) > 0) {
+        return ngx_http_polaris_limit_degrade(r, plcf, stat, lease_key, cost);     // 远端刚超时，暂不访问远端
+    }
+
+    if (plcf->lease) {
+        if (service->lease_table.TryAcquire(lease_key, cost, ngx_current_msec)) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] use leased quota for %s", lease_key.c_str());
+            ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_PASSED);
+            return NGX_DECLINED;                                // 本地租约内放行，不访问远端
+        }
+        amount = service->lease_table.NextLeaseSize(lease_key, plcf->lease) + cost - 1;  // 租约之外再加上当前请求的代价
+    }
+
+    if (r->connection->log->log_level >= NGX_LOG_DEBUG) {
+      std::string labels_values_str;
+      join_map_str(labels, labels_values_str);
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+          "[PolarisRateLimiting] quota_request namespace %s, service %s, method %s, labels %s, cost %L", plcf->service_namespace.c_str(), plcf->service_name.c_str(), uri.c_str(), labels_values_str.c_str(), cost);
+    }
+
+    if (ngx_http_polaris_limit_agent != NULL) {
+        agent_call = new LimitAgentQuotaCall();
+        agent_call->service_namespace = plcf->service_namespace;
+        agent_call->service_name = plcf->service_name;
+        agent_call->method = uri;
+        agent_call->labels.swap(labels);
+        agent_call->cost = cost;
+        agent_call->timeout = plcf->timeout ? plcf->timeout : NGX_HTTP_POLARIS_LIMIT_DEFAULT_TIMEOUT;
+        agent_call->with_info = ngx_http_polaris_limit_with_info(plcf);
+    } else {
+        quota_request = new polaris::QuotaRequest();
+        quota_request->SetServiceNamespace(plcf->service_namespace);      // 设置限流规则对应服务的命名空间
+        quota_request->SetServiceName(plcf->service_name);                // 设置限流规则对应的服务名
+        quota_request->SetMethod(uri);
+        quota_request->SetLabels(labels);                       // 设置label用于匹配限流规则
+        if (plcf->timeout) {
+            quota_request->SetTimeout(plcf->timeout);           // 本location的时间预算
+        }
+        if (amount > 1) {
+            quota_request->SetAcquireAmount(static_cast<int>(amount));   // 按请求代价获取或批量租用配额
+        }
+    }
+
+#if (NGX_THREADS)
+    if (plcf->async) {
+        return ngx_http_polaris_limit_post_task(r, plcf, limit_api, quota_request, agent_call, lease_key, amount, cost);
+    }
+#endif
+
+    if (agent_call != NULL) {
+        ret = ngx_http_polaris_limit_agent_get_quota(*agent_call, amount, result, info, stat);
+        delete agent_call;
+    } else {
+        ret = ngx_http_polaris_limit_get_quota(limit_api, *quota_request, amount, cost, result, info,
+            ngx_http_polaris_limit_with_info(plcf), stat);
+        delete quota_request;
+    }
+    if (!lease_key.empty()) {
+        ngx_http_polaris_limit_quota_update(plcf, lease_key, ret, result, amount, cost, info);
+    }
+    if (plcf->degrade_nodes && ret == polaris::kReturnTimeout) {
+        return ngx_http_polaris_limit_degrade(r, plcf, stat, lease_key, cost);
+    }
+    return ngx_http_polaris_limit_quota_decision(r, plcf, stat, ret, result, info);
+}
+
+/* 排队、按优先级保留、降级和批量租用都需要规则配额信息，第一次获取配额时就要返回，否则租约无法开始 */
+static ngx_flag_t ngx_http_polaris_limit_with_info(ngx_http_polaris_limit_conf_t *plcf) {
+    return plcf->delay != 0 || plcf->npriorities != 0 || plcf->degrade_nodes != 0 || plcf->lease != 0;
+}
+
+/* 获取配额，批量租用被拒绝时退回只获取当前请求的cost个配额，amount返回实际获得的数量
+   with_info或批量租用时通过info返回规则配额信息 */
+static polaris::ReturnCode ngx_http_polaris_limit_get_quota(polaris::LimitApi *limit_api, polaris::QuotaRequest& quota_request,
+    int64_t& amount, int64_t cost, polaris::QuotaResultCode& result, polaris::QuotaResultInfo& info, ngx_flag_t with_info,
+    ngx_polaris_limit_stat_t *stat) {
+    polaris::QuotaResponse             *response = NULL;
+    polaris::ReturnCode                 ret;
+    uint64_t                            start = ngx_polaris_limit_stat_now_us();
+
+    if (amount <= cost && !with_info) {
+        ret = limit_api->GetQuota(quota_request, result);
+        ngx_polaris_limit_stat_latency(stat, quota_latency, start);
+        return ret;
+    }
+
+    ret = limit_api->GetQuota(quota_request, response);
+    if (ret == polaris::kReturnOk) {
+        result = response->GetResultCode();
+        info = response->GetQuotaResultInfo();
+    }
+    delete response;
+
+    if (ret == polaris::kReturnOk && result == polaris::kQuotaResultLimited && amount > cost) {
+        amount = cost;                                          // 剩余配额不足一批，只为当前请求获取
+        quota_request.SetAcquireAmount(static_cast<int>(cost));
+        ret = limit_api->GetQuota(quota_request, result);
+    }
+    ngx_polaris_limit_stat_latency(stat, quota_latency, start);
+    return ret;
+}
+
+/* 在事件循环中根据远端结果更新租约和剩余配额 */
+static void ngx_http_polaris_limit_quota_update(ngx_http_polaris_limit_conf_t *plcf, const std::string& quota_key,
+    polaris::ReturnCode ret, polaris::QuotaResultCode result, int64_t amount, int64_t cost, const polaris::QuotaResultInfo& info) {
+    QuotaLeaseTable& lease_table = plcf->service->lease_table;
+
+    if (plcf->npriorities && ret == polaris::kReturnOk) {
+        plcf->service->pressure_table.Update(quota_key, result, info, ngx_current_msec);
+    }
+
+    if (plcf->degrade_nodes) {
+        if (ret == polaris::kReturnTimeout) {
+            plcf->service->degrade_expire = ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_DEGRADE_RETRY;
+        } else if (ret == polaris::kReturnOk) {
+            plcf->service->degrade_expire = 0;                  // 远端恢复，回到全局限流
+            plcf->service->degrade_table.Update(quota_key, info);
+        }
+    }
+
+    if (!plcf->lease) {
+        return;
+    }
+    if (ret != polaris::kReturnOk || result == polaris::kQuotaResultLimited) {
+        lease_table.Revoke(quota_key);
+        return;
+    }
+    lease_table.Grant(quota_key, amount, cost, plcf->lease, info, ngx_current_msec);
+}
+
+/* 通过主机代理获取配额，代理中按ngx_http_polaris_limit_get_quota处理，可以在线程中调用 */
+static polaris::ReturnCode ngx_http_polaris_limit_agent_get_quota(LimitAgentQuotaCall& call, int64_t& amount,
+    polaris::QuotaResultCode& result, polaris::QuotaResultInfo& info, ngx_polaris_limit_stat_t *stat) {
+    LimitAgentQuotaReply                reply = LimitAgentQuotaReply();
+    polaris::ReturnCode                 ret;
+    uint64_t                            start = ngx_polaris_limit_stat_now_us();
+
+    call.amount = amount;
+    ret = ngx_polaris_limit_agent_get_quota(ngx_http_polaris_limit_agent, call, reply);
+    ngx_polaris_limit_stat_latency(stat, quota_latency, start);
+    if (ret == polaris::kReturnOk) {
+        result = reply.result;
+        info = reply.info;
+        amount = reply.amount;
+    }
+    return ret;
+}
+
+/* 读取代理发布的规则，版本变化时替换label keys，返回NGX_AGAIN表示代理还没有发布过规则 */
+static ngx_int_t ngx_http_polaris_limit_agent_refresh(LimitServiceContext *service) {
+    std::set<std::string>              *label_keys;
+    std::string                         keys;
+    std::string                         rule;
+    size_t                              pos;
+    size_t                              next;
+
+    if (ngx_polaris_limit_agent_read_rule(ngx_http_polaris_limit_agent, service->stat_index, service->service_key,
+                                          service->agent_version, keys, rule) != NGX_OK) {
+        return service->agent_label_keys ? NGX_OK : NGX_AGAIN;
+    }
+
+    label_keys = new std::set<std::string>();
+    for (pos = 0; pos < keys.size(); pos = next + 1) {
+        next = keys.find('\n', pos);
+        if (next == std::string::npos) {
+            next = keys.size();
+        }
+        if (next > pos) {
+            label_keys->insert(keys.substr(pos, next - pos));
+        }
+    }
+    delete service->agent_label_keys;                           // 新集合先分配，地址不会与旧集合相同
+    service->agent_label_keys = label_keys;
+    service->agent_rule.swap(rule);
+    return NGX_OK;
+}
+
+/* 在代理线程中执行，使用代理worker的LimitApi */
+static void ngx_http_polaris_limit_agent_quota(LimitAgentQuotaCall& call, LimitAgentQuotaReply& reply) {
+    polaris::LimitApi                  *limit_api = Limit_API_SINGLETON.GetLimitApi();
+    polaris::QuotaRequest               quota_request;
+
+    if (limit_api == NULL) {
+        reply.ret = polaris::kReturnTimeout;                    // 与worker内LimitApi未就绪时一样放通
+        return;
+    }
+
+    quota_request.SetServiceNamespace(call.service_namespace);
+    quota_request.SetServiceName(call.service_name);
+    quota_request.SetMethod(call.method);
+    quota_request.SetLabels(call.labels);
+    quota_request.SetTimeout(call.timeout);
+    if (call.amount > 1) {
+        quota_request.SetAcquireAmount(static_cast<int>(call.amount));
+    }
+    reply.amount = call.amount;
+    reply.ret = ngx_http_polaris_limit_get_quota(limit_api, quota_request, reply.amount, call.cost, reply.result, reply.info,
+        call.with_info, NULL);
+}
+
+/* 在代理线程中执行，只查本地缓存，规则未加载时由SDK在后台拉取，下个发布周期再检查
+   label keys的指针在规则版本变化时改变，用作发布的版本 */
+static bool ngx_http_polaris_limit_agent_rule(ngx_uint_t index, std::string& name, const void*& version,
+    std::string& label_keys, std::string& rule) {
+    polaris::LimitApi                  *limit_api = Limit_API_SINGLETON.GetLimitApi();
+    LimitServiceContext                *service = NULL;
+    const std::set<std::string>        *keys;
+
+    if (limit_api == NULL) {
+        return false;
+    }
+
+    const std::map<std::string, LimitServiceContext*>& services = LimitServiceRegistry::Instance().Services();
+    for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+        if (it->second->stat_index == index) {
+            service = it->second;
+            name = it->first;
+            break;
+        }
+    }
+    if (service == NULL || limit_api->FetchRuleLabelKeys(service->service_key, 0, keys) != polaris::kReturnOk) {
+        return false;
+    }
+
+    version = keys;
+    label_keys.clear();
+    for (std::set<std::string>::const_iterator it = keys->begin(); it != keys->end(); ++it) {
+        label_keys += *it;
+        label_keys += '\n';
+    }
+    if (limit_api->FetchRule(service->service_key, 0, rule) != polaris::kReturnOk) {
+        rule.clear();
+    }
+    return true;
+}
+
+/* 按heavy_key统计流量份额，份额过高的key返回NGX_BUSY，key为空时不统计 */
+static ngx_int_t ngx_http_polaris_limit_heavy(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_str_t                           key;
+    ngx_flag_t                          first;
+    ngx_int_t                           rc;
+
+    if (ngx_http_complex_value(r, plcf->heavy_key, &key) != NGX_OK || key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_polaris_limit_heavy_check(reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(plcf->shm_zone->data), plcf->salt,
+        key.data, key.len, plcf->heavy_share, &first);
+    if (first) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0, "[PolarisRateLimiting] heavy hitter \"%V\" over %ui%% of traffic, throttled",
+            &key, plcf->heavy_share);
+    } else if (rc == NGX_BUSY) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] heavy hitter %V throttled", &key);
+    }
+    return rc;
+}
+
+/* 远端不可达时按最近一次的规则配额除以节点数，在共享内存中按本机份额限流，
+   从未获取到规则配额时按fail=处理 */
+static ngx_int_t ngx_http_polaris_limit_degrade(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, const std::string& quota_key, int64_t cost) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_polaris_limit_shm_ctx_t        *shm_ctx;
+    ngx_polaris_limit_gcra_t            gcra;
+    ngx_polaris_limit_result_t          result;
+    int64_t                             all_quota;
+    int64_t                             share;
+    uint64_t                            duration;
+    uint64_t                            hash;
+
+    if (!plcf->service->degrade_table.Get(quota_key, all_quota, duration)) {
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_TIMEOUT);
+        return ngx_http_polaris_limit_failure(plcf, NGX_DECLINED);
+    }
+
+    share = all_quota / static_cast<int64_t>(plcf->degrade_nodes);
+    gcra.rate = static_cast<ngx_uint_t>(all_quota * 1000000 / static_cast<int64_t>(duration * plcf->degrade_nodes));
+    if (gcra.rate == 0) {
+        gcra.rate = 1;
+    }
+    gcra.burst = share > 1 ? static_cast<ngx_uint_t>(share - 1) : 0;     // 本机份额可在一个规则周期内集中使用
+
+    shm_ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(plcf->shm_zone->data);
+    hash = ngx_polaris_limit_hash_key(plcf->salt, reinterpret_cast<u_char *>(const_cast<char *>(quota_key.data())),
+        quota_key.size());
+    ngx_polaris_limit_gcra_acquire(shm_ctx, hash, &gcra, static_cast<ngx_uint_t>(cost), 0, 0, &result);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] degrade %s to local share %L of %L, limited %ui",
+        quota_key.c_str(), share, all_quota, result.limited);
+
+    ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_DEGRADED);
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->remaining = result.remaining;
+    ctx->retry_after = result.retry_after;
+
+    if (result.limited) {
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_LIMITED);
+        if (ngx_http_polaris_limit_set_retry_after(r, result.retry_after) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ctx->quota_limited = 1;
+        return plcf->status_code;
+    }
+    ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_PASSED);
+    return NGX_DECLINED;
+}
+
+/* 请求所在优先级不能使用的配额百分比，priority=的值不是数字时按最高优先级处理 */
+static ngx_uint_t ngx_http_polaris_limit_reserve(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_str_t                           value;
+    ngx_int_t                           tier;
+
+    if (plcf->npriorities == 0 || ngx_http_complex_value(r, plcf->priority, &value) != NGX_OK) {
+        return 0;
+    }
+
+    tier = ngx_atoi(value.data, value.len);
+    if (tier == NGX_ERROR) {
+        return 0;
+    }
+    if (static_cast<ngx_uint_t>(tier) >= plcf->npriorities) {
+        tier = plcf->npriorities - 1;                           // 超出配置的优先级按最低优先级处理
+    }
+    return plcf->reserve[tier];
+}
+
+/* 请求消耗的配额数，未配置cost=或值不是正整数时为1 */
+static int64_t ngx_http_polaris_limit_cost(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_str_t                           value;
+    ngx_int_t                           cost;
+
+    if (plcf->cost == NULL || ngx_http_complex_value(r, plcf->cost, &value) != NGX_OK) {
+        return 1;
+    }
+
+    cost = ngx_atoi(value.data, value.len);
+    if (cost == NGX_ERROR || cost == 0) {
+        return 1;
+    }
+    if (cost > NGX_HTTP_POLARIS_LIMIT_MAX_COST) {
+        cost = NGX_HTTP_POLARIS_LIMIT_MAX_COST;
+    }
+    return cost;
+}
+
+static ngx_int_t ngx_http_polaris_limit_quota_decision(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, polaris::ReturnCode ret, polaris::QuotaResultCode result, const polaris::QuotaResultInfo& info) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] GetQuota return is: %d", ret);
+    if (ret == polaris::kReturnTimeout) {
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_TIMEOUT);
+        return ngx_http_polaris_limit_failure(plcf, NGX_DECLINED);          // GetQuota超时，默认不限流
+    } else if (ret != polaris::kReturnOk) {
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_ERROR);
+        return ngx_http_polaris_limit_failure(plcf, plcf->status_code);     // 默认返回为限流配置的状态码
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] result is: %d", result);
+    if (result == polaris::kQuotaResultLimited) {
+        if (plcf->delay) {
+            ngx_int_t rc = ngx_http_polaris_limit_delay(r, plcf, stat, info);
+            if (rc != NGX_DECLINED) {
+                return rc == NGX_AGAIN ? NGX_AGAIN : NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_LIMITED);
+        ngx_http_polaris_limit_ctx_t *ctx = ngx_http_polaris_limit_get_ctx(r);
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ctx->quota_limited = 1;
+        return plcf->status_code;   // 请求被限制
+    }
+    ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_PASSED);
+    return NGX_DECLINED;
+}
+
+/* 远端配额不足时按规则中每个配额的平均间隔排队后重新获取，超过delay=或队列已满时返回NGX_DECLINED */
+static ngx_int_t ngx_http_polaris_limit_delay(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat, const polaris::QuotaResultInfo& info) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_msec_t                          waited;
+    ngx_msec_t                          step = NGX_HTTP_POLARIS_LIMIT_DELAY_STEP;
+
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ctx->delay_state == NGX_HTTP_POLARIS_LIMIT_DELAY_NONE) {
+        ctx->delay_start = ngx_current_msec;
+    }
+    waited = ngx_current_msec - ctx->delay_start;
+    if (waited >= plcf->delay) {
+        return NGX_DECLINED;
+    }
+
+    if (info.all_quota_ > 0 && info.duration_ > 0) {
+        step = static_cast<ngx_msec_t>((info.duration_ + info.all_quota_ - 1) / info.all_quota_);
+    }
+    step = ngx_max(step, 1);
+    step = ngx_min(step, plcf->delay - waited);
+
+    return ngx_http_polaris_limit_park(r, plcf, ctx, stat, step, 0);
+}
+
+/* 与limit_req一致，在写事件定时器上挂起请求，到期后重新运行phase */
+static ngx_int_t ngx_http_polaris_limit_park(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_http_polaris_limit_ctx_t *ctx, ngx_polaris_limit_stat_t *stat, ngx_msec_t delay, ngx_flag_t reserved) {
+    ngx_pool_cleanup_t                 *cln;
+
+    if (plcf->delayed >= plcf->queue) {
+        return NGX_DECLINED;                                    // 队列已满
+    }
+
+    if (ctx->delay_conf == NULL) {
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+        cln->handler = ngx_http_polaris_limit_delay_cleanup;   // 排队中请求被终止时归还队列位置
+        cln->data = ctx;
+    }
+
+    if (ctx->delay_state == NGX_HTTP_POLARIS_LIMIT_DELAY_NONE) {
+        ngx_polaris_limit_stat_count(stat, NGX_POLARIS_LIMIT_STAT_DELAYED);
+    }
+
+    ctx->delay_conf = plcf;
+    ctx->delay_state = NGX_HTTP_POLARIS_LIMIT_DELAY_PARKED;
+    ctx->delay_reserved = reserved;
+    ctx->async_state = NGX_HTTP_POLARIS_LIMIT_ASYNC_NONE;      // 唤醒后重新获取配额
+    plcf->delayed++;
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] delay request %M ms, queue %ui",
+        delay, plcf->delayed);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_polaris_limit_delay_handler;
+    r->connection->write->delayed = 1;
+    ngx_add_timer(r->connection->write, delay);
+    return NGX_AGAIN;
+}
+
+static void ngx_http_polaris_limit_delay_handler(ngx_http_request_t *r) {
+    ngx_event_t                        *wev;
+
+    wev = r->connection->write;
+    if (wev->delayed) {
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        }
+        return;
+    }
+
+    if (ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ngx_http_polaris_limit_delay_cleanup(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(r);
+}
+
+static void ngx_http_polaris_limit_delay_cleanup(void *data) {
+    ngx_http_polaris_limit_ctx_t       *ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(data);
+
+    if (ctx->delay_state == NGX_HTTP_POLARIS_LIMIT_DELAY_PARKED) {
+        ctx->delay_conf->delayed--;
+        ctx->delay_state = NGX_HTTP_POLARIS_LIMIT_DELAY_WOKEN;
+    }
+}
+
+/* 当前worker上该location所属服务的统计，未创建统计共享内存时返回NULL */
+static ngx_polaris_limit_stat_t *ngx_http_polaris_limit_stat(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_http_polaris_limit_module));
+    if (lmcf->stat_zone == NULL) {
+        return NULL;
+    }
+    return ngx_polaris_limit_stat_get(reinterpret_cast<ngx_polaris_limit_stat_ctx_t *>(lmcf->stat_zone->data),
+        plcf->service->stat_index);
+}
+
+/* 调用SDK出错时按fail=配置放通或拒绝，未配置时保持原有行为 */
+static ngx_int_t ngx_http_polaris_limit_failure(ngx_http_polaris_limit_conf_t *plcf, ngx_int_t legacy_rc) {
+    switch (plcf->fail) {
+    case NGX_HTTP_POLARIS_LIMIT_FAIL_OPEN:
+        return NGX_DECLINED;
+    case NGX_HTTP_POLARIS_LIMIT_FAIL_CLOSED:
+        return plcf->status_code;
+    default:
+        return legacy_rc;
+    }
+}
+
+static ngx_http_polaris_limit_ctx_t *ngx_http_polaris_limit_get_ctx(ngx_http_request_t *r) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+
+    ngx_pool_cleanup_t                 *cln;
+
+    ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+    if (ctx == NULL) {
+        ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_pcalloc(r->pool, sizeof(ngx_http_polaris_limit_ctx_t)));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ctx->remaining = -1;
+
+        // 内部跳转会清空模块ctx，通过请求内存池上的cleanup找回，子请求与主请求共用内存池
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+        cln->handler = ngx_http_polaris_limit_ctx_cleanup;
+        cln->data = ctx;
+
+        ngx_http_set_ctx(r, ctx, ngx_http_polaris_limit_module);
+    }
+    return ctx;
+}
+
+/* 与realip模块找回ctx的方式一致，只读取判断结果，不恢复其他状态 */
+static ngx_flag_t ngx_http_polaris_limit_decided(ngx_http_request_t *r) {
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_polaris_limit_ctx_t       *ctx;
+
+    ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+    if (ctx != NULL) {
+        return ctx->decided;
+    }
+
+    if (!r->internal && r == r->main) {
+        return 0;                                               // 第一次进入，不需要查找
+    }
+
+    for (cln = r->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_polaris_limit_ctx_cleanup) {
+            ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(cln->data);
+            if (ctx->decided) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void ngx_http_polaris_limit_ctx_cleanup(void *data) {
+    // 只用于标记ctx，内存随请求内存池释放
+}
+
+#if (NGX_THREADS)
+
+/* 将拉取规则或获取配额投递到线程池，挂起请求直到线程返回 */
+static ngx_int_t ngx_http_polaris_limit_post_task(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    polaris::LimitApi *limit_api, polaris::QuotaRequest *quota_request, LimitAgentQuotaCall *agent_call,
+    const std::string& lease_key, int64_t amount, int64_t cost) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_http_polaris_limit_task_ctx_t  *tctx;
+    ngx_thread_task_t                  *task;
+
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (ctx == NULL) {
+        delete quota_request;
+        delete agent_call;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    task = ctx->task;
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_polaris_limit_task_ctx_t));
+        if (task == NULL) {
+            delete quota_request;
+            delete agent_call;
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        task->handler = ngx_http_polaris_limit_thread_handler;
+        ctx->task = task;
+    }
+
+    tctx = reinterpret_cast<ngx_http_polaris_limit_task_ctx_t *>(task->ctx);
+    tctx->limit_api = limit_api;
+    tctx->service = plcf->service;
+    tctx->quota_request = quota_request;
+    tctx->agent_call = agent_call;
+    tctx->timeout = plcf->timeout ? plcf->timeout : NGX_HTTP_POLARIS_LIMIT_DEFAULT_TIMEOUT;
+    tctx->amount = amount;
+    tctx->cost = cost;
+    tctx->stat = ngx_http_polaris_limit_stat(r, plcf);
+    tctx->with_info = ngx_http_polaris_limit_with_info(plcf);
+
+    if (!lease_key.empty()) {
+        ctx->lease_key.len = lease_key.size();
+        ctx->lease_key.data = reinterpret_cast<u_char *>(ngx_pnalloc(r->pool, lease_key.size()));
+        if (ctx->lease_key.data == NULL) {
+            delete quota_request;
+            delete agent_call;
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_memcpy(ctx->lease_key.data, lease_key.data(), lease_key.size());
+    }
+    ctx->cost = cost;
+
+    task->event.data = r;
+    task->event.handler = ngx_http_polaris_limit_thread_event_handler;
+
+    if (ngx_thread_task_post(plcf->thread_pool, task) != NGX_OK) {
+        // 线程池队列已满，与超时同样处理
+        delete quota_request;
+        delete agent_call;
+        ngx_polaris_limit_stat_count(tctx->stat, NGX_POLARIS_LIMIT_STAT_ERROR);
+        return ngx_http_polaris_limit_failure(plcf, NGX_DECLINED);
+    }
+
+    ctx->async_state = (quota_request || agent_call) ? NGX_HTTP_POLARIS_LIMIT_ASYNC_QUOTA : NGX_HTTP_POLARIS_LIMIT_ASYNC_FETCH;
+    r->main->blocked++;
+    r->aio = 1;
+    return NGX_AGAIN;
+}
+
+/* 在线程池中执行，可以阻塞等待SDK返回 */
+static void ngx_http_polaris_limit_thread_handler(void *data, ngx_log_t *log) {
+    ngx_http_polaris_limit_task_ctx_t  *tctx = reinterpret_cast<ngx_http_polaris_limit_task_ctx_t *>(data);
+    const std::set<std::string>        *label_keys;
+    uint64_t                            start;
+
+    if (tctx->agent_call != NULL) {
+        tctx->ret = ngx_http_polaris_limit_agent_get_quota(*tctx->agent_call, tctx->amount, tctx->result, tctx->info, tctx->stat);
+        return;
+    }
+    if (tctx->quota_request == NULL) {
+        start = ngx_polaris_limit_stat_now_us();
+        tctx->ret = tctx->limit_api->FetchRuleLabelKeys(tctx->service->service_key, tctx->timeout, label_keys);
+        ngx_polaris_limit_stat_latency(tctx->stat, rule_latency, start);
+        return;
+    }
+    tctx->ret = ngx_http_polaris_limit_get_quota(tctx->limit_api, *tctx->quota_request, tctx->amount, tctx->cost, tctx->result, tctx->info,
+        tctx->with_info, tctx->stat);
+}
+
+/* 线程返回后在事件循环中执行，保存结果并重新运行phase */
+static void ngx_http_polaris_limit_thread_event_handler(ngx_event_t *ev) {
+    ngx_http_request_t                 *r;
+    ngx_connection_t                   *c;
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_http_polaris_limit_task_ctx_t  *tctx;
+
+    r = reinterpret_cast<ngx_http_request_t *>(ev->data);
+    c = r->connection;
+    ngx_http_set_log_request(c->log, r);
+
+    ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+    tctx = reinterpret_cast<ngx_http_polaris_limit_task_ctx_t *>(ctx->task->ctx);
+
+    ctx->async_ret = tctx->ret;
+    ctx->async_result = tctx->result;
+    ctx->lease_amount = tctx->amount;
+    ctx->lease_info = tctx->info;
+    if (tctx->quota_request != NULL || tctx->agent_call != NULL) {
+        ctx->async_state = NGX_HTTP_POLARIS_LIMIT_ASYNC_QUOTA_DONE;
+        delete tctx->quota_request;
+        delete tctx->agent_call;
+        tctx->quota_request = NULL;
+        tctx->agent_call = NULL;
+    } else {
+        ctx->async_state = NGX_HTTP_POLARIS_LIMIT_ASYNC_FETCH_DONE;
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, c->log, 0, "[PolarisRateLimiting] async task done, state %ui, return %d",
+        ctx->async_state, ctx->async_ret);
+
+    r->main->blocked--;
+    r->aio = 0;
+    r->write_event_handler(r);          // 连接已出错时为ngx_http_request_finalizer
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+/* 本地限流，使用共享内存中的GCRA桶，所有worker共享配额 */
+static ngx_int_t ngx_http_polaris_limit_local_handler(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf,
+    ngx_polaris_limit_stat_t *stat) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_polaris_limit_shm_ctx_t        *shm_ctx;
+    ngx_polaris_limit_result_t          result;
+    ngx_str_t                           key;
+    ngx_str_t                           tenant;
+    uint64_t                            hash;
+    ngx_msec_t                          max_delay;
+    ngx_uint_t                          reserve;
+    ngx_uint_t                          cost;
+
+    ngx_str_null(&key);
+    if (plcf->key != NULL && ngx_http_complex_value(r, plcf->key, &key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_str_null(&tenant);
+    if (plcf->tenant != NULL && ngx_http_complex_value(r, plcf->tenant, &tenant) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    shm_ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(plcf->shm_zone->data);
+    hash = ngx_polaris_limit_hash_key(plcf->salt, key.data, key.len);
+    max_delay = plcf->delayed < plcf->queue ? plcf->delay : 0;    // 队列已满时不再预占之后的配额
+    reserve = ngx_http_polaris_limit_reserve(r, plcf);
+    cost = static_cast<ngx_uint_t>(ngx_http_polaris_limit_cost(r, plcf));
+    if (tenant.len) {
+        // 租户桶的key在全局桶的key下再区分租户，同一租户在不同key下分别计算份额
+        ngx_polaris_limit_tree_acquire(shm_ctx, hash, &plcf->gcra, ngx_polaris_limit_hash_key(hash, tenant.data, tenant.len),
+            &plcf->tenant_gcra, cost, reserve, plcf->tenant_borrow, max_delay, &result);
+    } else {
+        ngx_polaris_limit_gcra_acquire(shm_ctx, hash, &plcf->gcra, cost, reserve, max_delay, &result);
+    }
+
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ctx->remaining = result.remaining;
+    ctx->retry_after = result.retry_after;
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] local limit key \"%V\" cost %ui limited %ui, remaining %ui, retry after %M",
+        &key, cost, result.limited, result.remaining, result.retry_after);
+
+    if (result.limited) {
+        if (ngx_http_polaris_limit_set_retry_after(r, result.retry_after) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ctx->quota_limited = 1;
+        return plcf->status_code;   // 请求被限制
+    }
+
+    if (result.delay) {
+        if (ngx_http_polaris_limit_park(r, plcf, ctx, stat, result.delay, 1) != NGX_AGAIN) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        return NGX_AGAIN;                                       // 已预占配额，等待轮到后放行
+    }
+    return NGX_DECLINED;
+}
+
+/* 请求从接收到进入PREACCESS的排队时间，连接上的第一个请求从accept开始计算，事件循环延迟较大时以延迟为准。
+   读请求头和进入PREACCESS在同一轮事件中完成，ngx_current_msec在一轮内不变，只能以请求创建或accept为起点 */
+static ngx_msec_t ngx_http_polaris_limit_sojourn(ngx_http_request_t *r) {
+    ngx_time_t                         *tp;
+    ngx_msec_int_t                      ms;
+    ngx_msec_t                          sojourn = 0;
+
+    tp = ngx_timeofday();
+    ms = static_cast<ngx_msec_int_t>((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    if (ms > 0) {
+        sojourn = static_cast<ngx_msec_t>(ms);
+    }
+
+    if (r->connection->requests == 1 && ngx_current_msec - r->connection->start_time > sojourn) {
+        sojourn = ngx_current_msec - r->connection->start_time;
+    }
+
+    return ngx_max(sojourn, ngx_http_polaris_limit_loop_lag);
+}
+
+/* CoDel：排队时间在一个interval内始终高于目标时开始丢弃，丢弃间隔按interval/sqrt(count)缩短 */
+static ngx_flag_t ngx_http_polaris_limit_codel_drop(ngx_http_polaris_limit_conf_t *plcf, ngx_msec_t sojourn) {
+    ngx_http_polaris_limit_codel_t     *codel = &plcf->codel;
+    ngx_msec_t                          now = ngx_current_msec;
+    ngx_flag_t                          ok_to_drop = 0;
+
+    if (sojourn < plcf->shed_target) {
+        codel->first_above_time = 0;
+    } else if (codel->first_above_time == 0) {
+        codel->first_above_time = now + plcf->shed_interval;
+    } else if (static_cast<ngx_msec_int_t>(now - codel->first_above_time) >= 0) {
+        ok_to_drop = 1;
+    }
+
+    if (codel->dropping) {
+        if (!ok_to_drop) {
+            codel->dropping = 0;
+            return 0;
+        }
+        if (static_cast<ngx_msec_int_t>(now - codel->drop_next) < 0) {
+            return 0;
+        }
+        codel->count++;
+        codel->drop_next += static_cast<ngx_msec_t>(plcf->shed_interval / sqrt(static_cast<double>(codel->count)));
+        return 1;
+    }
+
+    if (!ok_to_drop) {
+        return 0;
+    }
+
+    // 距离上一轮丢弃不久时沿用上一轮的丢弃频率
+    ngx_uint_t delta = codel->count - codel->last_count;
+    codel->count = 1;
+    if (delta > 1 && now - codel->drop_next < 16 * plcf->shed_interval) {
+        codel->count = delta;
+    }
+    codel->last_count = codel->count;
+    codel->dropping = 1;
+    codel->drop_next = now + static_cast<ngx_msec_t>(plcf->shed_interval / sqrt(static_cast<double>(codel->count)));
+    return 1;
+}
+
+/* 定时器到期的延迟即为事件循环被阻塞的时间 */
+static void ngx_http_polaris_limit_lag_handler(ngx_event_t *ev) {
+    ngx_msec_t                          expected = reinterpret_cast<uintptr_t>(ev->data);
+
+    if (ngx_exiting) {
+        return;
+    }
+    ngx_http_polaris_limit_loop_lag = ngx_current_msec > expected ? ngx_current_msec - expected : 0;
+    ev->data = reinterpret_cast<void *>(static_cast<uintptr_t>(ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_LAG_INTERVAL));
+    ngx_add_timer(ev, NGX_HTTP_POLARIS_LIMIT_LAG_INTERVAL);
+}
+
+/* 并发限流，在共享内存槽中计数正在处理的请求，请求结束时按上游耗时调整上限 */
+static ngx_int_t ngx_http_polaris_limit_concurrency_handler(ngx_http_request_t *r, ngx_http_polaris_limit_conf_t *plcf) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    ngx_http_polaris_limit_inflight_t  *inflight;
+    ngx_polaris_limit_concurrency_t    *slot = NULL;
+    ngx_polaris_limit_shm_ctx_t        *shm_ctx;
+    ngx_polaris_limit_result_t          result;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_str_t                           key;
+    ngx_int_t                           rc;
+    ngx_uint_t                          reserve;
+
+    ngx_str_null(&key);
+    if (plcf->key != NULL && ngx_http_complex_value(r, plcf->key, &key) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_polaris_limit_inflight_t));
+    ctx = ngx_http_polaris_limit_get_ctx(r);
+    if (cln == NULL || ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    reserve = ngx_http_polaris_limit_reserve(r, plcf);
+    shm_ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(plcf->shm_zone->data);
+    rc = ngx_polaris_limit_concurrency_acquire(shm_ctx, ngx_polaris_limit_hash_key(plcf->salt, key.data, key.len),
+        &plcf->concurrency, reserve, &slot, &result);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] concurrency key \"%V\" acquire %i, remaining %ui",
+        &key, rc, result.remaining);
+
+    if (rc == NGX_BUSY) {
+        ctx->remaining = 0;
+        return plcf->status_code;   // 请求被限制
+    }
+    if (rc == NGX_DECLINED) {
+        return NGX_DECLINED;                                    // 没有可用的槽，不限制
+    }
+
+    ctx->remaining = result.remaining;
+    inflight = reinterpret_cast<ngx_http_polaris_limit_inflight_t *>(cln->data);
+    inflight->request = r;
+    inflight->slot = slot;
+    inflight->conf = &plcf->concurrency;
+    inflight->start = ngx_polaris_limit_stat_now_us();
+    cln->handler = ngx_http_polaris_limit_concurrency_cleanup;
+    return NGX_DECLINED;
+}
+
+/* 优先使用上游响应耗时，没有访问上游时使用请求处理耗时 */
+static void ngx_http_polaris_limit_concurrency_cleanup(void *data) {
+    ngx_http_polaris_limit_inflight_t  *inflight = reinterpret_cast<ngx_http_polaris_limit_inflight_t *>(data);
+    ngx_http_request_t                 *r = inflight->request;
+    ngx_http_upstream_state_t          *state;
+    ngx_uint_t                          i;
+    uint64_t                            rtt = 0;
+    ngx_flag_t                          upstream = 0;
+
+    if (r->upstream_states != NULL) {
+        state = reinterpret_cast<ngx_http_upstream_state_t *>(r->upstream_states->elts);
+        for (i = 0; i < r->upstream_states->nelts; i++) {
+            if (state[i].peer != NULL && state[i].response_time != static_cast<ngx_msec_t>(-1)) {
+                rtt += static_cast<uint64_t>(state[i].response_time) * 1000;
+                upstream = 1;
+            }
+        }
+    }
+
+    if (!upstream) {
+        rtt = ngx_polaris_limit_stat_now_us() - inflight->start;
+    }
+
+    ngx_polaris_limit_concurrency_release(inflight->slot, inflight->conf, rtt);
+}
+
+/*
+ * 获取调用方地址，只使用连接地址。经过代理时由realip模块(set_real_ip_from)校验可信代理后改写连接地址，
+ * 不直接解析X-Forwarded-For，否则客户端可以伪造放行名单中的地址
+ */
+static void ngx_http_polaris_limit_caller_addr(ngx_http_request_t *r, ngx_addr_t *addr) {
+    ngx_connection_t                   *c = r->connection;
+
+    addr->sockaddr = c->sockaddr;
+    addr->socklen = c->socklen;
+    addr->name = c->addr_text;
+}
+
+static uintptr_t ngx_http_polaris_limit_acl_find(ngx_http_polaris_limit_conf_t *plcf, struct sockaddr *sockaddr) {
+    struct sockaddr_in                 *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                *sin6;
+    u_char                             *p;
+    in_addr_t                           inaddr;
+#endif
+
+    switch (sockaddr->sa_family) {
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = reinterpret_cast<struct sockaddr_in6 *>(sockaddr);
+        p = sin6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            if (plcf->acl == NULL) {
+                return NGX_RADIX_NO_VALUE;
+            }
+            inaddr = static_cast<in_addr_t>(p[12]) << 24;
+            inaddr += p[13] << 16;
+            inaddr += p[14] << 8;
+            inaddr += p[15];
+            return ngx_radix32tree_find(plcf->acl, inaddr);
+        }
+        return plcf->acl6 ? ngx_radix128tree_find(plcf->acl6, p) : NGX_RADIX_NO_VALUE;
+#endif
+    case AF_INET:
+        sin = reinterpret_cast<struct sockaddr_in *>(sockaddr);
+        return plcf->acl ? ngx_radix32tree_find(plcf->acl, ntohl(sin->sin_addr.s_addr)) : NGX_RADIX_NO_VALUE;
+    default:
+        return NGX_RADIX_NO_VALUE;
+    }
+}
+
+static ngx_int_t ngx_http_polaris_limit_set_retry_after(ngx_http_request_t *r, ngx_msec_t retry_after) {
+    ngx_table_elt_t                    *h;
+
+    h = reinterpret_cast<ngx_table_elt_t *>(ngx_list_push(&r->headers_out.headers));
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.data = reinterpret_cast<u_char *>(ngx_pnalloc(r->pool, NGX_TIME_T_LEN));
+    if (h->value.data == NULL) {
+        h->hash = 0;
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->next = NULL;
+    ngx_str_set(&h->key, "Retry-After");
+    h->value.len = ngx_sprintf(h->value.data, "%M", (retry_after + 999) / 1000) - h->value.data;
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_polaris_limit_add_variables(ngx_conf_t *cf) {
+    ngx_http_variable_t                *var, *v;
+
+    for (v = ngx_http_polaris_limit_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+    return NGX_OK;
+}
+
+/* $polaris_rate_limit_remaining 和 $polaris_rate_limit_retry_after，重试间隔单位为秒 */
+static ngx_int_t ngx_http_polaris_limit_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data) {
+    ngx_http_polaris_limit_ctx_t       *ctx;
+    u_char                             *p;
+
+    ctx = reinterpret_cast<ngx_http_polaris_limit_ctx_t *>(ngx_http_get_module_ctx(r, ngx_http_polaris_limit_module));
+    if (ctx == NULL || ctx->remaining < 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = reinterpret_cast<u_char *>(ngx_pnalloc(r->pool, NGX_INT_T_LEN));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (data == 0) {
+        v->len = ngx_sprintf(p, "%i", ctx->remaining) - p;
+    } else {
+        v->len = ngx_sprintf(p, "%M", (ctx->retry_after + 999) / 1000) - p;
+    }
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+    return NGX_OK;
+}
+
+/* 由直方图估算分位数，返回所在桶的上界，单位微秒 */
+static uint64_t ngx_http_polaris_limit_percentile(const ngx_polaris_limit_histogram_t *hist, uint64_t count, uint64_t permille) {
+    uint64_t                            target, seen = 0;
+    ngx_uint_t                          i;
+
+    if (count == 0) {
+        return 0;
+    }
+
+    target = (count * permille + 999) / 1000;
+    for (i = 0; i < NGX_POLARIS_LIMIT_STAT_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            return ngx_polaris_limit_stat_bucket_upper(i);
+        }
+    }
+    return ngx_polaris_limit_stat_bucket_upper(NGX_POLARIS_LIMIT_STAT_BUCKETS - 1);
+}
+
+static uint64_t ngx_http_polaris_limit_histogram_count(const ngx_polaris_limit_histogram_t *hist) {
+    uint64_t                            count = 0;
+    ngx_uint_t                          i;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_STAT_BUCKETS; i++) {
+        count += hist->buckets[i];
+    }
+    return count;
+}
+
+static void ngx_http_polaris_limit_append_uint(std::string& out, uint64_t n) {
+    u_char                              buf[NGX_INT64_LEN];
+
+    out.append(reinterpret_cast<char *>(buf), ngx_sprintf(buf, "%uL", n) - buf);
+}
+
+/* JSON字符串和Prometheus label值都转义反斜杠、双引号和换行。
+   JSON中其他控制字符输出为\u00XX；Prometheus只定义了这三种转义，其他字符原样输出 */
+static void ngx_http_polaris_limit_append_escaped(std::string& out, ngx_flag_t json, const std::string& s) {
+    u_char                              buf[sizeof("\\u00XX")];
+
+    for (size_t i = 0; i < s.size(); i++) {
+        u_char ch = static_cast<u_char>(s[i]);
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += static_cast<char>(ch);
+        } else if (ch == '\n') {
+            out += "\\n";
+        } else if (ch < 0x20 && json) {
+            out.append(reinterpret_cast<char *>(buf), ngx_sprintf(buf, "\\u%04xd", static_cast<unsigned int>(ch)) - buf);
+        } else {
+            out += static_cast<char>(ch);
+        }
+    }
+}
+
+static void ngx_http_polaris_limit_status_json_histogram(std::string& out, const char *name, const ngx_polaris_limit_histogram_t *hist) {
+    static const uint64_t               permilles[] = { 500, 900, 990, 999 };
+    static const char                  *names[] = { "p50", "p90", "p99", "p999" };
+    uint64_t                            count = ngx_http_polaris_limit_histogram_count(hist);
+
+    out += ",\"";
+    out += name;
+    out += "\":{\"count\":";
+    ngx_http_polaris_limit_append_uint(out, count);
+    out += ",\"sum\":";
+    ngx_http_polaris_limit_append_uint(out, hist->sum);
+    for (size_t i = 0; i < sizeof(permilles) / sizeof(permilles[0]); i++) {
+        out += ",\"";
+        out += names[i];
+        out += "\":";
+        ngx_http_polaris_limit_append_uint(out, ngx_http_polaris_limit_percentile(hist, count, permilles[i]));
+    }
+    out += "}";
+}
+
+/* 只输出2的幂边界上的累计桶，秒为单位 */
+static void ngx_http_polaris_limit_status_prometheus_histogram(std::string& out, const char *name, const std::string& labels,
+    const ngx_polaris_limit_histogram_t *hist) {
+    uint64_t                            cumulative = 0, upper;
+    ngx_uint_t                          i;
+    u_char                              buf[NGX_INT64_LEN * 2 + 2];
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_STAT_BUCKETS - 1; i++) {
+        cumulative += hist->buckets[i];
+        upper = ngx_polaris_limit_stat_bucket_upper(i) + 1;
+        if ((upper & (upper - 1)) != 0) {
+            continue;
+        }
+        out += name;
+        out += "_bucket{";
+        out += labels;
+        out += ",le=\"";
+        out.append(reinterpret_cast<char *>(buf), ngx_sprintf(buf, "%uL.%06uL", upper / 1000000, upper % 1000000) - buf);
+        out += "\"} ";
+        ngx_http_polaris_limit_append_uint(out, cumulative);
+        out += "\n";
+    }
+    cumulative += hist->buckets[NGX_POLARIS_LIMIT_STAT_BUCKETS - 1];
+
+    out += name;
+    out += "_bucket{";
+    out += labels;
+    out += ",le=\"+Inf\"} ";
+    ngx_http_polaris_limit_append_uint(out, cumulative);
+    out += "\n";
+    out += name;
+    out += "_sum{";
+    out += labels;
+    out += "} ";
+    out.append(reinterpret_cast<char *>(buf), ngx_sprintf(buf, "%uL.%06uL", hist->sum / 1000000, hist->sum % 1000000) - buf);
+    out += "\n";
+    out += name;
+    out += "_count{";
+    out += labels;
+    out += "} ";
+    ngx_http_polaris_limit_append_uint(out, cumulative);
+    out += "\n";
+}
+
+/* 汇总所有worker分片，按服务输出限流结果计数和SDK调用耗时 */
+static ngx_int_t ngx_http_polaris_limit_status_handler(ngx_http_request_t *r) {
+    static const char                  *counter_names[] = { "passed", "limited", "timeout", "error", "delayed", "shed", "degraded" };
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+    ngx_http_polaris_limit_conf_t      *plcf;
+    ngx_polaris_limit_stat_ctx_t       *stat_ctx = NULL;
+    ngx_polaris_limit_stat_t            stat;
+    ngx_uint_t                          format;
+    ngx_int_t                           rc;
+    ngx_str_t                           arg;
+    ngx_buf_t                          *b;
+    ngx_chain_t                         out;
+    std::string                         body;
+    std::string                         labels;
+    bool                                first = true;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(
+        ngx_http_get_module_loc_conf(r, ngx_http_polaris_limit_module));
+    format = plcf->status_format;
+    if (ngx_http_arg(r, reinterpret_cast<u_char *>(const_cast<char *>("format")), 6, &arg) == NGX_OK) {
+        if (arg.len == 4 && ngx_strncmp(arg.data, "json", 4) == 0) {
+            format = NGX_HTTP_POLARIS_LIMIT_STATUS_JSON;
+        } else if (arg.len == 10 && ngx_strncmp(arg.data, "prometheus", 10) == 0) {
+            format = NGX_HTTP_POLARIS_LIMIT_STATUS_PROMETHEUS;
+        } else {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_get_module_main_conf(r, ngx_http_polaris_limit_module));
+    if (lmcf->stat_zone != NULL) {
+        stat_ctx = reinterpret_cast<ngx_polaris_limit_stat_ctx_t *>(lmcf->stat_zone->data);
+    }
+
+    const std::map<std::string, LimitServiceContext*>& services = LimitServiceRegistry::Instance().Services();
+    if (format == NGX_HTTP_POLARIS_LIMIT_STATUS_PROMETHEUS) {
+        body = "# HELP polaris_rate_limiting_requests_total Requests checked by polaris rate limiting.\n"
+               "# TYPE polaris_rate_limiting_requests_total counter\n";
+        for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+            ngx_polaris_limit_stat_merge(stat_ctx, it->second->stat_index, &stat);
+            labels = "namespace=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.namespace_);
+            labels += "\",service=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.name_);
+            labels += "\"";
+            for (ngx_uint_t i = 0; i < NGX_POLARIS_LIMIT_STAT_NCOUNTERS; i++) {
+                body += "polaris_rate_limiting_requests_total{";
+                body += labels;
+                body += ",result=\"";
+                body += counter_names[i];
+                body += "\"} ";
+                ngx_http_polaris_limit_append_uint(body, stat.counters[i]);
+                body += "\n";
+            }
+        }
+        body += "# HELP polaris_rate_limiting_quota_latency_seconds Latency of polaris GetQuota calls.\n"
+                "# TYPE polaris_rate_limiting_quota_latency_seconds histogram\n";
+        for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+            ngx_polaris_limit_stat_merge(stat_ctx, it->second->stat_index, &stat);
+            labels = "namespace=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.namespace_);
+            labels += "\",service=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.name_);
+            labels += "\"";
+            ngx_http_polaris_limit_status_prometheus_histogram(body, "polaris_rate_limiting_quota_latency_seconds", labels,
+                &stat.quota_latency);
+        }
+        body += "# HELP polaris_rate_limiting_rule_latency_seconds Latency of polaris FetchRuleLabelKeys calls.\n"
+                "# TYPE polaris_rate_limiting_rule_latency_seconds histogram\n";
+        for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+            ngx_polaris_limit_stat_merge(stat_ctx, it->second->stat_index, &stat);
+            labels = "namespace=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.namespace_);
+            labels += "\",service=\"";
+            ngx_http_polaris_limit_append_escaped(labels, 0, it->second->service_key.name_);
+            labels += "\"";
+            ngx_http_polaris_limit_status_prometheus_histogram(body, "polaris_rate_limiting_rule_latency_seconds", labels,
+                &stat.rule_latency);
+        }
+        ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    } else {
+        body = "{\"services\":[";
+        for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+            ngx_polaris_limit_stat_merge(stat_ctx, it->second->stat_index, &stat);
+            body += first ? "{\"namespace\":\"" : ",{\"namespace\":\"";
+            first = false;
+            ngx_http_polaris_limit_append_escaped(body, 1, it->second->service_key.namespace_);
+            body += "\",\"service\":\"";
+            ngx_http_polaris_limit_append_escaped(body, 1, it->second->service_key.name_);
+            body += "\"";
+            for (ngx_uint_t i = 0; i < NGX_POLARIS_LIMIT_STAT_NCOUNTERS; i++) {
+                body += ",\"";
+                body += counter_names[i];
+                body += "\":";
+                ngx_http_polaris_limit_append_uint(body, stat.counters[i]);
+            }
+            ngx_http_polaris_limit_status_json_histogram(body, "quota_latency_us", &stat.quota_latency);
+            ngx_http_polaris_limit_status_json_histogram(body, "rule_latency_us", &stat.rule_latency);
+            body += "}";
+        }
+        body += "]}\n";
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = body.size();
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_create_temp_buf(r->pool, body.size());
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    b->last = ngx_cpymem(b->last, body.data(), body.size());
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+    return ngx_http_output_filter(r, &out);
+}
+
+static void join_map_str(const std::map<std::string, std::string>& labels, std::string& labels_str) {
+  for (std::map<std::string, std::string>::const_iterator it = labels.begin(); it != labels.end(); it++) {
+    labels_str += it->first;
+    labels_str += "=";
+    labels_str += it->second;
+    labels_str += ",";
+  }
+}
+
+bool string2bool(const std::string & v) {
+    return !v.empty () && (strcasecmp (v.c_str (), "true") == 0 || atoi (v.c_str ()) != 0);
+}
+
+ngx_polaris_limit_agent_ctx_t *ngx_http_polaris_limit_get_agent() {
+    return ngx_http_polaris_limit_agent;
+}
+
+/* 读取配置参数 polaris_limit */
+static char *ngx_http_polaris_limit_conf_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_polaris_limit_conf_t      *plcf;
+    ngx_uint_t                          i;
+    ngx_str_t                          *value;
+    plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(conf);
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+
+    bool has_namespace = false;
+    bool has_service = false;
+    bool has_enable = false;
+    ngx_str_t thread_pool_name = ngx_string("default");
+  
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, KEY_NAMESPACE, KEY_NAMESPACE_SIZE) == 0) {
+            size_t ns_size = value[i].len - KEY_NAMESPACE_SIZE;
+            if (ns_size > 0) {
+                ngx_str_t namespace_str = {value[i].len - KEY_NAMESPACE_SIZE, &value[i].data[KEY_NAMESPACE_SIZE]};
+                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx namespace", &namespace_str);
+                plcf->service_namespace = std::string(reinterpret_cast<char *>(namespace_str.data), namespace_str.len);
+                has_namespace = true;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_SERVICE_NAME, KEY_SERVICE_NAME_SIZE) == 0) {
+            size_t svc_size = value[i].len - KEY_SERVICE_NAME_SIZE;
+            if (svc_size > 0) {
+                ngx_str_t svc_name_str = {value[i].len - KEY_SERVICE_NAME_SIZE, &value[i].data[KEY_SERVICE_NAME_SIZE]};
+                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx service name", &svc_name_str);
+                plcf->service_name = std::string(reinterpret_cast<char *>(svc_name_str.data), svc_name_str.len);
+                has_service = true;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_ENABLE, KEY_ENABLE_SIZE) == 0) {
+            size_t enable_size = value[i].len - KEY_ENABLE_SIZE;
+            if (enable_size > 0) {
+                ngx_str_t enable_str = {value[i].len - KEY_ENABLE_SIZE, &value[i].data[KEY_ENABLE_SIZE]};
+                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx ratelimit enable value", &enable_str);
+                std::string enable_str_value = std::string(reinterpret_cast<char *>(enable_str.data), enable_str.len);
+                if (string2bool(enable_str_value)) {
+                  plcf->enable = 1;
+                } else {
+                  plcf->enable = 0;
+                }
+                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx ratelimit enable", plcf->enable);
+                has_enable = true;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_MODE, KEY_MODE_SIZE) == 0) {
+            ngx_str_t mode_str = {value[i].len - KEY_MODE_SIZE, &value[i].data[KEY_MODE_SIZE]};
+            if (mode_str.len == 5 && ngx_strncmp(mode_str.data, "local", 5) == 0) {
+                plcf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL;
+            } else if (mode_str.len == 6 && ngx_strncmp(mode_str.data, "remote", 6) == 0) {
+                plcf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE;
+            } else if (mode_str.len == 11 && ngx_strncmp(mode_str.data, "concurrency", 11) == 0) {
+                plcf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid mode \"%V\", only local, remote or concurrency",
+                    &mode_str);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_ZONE, KEY_ZONE_SIZE) == 0) {
+            ngx_str_t zone_name = {value[i].len - KEY_ZONE_SIZE, &value[i].data[KEY_ZONE_SIZE]};
+            plcf->shm_zone = ngx_shared_memory_add(cf, &zone_name, 0, &ngx_http_polaris_limit_module);
+            if (plcf->shm_zone == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_RATE, KEY_RATE_SIZE) == 0) {
+            ngx_str_t rate_str = {value[i].len - KEY_RATE_SIZE, &value[i].data[KEY_RATE_SIZE]};
+            if (ngx_polaris_limit_parse_rate(&rate_str, &plcf->gcra.rate) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid rate \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_BURST, KEY_BURST_SIZE) == 0) {
+            ngx_int_t burst = ngx_atoi(value[i].data + KEY_BURST_SIZE, value[i].len - KEY_BURST_SIZE);
+            if (burst < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid burst \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->gcra.burst = burst;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_TENANT_SHARE, KEY_TENANT_SHARE_SIZE) == 0) {
+            ngx_int_t share = ngx_atoi(value[i].data + KEY_TENANT_SHARE_SIZE, value[i].len - KEY_TENANT_SHARE_SIZE);
+            if (share <= 0 || share > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid tenant_share \"%V\", only 1-100", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->tenant_share = share;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_TENANT_BORROW, KEY_TENANT_BORROW_SIZE) == 0) {
+            ngx_int_t borrow = ngx_atoi(value[i].data + KEY_TENANT_BORROW_SIZE, value[i].len - KEY_TENANT_BORROW_SIZE);
+            if (borrow < 0 || borrow > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid tenant_borrow \"%V\", only 0-100", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->tenant_borrow = borrow;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_TENANT, KEY_TENANT_SIZE) == 0) {
+            ngx_str_t tenant_str = {value[i].len - KEY_TENANT_SIZE, &value[i].data[KEY_TENANT_SIZE]};
+            ngx_http_compile_complex_value_t ccv;
+
+            plcf->tenant = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+            if (plcf->tenant == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ccv.cf = cf;
+            ccv.value = &tenant_str;
+            ccv.complex_value = plcf->tenant;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_EARLY, KEY_EARLY_SIZE) == 0) {
+            ngx_str_t early_str = {value[i].len - KEY_EARLY_SIZE, &value[i].data[KEY_EARLY_SIZE]};
+            if (early_str.len == 2 && ngx_strncmp(early_str.data, "on", 2) == 0) {
+                plcf->early = 1;
+            } else if (early_str.len == 3 && ngx_strncmp(early_str.data, "off", 3) == 0) {
+                plcf->early = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid early \"%V\", only on or off", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_HEAVY_SHARE, KEY_HEAVY_SHARE_SIZE) == 0) {
+            ngx_int_t share = ngx_atoi(value[i].data + KEY_HEAVY_SHARE_SIZE, value[i].len - KEY_HEAVY_SHARE_SIZE);
+            if (share <= 0 || share > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid heavy_share \"%V\", only 1-100", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->heavy_share = share;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_HEAVY_KEY, KEY_HEAVY_KEY_SIZE) == 0) {
+            ngx_str_t heavy_str = {value[i].len - KEY_HEAVY_KEY_SIZE, &value[i].data[KEY_HEAVY_KEY_SIZE]};
+            ngx_http_compile_complex_value_t ccv;
+
+            plcf->heavy_key = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+            if (plcf->heavy_key == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ccv.cf = cf;
+            ccv.value = &heavy_str;
+            ccv.complex_value = plcf->heavy_key;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_LIMIT_KEY, KEY_LIMIT_KEY_SIZE) == 0) {
+            ngx_str_t key_str = {value[i].len - KEY_LIMIT_KEY_SIZE, &value[i].data[KEY_LIMIT_KEY_SIZE]};
+            ngx_http_compile_complex_value_t ccv;
+
+            plcf->key = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+            if (plcf->key == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ccv.cf = cf;
+            ccv.value = &key_str;
+            ccv.complex_value = plcf->key;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_ASYNC, KEY_ASYNC_SIZE) == 0) {
+            ngx_str_t async_str = {value[i].len - KEY_ASYNC_SIZE, &value[i].data[KEY_ASYNC_SIZE]};
+            if (async_str.len == 2 && ngx_strncmp(async_str.data, "on", 2) == 0) {
+                plcf->async = 1;
+            } else if (async_str.len == 3 && ngx_strncmp(async_str.data, "off", 3) == 0) {
+                plcf->async = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid async \"%V\", only on or off", &async_str);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_THREAD_POOL, KEY_THREAD_POOL_SIZE) == 0) {
+            thread_pool_name.len = value[i].len - KEY_THREAD_POOL_SIZE;
+            thread_pool_name.data = &value[i].data[KEY_THREAD_POOL_SIZE];
+            if (thread_pool_name.len == 0) {
+                return const_cast<char *>("invalid thread_pool");
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_TIMEOUT, KEY_TIMEOUT_SIZE) == 0) {
+            ngx_str_t timeout_str = {value[i].len - KEY_TIMEOUT_SIZE, &value[i].data[KEY_TIMEOUT_SIZE]};
+            ngx_msec_int_t timeout = ngx_parse_time(&timeout_str, 0);
+            if (timeout == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid timeout \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->timeout = static_cast<ngx_msec_t>(timeout);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_LEASE, KEY_LEASE_SIZE) == 0) {
+            ngx_str_t lease_str = {value[i].len - KEY_LEASE_SIZE, &value[i].data[KEY_LEASE_SIZE]};
+            if (lease_str.len > 0 && lease_str.data[lease_str.len - 1] == '%') {
+                lease_str.len--;
+            }
+            ngx_int_t lease = ngx_atoi(lease_str.data, lease_str.len);
+            if (lease < 0 || lease > NGX_HTTP_POLARIS_LIMIT_MAX_LEASE) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid lease \"%V\", must be 0-%d%%",
+                    &value[i], NGX_HTTP_POLARIS_LIMIT_MAX_LEASE);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->lease = lease;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_DEGRADE_NODES, KEY_DEGRADE_NODES_SIZE) == 0) {
+            ngx_int_t nodes = ngx_atoi(value[i].data + KEY_DEGRADE_NODES_SIZE, value[i].len - KEY_DEGRADE_NODES_SIZE);
+            if (nodes <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid degrade_nodes \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->degrade_nodes = nodes;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_BYPASS, KEY_BYPASS_SIZE) == 0) {
+            ngx_str_t bypass_str = {value[i].len - KEY_BYPASS_SIZE, &value[i].data[KEY_BYPASS_SIZE]};
+            char *rv = ngx_http_polaris_limit_acl_add(cf, plcf, &bypass_str, NGX_HTTP_POLARIS_LIMIT_ACL_BYPASS);
+            if (rv != NGX_CONF_OK) {
+                return rv;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_BLOCK, KEY_BLOCK_SIZE) == 0) {
+            ngx_str_t block_str = {value[i].len - KEY_BLOCK_SIZE, &value[i].data[KEY_BLOCK_SIZE]};
+            char *rv = ngx_http_polaris_limit_acl_add(cf, plcf, &block_str, NGX_HTTP_POLARIS_LIMIT_ACL_BLOCK);
+            if (rv != NGX_CONF_OK) {
+                return rv;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_CONCURRENCY, KEY_CONCURRENCY_SIZE) == 0) {
+            // concurrency=max 或 concurrency=min-max
+            u_char *start = value[i].data + KEY_CONCURRENCY_SIZE;
+            u_char *last = value[i].data + value[i].len;
+            u_char *dash = ngx_strlchr(start, last, '-');
+            ngx_int_t min = 1;
+            ngx_int_t max;
+            if (dash != NULL) {
+                min = ngx_atoi(start, dash - start);
+                start = dash + 1;
+            }
+            max = ngx_atoi(start, last - start);
+            if (min <= 0 || max <= 0 || min > max) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid concurrency \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->concurrency.min = min;
+            plcf->concurrency.max = max;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_PRIORITY, KEY_PRIORITY_SIZE) == 0) {
+            ngx_str_t priority_str = {value[i].len - KEY_PRIORITY_SIZE, &value[i].data[KEY_PRIORITY_SIZE]};
+            ngx_http_compile_complex_value_t ccv;
+
+            plcf->priority = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+            if (plcf->priority == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ccv.cf = cf;
+            ccv.value = &priority_str;
+            ccv.complex_value = plcf->priority;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_COST, KEY_COST_SIZE) == 0) {
+            // cost=$request_cost 配合map按路由、method或$content_length计算请求消耗的配额数
+            ngx_str_t cost_str = {value[i].len - KEY_COST_SIZE, &value[i].data[KEY_COST_SIZE]};
+            ngx_http_compile_complex_value_t ccv;
+
+            plcf->cost = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+            if (plcf->cost == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+            ccv.cf = cf;
+            ccv.value = &cost_str;
+            ccv.complex_value = plcf->cost;
+            if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_PRIORITY_RESERVE, KEY_PRIORITY_RESERVE_SIZE) == 0) {
+            // priority_reserve=0,20,50 依次为优先级0、1、2不能使用的配额百分比
+            u_char *p = value[i].data + KEY_PRIORITY_RESERVE_SIZE;
+            u_char *last = value[i].data + value[i].len;
+            plcf->npriorities = 0;
+            while (p < last) {
+                u_char *end = ngx_strlchr(p, last, ',');
+                if (end == NULL) {
+                    end = last;
+                }
+                ngx_int_t reserve = ngx_atoi(p, end - p);
+                if (reserve < 0 || reserve > 99 || plcf->npriorities == NGX_HTTP_POLARIS_LIMIT_MAX_PRIORITIES) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid priority_reserve \"%V\", "
+                        "at most %d percents of 0-99", &value[i], NGX_HTTP_POLARIS_LIMIT_MAX_PRIORITIES);
+                    return static_cast<char *>(NGX_CONF_ERROR);
+                }
+                plcf->reserve[plcf->npriorities++] = reserve;
+                p = end + 1;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_SHED_TARGET, KEY_SHED_TARGET_SIZE) == 0) {
+            ngx_str_t target_str = {value[i].len - KEY_SHED_TARGET_SIZE, &value[i].data[KEY_SHED_TARGET_SIZE]};
+            ngx_msec_int_t target = ngx_parse_time(&target_str, 0);
+            if (target == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid shed_target \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->shed_target = static_cast<ngx_msec_t>(target);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_SHED_INTERVAL, KEY_SHED_INTERVAL_SIZE) == 0) {
+            ngx_str_t interval_str = {value[i].len - KEY_SHED_INTERVAL_SIZE, &value[i].data[KEY_SHED_INTERVAL_SIZE]};
+            ngx_msec_int_t interval = ngx_parse_time(&interval_str, 0);
+            if (interval == NGX_ERROR || interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid shed_interval \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->shed_interval = static_cast<ngx_msec_t>(interval);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_DELAY, KEY_DELAY_SIZE) == 0) {
+            ngx_str_t delay_str = {value[i].len - KEY_DELAY_SIZE, &value[i].data[KEY_DELAY_SIZE]};
+            ngx_msec_int_t delay = ngx_parse_time(&delay_str, 0);
+            if (delay == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid delay \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->delay = static_cast<ngx_msec_t>(delay);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_QUEUE, KEY_QUEUE_SIZE) == 0) {
+            ngx_int_t queue = ngx_atoi(value[i].data + KEY_QUEUE_SIZE, value[i].len - KEY_QUEUE_SIZE);
+            if (queue <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid queue \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            plcf->queue = queue;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_FAIL, KEY_FAIL_SIZE) == 0) {
+            ngx_str_t fail_str = {value[i].len - KEY_FAIL_SIZE, &value[i].data[KEY_FAIL_SIZE]};
+            if (fail_str.len == 4 && ngx_strncmp(fail_str.data, "open", 4) == 0) {
+                plcf->fail = NGX_HTTP_POLARIS_LIMIT_FAIL_OPEN;
+            } else if (fail_str.len == 6 && ngx_strncmp(fail_str.data, "closed", 6) == 0) {
+                plcf->fail = NGX_HTTP_POLARIS_LIMIT_FAIL_CLOSED;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid fail \"%V\", only open or closed", &fail_str);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+    }
+
+    if (!has_namespace) {
+      const char *namespace_env_value = getenv(ENV_NAMESPACE.c_str());
+      if (NULL != namespace_env_value) {
+          plcf->service_namespace.assign(namespace_env_value);
+      } else {
+          plcf->service_namespace = DEFAULT_NAMESPACE;
+      }
+      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %s as nginx namespace", plcf->service_namespace.c_str());
+    }
+
+    if (!has_service) {
+      const char *service_env_value = getenv(ENV_SERVICE.c_str());
+      if (NULL != service_env_value) {
+          plcf->service_name.assign(service_env_value);
+      } else {
+          plcf->service_name = DEFAULT_SERVICE;
+      }
+      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %s as nginx service name", plcf->service_name.c_str());
+    }
+
+    if (!has_enable) {
+      const char *enable_env_value = getenv(ENV_RATELIMIT_ENABLE.c_str());
+      if (NULL != enable_env_value) {
+          std::string enable_str = std::string(enable_env_value);
+          plcf->enable = string2bool(enable_str) ? 1 : 0;
+      } else {
+          plcf->enable = 0;
+      }
+      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %d as nginx ratelimit enable", plcf->enable);
+    }
+
+    if (plcf->enable) {
+        ngx_http_polaris_limit_main_conf_t *lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+            ngx_http_conf_get_module_main_conf(cf, ngx_http_polaris_limit_module));
+        lmcf->enabled = 1;
+        if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE) {
+            lmcf->remote = 1;
+        }
+    }
+
+    plcf->service = LimitServiceRegistry::Instance().Get(plcf->service_namespace, plcf->service_name);
+    if (plcf->service == NULL) {
+        return const_cast<char *>("fail to create polaris rate limit service context");
+    }
+    if (plcf->enable && plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE) {
+        plcf->service->remote = 1;
+    }
+
+    if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL && (plcf->shm_zone == NULL || plcf->gcra.rate == 0)) {
+        return const_cast<char *>("local mode requires zone= and rate=");
+    }
+
+    if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY) {
+        if (plcf->shm_zone == NULL || plcf->concurrency.max == 0) {
+            return const_cast<char *>("concurrency mode requires zone= and concurrency=");
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use concurrency mode, limit %ui-%ui",
+            plcf->concurrency.min, plcf->concurrency.max);
+    }
+
+    if (plcf->heavy_key != NULL) {
+        if (plcf->shm_zone == NULL || plcf->heavy_share == 0) {
+            return const_cast<char *>("heavy_key= requires zone= and heavy_share=");
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] throttle keys over %ui%% of traffic", plcf->heavy_share);
+    }
+
+    if (plcf->degrade_nodes) {
+        if (plcf->mode != NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE || plcf->shm_zone == NULL) {
+            return const_cast<char *>("degrade_nodes= requires remote mode and zone=");
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] degrade to 1/%ui of rule quota when limiter unreachable",
+            plcf->degrade_nodes);
+    }
+
+    if (plcf->mode != NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE || plcf->heavy_key != NULL || plcf->degrade_nodes || plcf->early) {
+        // 同一共享内存被多个location使用时，以location名和服务名区分限流桶，reload后保持不变
+        ngx_http_core_loc_conf_t *clcf = reinterpret_cast<ngx_http_core_loc_conf_t *>(
+            ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+        std::string service_key = plcf->service_namespace + "/" + plcf->service_name;
+        plcf->salt = (static_cast<uint64_t>(ngx_murmur_hash2(clcf->name.data, clcf->name.len)) << 32)
+            | ngx_crc32_short(reinterpret_cast<u_char *>(&service_key[0]), service_key.size());
+        if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL) {
+            ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use local mode, rate %ui.%03ui r/s, burst %ui",
+                plcf->gcra.rate / 1000, plcf->gcra.rate % 1000, plcf->gcra.burst);
+        }
+    }
+
+    if (plcf->tenant != NULL) {
+        if (plcf->mode != NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL || plcf->tenant_share == 0) {
+            return const_cast<char *>("tenant= requires local mode and tenant_share=");
+        }
+        plcf->tenant_gcra.rate = plcf->gcra.rate * plcf->tenant_share / 100;
+        plcf->tenant_gcra.burst = plcf->gcra.burst * plcf->tenant_share / 100;
+        if (plcf->tenant_gcra.rate == 0) {
+            return const_cast<char *>("tenant_share= leaves tenant with zero rate");
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] tenant share %ui%%, rate %ui.%03ui r/s, burst %ui",
+            plcf->tenant_share, plcf->tenant_gcra.rate / 1000, plcf->tenant_gcra.rate % 1000, plcf->tenant_gcra.burst);
+    }
+
+    if (plcf->shm_zone != NULL) {
+        // 共享内存只分配本location用到的结构，多个location使用同一zone时取并集
+        ngx_uint_t uses = 0;
+        if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL || plcf->degrade_nodes) {
+            uses |= NGX_POLARIS_LIMIT_USE_GCRA;
+        }
+        if (plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY) {
+            uses |= NGX_POLARIS_LIMIT_USE_CONCURRENCY;
+        }
+        if (plcf->heavy_key != NULL) {
+            uses |= NGX_POLARIS_LIMIT_USE_HEAVY;
+        }
+        if (ngx_polaris_limit_zone_use(cf, plcf->shm_zone, uses) == NULL) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+    }
+
+    if (plcf->lease && plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE) {
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] lease at most %ui%% of rule quota per request", plcf->lease);
+    }
+
+    if ((plcf->priority == NULL) != (plcf->npriorities == 0)) {
+        return const_cast<char *>("priority= and priority_reserve= must be set together");
+    }
+
+    if (plcf->cost != NULL && plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY) {
+        return const_cast<char *>("cost= is not supported in concurrency mode");
+    }
+
+    if (plcf->shed_target) {
+        if (plcf->shed_interval == 0) {
+            plcf->shed_interval = NGX_HTTP_POLARIS_LIMIT_SHED_INTERVAL;
+        }
+        ngx_http_polaris_limit_main_conf_t *lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+            ngx_http_conf_get_module_main_conf(cf, ngx_http_polaris_limit_module));
+        lmcf->shed = 1;
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] shed requests queued over %M ms for %M ms",
+            plcf->shed_target, plcf->shed_interval);
+    }
+
+    if (plcf->delay) {
+        if (plcf->queue == 0) {
+            plcf->queue = NGX_HTTP_POLARIS_LIMIT_DEFAULT_QUEUE;
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] delay over quota requests at most %M ms, queue %ui per worker",
+            plcf->delay, plcf->queue);
+    }
+
+    if (plcf->async && plcf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE) {
+#if (NGX_THREADS)
+        plcf->thread_pool = ngx_thread_pool_add(cf, &thread_pool_name);
+        if (plcf->thread_pool == NULL) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] get quota in thread pool \"%V\", timeout %M",
+            &thread_pool_name, plcf->timeout);
+#else
+        return const_cast<char *>("async=on requires nginx built with --with-threads");
+#endif
+    }
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 解析逗号分隔的CIDR列表加入radix树，相同网段以先配置的为准，不同网段按最长前缀匹配 */
+static char *ngx_http_polaris_limit_acl_add(ngx_conf_t *cf, ngx_http_polaris_limit_conf_t *plcf, ngx_str_t *value, uintptr_t action) {
+    u_char                             *p, *last, *end;
+    ngx_str_t                           net;
+    ngx_cidr_t                          cidr;
+    ngx_int_t                           rc;
+
+    p = value->data;
+    last = value->data + value->len;
+
+    while (p < last) {
+        end = ngx_strlchr(p, last, ',');
+        if (end == NULL) {
+            end = last;
+        }
+        net.data = p;
+        net.len = end - p;
+        p = end + 1;
+
+        if (net.len == 0) {
+            continue;
+        }
+
+        rc = ngx_ptocidr(&net, &cidr);
+        if (rc == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid network \"%V\"", &net);
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        if (rc == NGX_DONE) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "[PolarisRateLimiting] low address bits of %V are meaningless", &net);
+        }
+
+        switch (cidr.family) {
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            if (plcf->acl6 == NULL) {
+                plcf->acl6 = ngx_radix_tree_create(cf->pool, -1);
+                if (plcf->acl6 == NULL) {
+                    return static_cast<char *>(NGX_CONF_ERROR);
+                }
+            }
+            rc = ngx_radix128tree_insert(plcf->acl6, cidr.u.in6.addr.s6_addr, cidr.u.in6.mask.s6_addr, action);
+            break;
+#endif
+        default:
+            if (plcf->acl == NULL) {
+                plcf->acl = ngx_radix_tree_create(cf->pool, -1);
+                if (plcf->acl == NULL) {
+                    return static_cast<char *>(NGX_CONF_ERROR);
+                }
+            }
+            rc = ngx_radix32tree_insert(plcf->acl, ntohl(cidr.u.in.addr), ntohl(cidr.u.in.mask), action);
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        if (rc == NGX_BUSY) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "[PolarisRateLimiting] duplicate network \"%V\", ignored", &net);
+        }
+    }
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 读取配置参数 polaris_rate_limiting_zone zone=name:size */
+static char *ngx_http_polaris_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_str_t                          *value;
+    ngx_str_t                           name;
+    ssize_t                             size;
+    ngx_shm_zone_t                     *shm_zone;
+    char                               *rv;
+
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+
+    rv = ngx_polaris_limit_parse_zone(cf, &value[1], &name, &size);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_polaris_limit_module);
+    if (shm_zone == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // 控制结构可能已由之前引用该zone的指令创建，以init区分重复定义
+    if (shm_zone->init) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] duplicate zone \"%V\"", &name);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (ngx_polaris_limit_zone_use(cf, shm_zone, 0) == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    shm_zone->init = ngx_polaris_limit_init_zone;
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 读取配置参数 polaris_rate_limiting_early zone=name [key=$binary_remote_addr] [hold=1s]
+   zone为polaris_rate_limiting_zone定义的共享内存，记录按location区分，只有配额判断为限流时记录 */
+static char *ngx_http_polaris_limit_early(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_polaris_limit_main_conf_t *lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(conf);
+    ngx_http_compile_complex_value_t    ccv;
+    ngx_str_t                          *value;
+    ngx_str_t                           name = ngx_null_string;
+    ngx_str_t                           key = ngx_string("$binary_remote_addr");
+    ngx_str_t                           s;
+    ngx_msec_t                          hold = 1000;
+    ngx_int_t                           n;
+    ngx_uint_t                          i;
+
+    if (lmcf->early_zone != NULL) {
+        return const_cast<char *>("is duplicate");
+    }
+
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, KEY_ZONE, KEY_ZONE_SIZE) == 0) {
+            name.len = value[i].len - KEY_ZONE_SIZE;
+            name.data = value[i].data + KEY_ZONE_SIZE;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, KEY_LIMIT_KEY, KEY_LIMIT_KEY_SIZE) == 0) {
+            key.len = value[i].len - KEY_LIMIT_KEY_SIZE;
+            key.data = value[i].data + KEY_LIMIT_KEY_SIZE;
+            continue;
+        }
+        if (ngx_strncmp(value[i].data, KEY_HOLD, KEY_HOLD_SIZE) == 0) {
+            s.len = value[i].len - KEY_HOLD_SIZE;
+            s.data = value[i].data + KEY_HOLD_SIZE;
+            n = ngx_parse_time(&s, 0);
+            if (n <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid hold \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            hold = static_cast<ngx_msec_t>(n);
+            continue;
+        }
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid parameter \"%V\"", &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (name.len == 0) {
+        return const_cast<char *>("requires zone=");
+    }
+
+    lmcf->early_zone = ngx_shared_memory_add(cf, &name, 0, &ngx_http_polaris_limit_module);
+    if (lmcf->early_zone == NULL
+        || ngx_polaris_limit_zone_use(cf, lmcf->early_zone, NGX_POLARIS_LIMIT_USE_VERDICT) == NULL)
+    {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    lmcf->early_key = reinterpret_cast<ngx_http_complex_value_t *>(ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t)));
+    if (lmcf->early_key == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &key;
+    ccv.complex_value = lmcf->early_key;
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    lmcf->early_hold = hold;
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 读取配置参数 polaris_rate_limiting_status [json|prometheus] */
+static char *ngx_http_polaris_limit_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_http_polaris_limit_conf_t      *plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(conf);
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_str_t                          *value;
+
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+    plcf->status_format = NGX_HTTP_POLARIS_LIMIT_STATUS_JSON;
+    if (cf->args->nelts > 1) {
+        if (value[1].len == 10 && ngx_strncmp(value[1].data, "prometheus", 10) == 0) {
+            plcf->status_format = NGX_HTTP_POLARIS_LIMIT_STATUS_PROMETHEUS;
+        } else if (value[1].len != 4 || ngx_strncmp(value[1].data, "json", 4) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid status format \"%V\", only json or prometheus",
+                &value[1]);
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+    }
+
+    clcf = reinterpret_cast<ngx_http_core_loc_conf_t *>(ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module));
+    clcf->handler = ngx_http_polaris_limit_status_handler;
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 初始化limit模块 */
+static ngx_int_t ngx_http_polaris_limit_init(ngx_conf_t *cf) {
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_polaris_limit_module));
+    if (!lmcf->enabled) {
+        return NGX_OK;                                          // 没有启用限流的location，请求不经过本模块
+    }
+
+    // http核心模块的main_conf
+    cmcf = reinterpret_cast<ngx_http_core_main_conf_t *>(
+        ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module));
+
+    // 准备挂载模块，获取迭代器
+    h = reinterpret_cast<ngx_http_handler_pt *>(
+        ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers));
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_polaris_limit_handler;    // 挂载limit_req处理函数
+    return NGX_OK;
+}
+
+/* 每次加载nginx配置只读取一次polaris.yaml，reload失败时旧cycle的配置不受影响 */
+static void *ngx_http_polaris_limit_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_polaris_limit_main_conf_t *lmcf;
+    std::string                         path;
+    std::string                         content;
+
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_pcalloc(cf->pool, sizeof(ngx_http_polaris_limit_main_conf_t)));
+    if (lmcf == NULL) {
+        return NULL;
+    }
+
+    // 服务表只包含本次配置中的location，统计共享内存、代理和预拉取都按此表
+    lmcf->services = LimitServiceRegistry::Instance().Create(cf->pool);
+    if (lmcf->services == NULL) {
+        return NULL;
+    }
+
+    path = get_polaris_conf_path();
+    Limit_API_SINGLETON.LoadPolarisConfig(path, content, lmcf->config_mtime);
+
+    lmcf->config_path.len = path.size();
+    lmcf->config_path.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, path.size()));
+    lmcf->polaris_config.len = content.size();
+    lmcf->polaris_config.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, content.size()));
+    if (lmcf->config_path.data == NULL || lmcf->polaris_config.data == NULL) {
+        return NULL;
+    }
+    ngx_memcpy(lmcf->config_path.data, path.data(), path.size());
+    ngx_memcpy(lmcf->polaris_config.data, content.data(), content.size());
+
+    lmcf->config_watch = NGX_CONF_UNSET_MSEC;
+    lmcf->prewarm = NGX_CONF_UNSET_MSEC;
+    lmcf->agent = NGX_CONF_UNSET;
+    return lmcf;
+}
+
+static char *ngx_http_polaris_limit_init_main_conf(ngx_conf_t *cf, void *conf) {
+    ngx_http_polaris_limit_main_conf_t *lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(conf);
+    ngx_polaris_limit_stat_ctx_t       *ctx;
+    ngx_polaris_limit_agent_ctx_t      *agent_ctx;
+    ngx_str_t                           name;
+    ngx_uint_t                          nservices;
+
+    ngx_conf_init_msec_value(lmcf->config_watch, 0);
+    ngx_conf_init_msec_value(lmcf->prewarm, 0);                // 默认不预先拉取，worker启动不等待
+    ngx_conf_init_value(lmcf->agent, 0);
+
+    // 此时所有location已解析完，按已注册的服务数创建统计共享内存
+    nservices = LimitServiceRegistry::Instance().Size();
+    if (nservices == 0) {
+        return static_cast<char *>(NGX_CONF_OK);
+    }
 
-    plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(
-        ngx_http_get_module_loc_conf(r, ngx_http_polaris_limit_module));
+    ctx = reinterpret_cast<ngx_polaris_limit_stat_ctx_t *>(ngx_pcalloc(cf->pool, sizeof(ngx_polaris_limit_stat_ctx_t)));
+    if (ctx == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    ctx->nservices = nservices;
+
+    name.len = STATUS_ZONE_NAME.size();
+    name.data = reinterpret_cast<u_char *>(const_cast<char *>(STATUS_ZONE_NAME.data()));
+    lmcf->stat_zone = ngx_shared_memory_add(cf, &name, ngx_polaris_limit_stat_zone_size(nservices),
+        &ngx_http_polaris_limit_module);
+    if (lmcf->stat_zone == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    lmcf->stat_zone->init = ngx_polaris_limit_stat_init_zone;
+    lmcf->stat_zone->data = ctx;
 
-    if (plcf->enable == 0) {
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] RateLimit not enabled");
-      return NGX_DECLINED;
+    if (!lmcf->agent || !lmcf->remote) {
+        return static_cast<char *>(NGX_CONF_OK);
     }
-    polaris::LimitApi* limit_api = Limit_API_SINGLETON.GetLimitApi(r->connection->log);
-    if (NULL == limit_api) {
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] RateLimit api not created");
-      return NGX_DECLINED;
+
+#if !(NGX_HAVE_POSIX_SEM)
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] polaris_rate_limiting_agent requires posix semaphores");
+    return static_cast<char *>(NGX_CONF_ERROR);
+#endif
+
+    agent_ctx = reinterpret_cast<ngx_polaris_limit_agent_ctx_t *>(ngx_pcalloc(cf->pool, sizeof(ngx_polaris_limit_agent_ctx_t)));
+    if (agent_ctx == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
     }
+    agent_ctx->nservices = nservices;
+
+    name.len = AGENT_ZONE_NAME.size();
+    name.data = reinterpret_cast<u_char *>(const_cast<char *>(AGENT_ZONE_NAME.data()));
+    lmcf->agent_zone = ngx_shared_memory_add(cf, &name, ngx_polaris_limit_agent_zone_size(nservices),
+        &ngx_http_polaris_limit_module);
+    if (lmcf->agent_zone == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    lmcf->agent_zone->init = ngx_polaris_limit_agent_init_zone;
+    lmcf->agent_zone->data = agent_ctx;
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
 
-    polaris::ServiceKey serviceKey = {plcf->service_namespace, plcf->service_name};
-    std::string method = std::string(reinterpret_cast<char *>(r->uri.data), r->uri.len);
-    ret = limit_api->FetchRuleLabelKeys(serviceKey, label_keys);
+/* worker启动时创建LimitApi，避免第一个请求承担SDK初始化耗时 */
+static ngx_int_t ngx_http_polaris_limit_init_process(ngx_cycle_t *cycle) {
+    ngx_http_polaris_limit_main_conf_t *lmcf;
 
-    if (ret != 0) {
-       ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[PolarisRateLimiting] fail to fetchRuleLabelKeys return is: %d", ret);
-       return NGX_DECLINED;
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
     }
 
-    if (label_keys != NULL) {
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] FetchRuleLabelKeys labels count %d", label_keys->size());
+    lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(
+        ngx_http_cycle_get_module_main_conf(cycle, ngx_http_polaris_limit_module));
+    if (lmcf == NULL) {
+        return NGX_OK;
     }
-    
-    if (ret == polaris::kReturnTimeout) {
-        return NGX_DECLINED;                                     // 拉取labelkey超时，不限流
-    } else if (ret != polaris::kReturnOk) {
-        return plcf->status_code;                               // 返回为限流配置的状态码
+
+    // master中的当前服务表可能属于加载失败的新配置
+    LimitServiceRegistry::Instance().Use(lmcf->services);
+
+    if (lmcf->shed) {
+        ngx_http_polaris_limit_lag_event.handler = ngx_http_polaris_limit_lag_handler;
+        ngx_http_polaris_limit_lag_event.data = reinterpret_cast<void *>(
+            static_cast<uintptr_t>(ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_LAG_INTERVAL));
+        ngx_http_polaris_limit_lag_event.log = cycle->log;
+        ngx_http_polaris_limit_lag_event.cancelable = 1;
+        ngx_add_timer(&ngx_http_polaris_limit_lag_event, NGX_HTTP_POLARIS_LIMIT_LAG_INTERVAL);
     }
 
-    get_labels_from_request(r, label_keys, labels);    // 从http 请求中获取labels
-    std::string uri(reinterpret_cast<char *>(r->uri.data), r->uri.len);
-    quota_request.SetServiceNamespace(plcf->service_namespace);       // 设置限流规则对应服务的命名空间
-    quota_request.SetServiceName(plcf->service_name);                 // 设置限流规则对应的服务名
-    quota_request.SetMethod(uri);
-    quota_request.SetLabels(labels);                            // 设置label用于匹配限流规则
+    if (!lmcf->remote) {
+        return NGX_OK;
+    }
 
-    if (r->connection->log->log_level >= NGX_LOG_DEBUG) {
-      std::string labels_values_str;
-      join_map_str(labels, labels_values_str);
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-          "[PolarisRateLimiting] quota_request namespace %s, service %s, method %s, labels %s", plcf->service_namespace.c_str(), plcf->service_name.c_str(), uri.c_str(), labels_values_str.c_str());
+    // 启用代理时只有一个worker创建LimitApi，其他worker通过共享内存转发
+    if (lmcf->agent_zone != NULL && ngx_process == NGX_PROCESS_WORKER && ngx_worker != NGX_POLARIS_LIMIT_AGENT_WORKER) {
+        ngx_http_polaris_limit_agent = reinterpret_cast<ngx_polaris_limit_agent_ctx_t *>(lmcf->agent_zone->data);
+        ngx_http_polaris_limit_prewarm(cycle, lmcf->prewarm);
+        return NGX_OK;
     }
-    ret = limit_api->GetQuota(quota_request, result);
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] GetQuota return is: %d", ret);
-    if (ret == polaris::kReturnTimeout) {
-        return NGX_DECLINED;                                    // GetQuota超时，不限流
-    } else if (ret != polaris::kReturnOk) {
-        return plcf->status_code;                               // 返回为限流配置的状态码
+    // 创建失败时放通，不影响worker启动
+    Limit_API_SINGLETON.Init(cycle->log,
+        std::string(reinterpret_cast<char *>(lmcf->config_path.data), lmcf->config_path.len),
+        std::string(reinterpret_cast<char *>(lmcf->polaris_config.data), lmcf->polaris_config.len),
+        lmcf->config_mtime);
+
+    if (lmcf->agent_zone != NULL && ngx_process == NGX_PROCESS_WORKER) {
+        // 启动失败时其他worker等待超时，按fail=策略处理
+        (void) ngx_polaris_limit_agent_start(reinterpret_cast<ngx_polaris_limit_agent_ctx_t *>(lmcf->agent_zone->data),
+            ngx_http_polaris_limit_agent_quota, ngx_http_polaris_limit_agent_rule, cycle->log);
     }
-  
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[PolarisRateLimiting] result is: %d", result);
-    if (result == polaris::kQuotaResultLimited) {
-        return plcf->status_code;   // 请求被限制
+
+    ngx_http_polaris_limit_prewarm(cycle, lmcf->prewarm);
+
+    if (lmcf->config_watch) {
+        ngx_http_polaris_limit_watch_event.handler = ngx_http_polaris_limit_watch_handler;
+        ngx_http_polaris_limit_watch_event.data = lmcf;
+        ngx_http_polaris_limit_watch_event.log = cycle->log;
+        ngx_http_polaris_limit_watch_event.cancelable = 1;      // 不阻塞worker退出
+        ngx_add_timer(&ngx_http_polaris_limit_watch_event, lmcf->config_watch);
     }
-    return NGX_DECLINED;
+    return NGX_OK;
 }
 
-static void join_map_str(const std::map<std::string, std::string>& labels, std::string& labels_str) {
-  for (std::map<std::string, std::string>::const_iterator it = labels.begin(); it != labels.end(); it++) {
-    labels_str += it->first;
-    labels_str += "=";
-    labels_str += it->second;
-    labels_str += ",";
-  }
-}
+/* 配置了polaris_rate_limiting_prewarm时，worker开始接收请求前加载所有远端限流服务的规则，
+   避免启动或reload后的首批请求等待拉取规则而超时放通。
+   先让SDK在后台同时拉取所有服务，再在总时间prewarm内逐个等待，超时的服务在请求到来时再拉取。
+   通过代理访问时规则由代理worker发布，不在init_process中等待，由定时器检查到prewarm为止 */
+static void ngx_http_polaris_limit_prewarm(ngx_cycle_t *cycle, ngx_msec_t prewarm) {
+    polaris::LimitApi                  *limit_api;
+    const std::set<std::string>        *label_keys;
+    ngx_uint_t                          total = 0;
+    ngx_uint_t                          ready = 0;
+    ngx_msec_t                          elapsed;
+    uint64_t                            start;
+
+    if (prewarm == 0) {
+        return;
+    }
 
-bool string2bool(const std::string & v) {
-    return !v.empty () && (strcasecmp (v.c_str (), "true") == 0 || atoi (v.c_str ()) != 0);
-}
+    if (ngx_http_polaris_limit_agent != NULL) {
+        ngx_http_polaris_limit_prewarm_event.handler = ngx_http_polaris_limit_prewarm_handler;
+        ngx_http_polaris_limit_prewarm_event.data = reinterpret_cast<void *>(
+            static_cast<uintptr_t>(ngx_current_msec + prewarm));
+        ngx_http_polaris_limit_prewarm_event.log = cycle->log;
+        ngx_http_polaris_limit_prewarm_event.cancelable = 1;
+        ngx_http_polaris_limit_prewarm_handler(&ngx_http_polaris_limit_prewarm_event);
+        return;
+    }
 
-/* 读取配置参数 polaris_limit */
-static char *ngx_http_polaris_limit_conf_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
-    ngx_http_polaris_limit_conf_t      *plcf;
-    ngx_uint_t                          i;
-    ngx_str_t                          *value;
-    plcf = reinterpret_cast<ngx_http_polaris_limit_conf_t *>(conf);
-    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+    limit_api = Limit_API_SINGLETON.GetLimitApi();
+    if (limit_api == NULL) {
+        return;
+    }
 
-    bool has_namespace = false;
-    bool has_service = false;
-    bool has_enable = false;
-  
-    for (i = 1; i < cf->args->nelts; i++) {
-        if (ngx_strncmp(value[i].data, KEY_NAMESPACE, KEY_NAMESPACE_SIZE) == 0) {
-            size_t ns_size = value[i].len - KEY_NAMESPACE_SIZE;
-            if (ns_size > 0) {
-                ngx_str_t namespace_str = {value[i].len - KEY_NAMESPACE_SIZE, &value[i].data[KEY_NAMESPACE_SIZE]};
-                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx namespace", &namespace_str);
-                plcf->service_namespace = std::string(reinterpret_cast<char *>(namespace_str.data), namespace_str.len);
-                has_namespace = true;
-            }
-            continue;
-        }
+    const std::map<std::string, LimitServiceContext*>& services = LimitServiceRegistry::Instance().Services();
+    std::map<std::string, LimitServiceContext*>::const_iterator it;
+    start = ngx_polaris_limit_stat_now_us();
 
-        if (ngx_strncmp(value[i].data, KEY_SERVICE_NAME, KEY_SERVICE_NAME_SIZE) == 0) {
-            size_t svc_size = value[i].len - KEY_SERVICE_NAME_SIZE;
-            if (svc_size > 0) {
-                ngx_str_t svc_name_str = {value[i].len - KEY_SERVICE_NAME_SIZE, &value[i].data[KEY_SERVICE_NAME_SIZE]};
-                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx service name", &svc_name_str);
-                plcf->service_name = std::string(reinterpret_cast<char *>(svc_name_str.data), svc_name_str.len);
-                has_service = true;
-            }
-            continue;
+    for (it = services.begin(); it != services.end(); ++it) {
+        if (it->second->remote) {
+            (void) limit_api->FetchRuleLabelKeys(it->second->service_key, 0, label_keys);
         }
+    }
 
-        if (ngx_strncmp(value[i].data, KEY_ENABLE, KEY_ENABLE_SIZE) == 0) {
-            size_t enable_size = value[i].len - KEY_ENABLE_SIZE;
-            if (enable_size > 0) {
-                ngx_str_t enable_str = {value[i].len - KEY_ENABLE_SIZE, &value[i].data[KEY_ENABLE_SIZE]};
-                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx ratelimit enable value", &enable_str);
-                std::string enable_str_value = std::string(reinterpret_cast<char *>(enable_str.data), enable_str.len);
-                if (string2bool(enable_str_value)) {
-                  plcf->enable = 1;
-                } else {
-                  plcf->enable = 0;
-                }
-                ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %V as nginx ratelimit enable", plcf->enable);
-                has_enable = true;
-            }
+    for (it = services.begin(); it != services.end(); ++it) {
+        LimitServiceContext *service = it->second;
+        if (!service->remote) {
             continue;
         }
-       
+        total++;
+        elapsed = static_cast<ngx_msec_t>((ngx_polaris_limit_stat_now_us() - start) / 1000);
+        if (elapsed < prewarm
+            && limit_api->FetchRuleLabelKeys(service->service_key, prewarm - elapsed, label_keys) == polaris::kReturnOk) {
+            ready++;
+        }
     }
 
-    if (!has_namespace) {
-      const char *namespace_env_value = getenv(ENV_NAMESPACE.c_str());
-      if (NULL != namespace_env_value) {
-          plcf->service_namespace.assign(namespace_env_value);
-      } else {
-          plcf->service_namespace = DEFAULT_NAMESPACE;
-      }
-      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %s as nginx namespace", plcf->service_namespace.c_str());
+    if (total == 0) {
+        return;
     }
+    ngx_log_error(ready == total ? NGX_LOG_NOTICE : NGX_LOG_WARN, cycle->log, 0,
+        "[PolarisRateLimiting] prewarm rules of %ui/%ui services in %M ms", ready, total,
+        static_cast<ngx_msec_t>((ngx_polaris_limit_stat_now_us() - start) / 1000));
+}
 
-    if (!has_service) {
-      const char *service_env_value = getenv(ENV_SERVICE.c_str());
-      if (NULL != service_env_value) {
-          plcf->service_name.assign(service_env_value);
-      } else {
-          plcf->service_name = DEFAULT_SERVICE;
-      }
-      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %s as nginx service name", plcf->service_name.c_str());
+/* 读取代理已发布的规则，还有服务未发布时每隔PREWARM_POLL毫秒再检查，data为截止时间 */
+static void ngx_http_polaris_limit_prewarm_handler(ngx_event_t *ev) {
+    ngx_msec_t                          deadline = static_cast<ngx_msec_t>(reinterpret_cast<uintptr_t>(ev->data));
+    ngx_uint_t                          total = 0;
+    ngx_uint_t                          ready = 0;
+
+    const std::map<std::string, LimitServiceContext*>& services = LimitServiceRegistry::Instance().Services();
+    for (std::map<std::string, LimitServiceContext*>::const_iterator it = services.begin(); it != services.end(); ++it) {
+        if (!it->second->remote) {
+            continue;
+        }
+        total++;
+        if (ngx_http_polaris_limit_agent_refresh(it->second) == NGX_OK) {
+            ready++;
+        }
     }
 
-    if (!has_enable) {
-      const char *enable_env_value = getenv(ENV_RATELIMIT_ENABLE.c_str());
-      if (NULL != enable_env_value) {
-          std::string enable_str = std::string(enable_env_value);
-          plcf->enable = string2bool(enable_str) ? 1 : 0;
-      } else {
-          plcf->enable = 0;
-      }
-      ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use %d as nginx ratelimit enable", plcf->enable);
+    if (ready < total && !ngx_exiting && static_cast<ngx_msec_int_t>(ngx_current_msec - deadline) < 0) {
+        ngx_add_timer(ev, NGX_HTTP_POLARIS_LIMIT_PREWARM_POLL);
+        return;
     }
 
-    return static_cast<char *>(NGX_CONF_OK);
+    if (total == 0) {
+        return;
+    }
+    ngx_log_error(ready == total ? NGX_LOG_NOTICE : NGX_LOG_WARN, ev->log, 0,
+        "[PolarisRateLimiting] prewarm rules of %ui/%ui services from agent", ready, total);
 }
 
-/* 初始化limit模块 */
-static ngx_int_t ngx_http_polaris_limit_init(ngx_conf_t *cf) {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
-
-    // http核心模块的main_conf
-    cmcf = reinterpret_cast<ngx_http_core_main_conf_t *>(
-        ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module));
+/* 定时检查polaris.yaml，变化后在worker内替换LimitApi，不需要reload nginx */
+static void ngx_http_polaris_limit_watch_handler(ngx_event_t *ev) {
+    ngx_http_polaris_limit_main_conf_t *lmcf = reinterpret_cast<ngx_http_polaris_limit_main_conf_t *>(ev->data);
 
-    // 准备挂载模块，获取迭代器
-    h = reinterpret_cast<ngx_http_handler_pt *>(
-        ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers));
-    if (h == NULL) {
-        return NGX_ERROR;
+    if (ngx_exiting) {
+        return;
     }
+    Limit_API_SINGLETON.CheckConfigUpdate(ev->log);
+    ngx_add_timer(ev, lmcf->config_watch);
+}
 
-    *h = ngx_http_polaris_limit_handler;    // 挂载limit_req处理函数
-    return NGX_OK;
+static void ngx_http_polaris_limit_exit_process(ngx_cycle_t *cycle) {
+    if (ngx_polaris_limit_agent_stop() != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0, "[PolarisRateLimiting] agent thread is still calling LimitApi, skip destroy");
+        return;
+    }
+    Limit_API_SINGLETON.Destroy(cycle->log);
 }
 
 /* 创建 conf */
@@ -277,8 +3050,7 @@ static void *ngx_http_polaris_limit_create_conf(ngx_conf_t *cf) {
     }
 
     conf->status_code = 429;        // 限流默认返回429
-
-    Limit_API_SINGLETON.LoadPolarisConfig();
+    conf->tenant_borrow = NGX_CONF_UNSET_UINT;      // 默认租户不能借用全局配额
     return conf;
 }
 
@@ -290,100 +3062,275 @@ static char * ngx_http_polaris_limit_merge_conf(ngx_conf_t *cf, void *parent, vo
     return static_cast<char *>(NGX_CONF_OK);
 }
 
-static const std::string delimiter = ">=";
+void LabelExtractionPlan::Build(const std::set<std::string>* label_keys) {
+  m_label_keys = label_keys;
+  m_need_method = false;
+  m_need_caller_ip = false;
+  m_header_keys.clear();
+  m_query_keys.clear();
+  if (label_keys == NULL) {
+    return;
+  }
 
-static void split_query(std::string& s, std::map<std::string, std::string>& v) {
-  size_t pos = 0;
-  std::string token;
-  while ((pos = s.find(delimiter)) != std::string::npos) {
-    token = s.substr(0, pos);
-    parse_query_token(token, v);
-    s.erase(0, pos + delimiter.length());
+  for (std::set<std::string>::const_iterator it = label_keys->begin(); it != label_keys->end(); ++it) {
+    const std::string& label_key = *it;
+    if (label_key == LABEL_KEY_METHOD) {
+      m_need_method = true;
+      continue;
+    }
+    if (label_key == LABEL_KEY_CALLER_IP) {
+      m_need_caller_ip = true;
+      continue;
+    }
+    if (label_key.size() > LABEL_KEY_HEADER.size() && label_key.compare(0, LABEL_KEY_HEADER.size(), LABEL_KEY_HEADER) == 0) {
+      HeaderLabelKey header_key;
+      header_key.lowcase_key = label_key.substr(LABEL_KEY_HEADER.size());
+      std::transform(header_key.lowcase_key.begin(), header_key.lowcase_key.end(), header_key.lowcase_key.begin(), ::tolower);
+      header_key.hash = ngx_hash_key(reinterpret_cast<u_char *>(&header_key.lowcase_key[0]), header_key.lowcase_key.size());
+      header_key.label_key = label_key;
+      m_header_keys.push_back(header_key);
+      continue;
+    }
+    if (label_key.size() > LABEL_KEY_QUERY.size() && label_key.compare(0, LABEL_KEY_QUERY.size(), LABEL_KEY_QUERY) == 0) {
+      QueryLabelKey query_key;
+      query_key.key = label_key.substr(LABEL_KEY_QUERY.size());
+      query_key.label_key = label_key;
+      m_query_keys.push_back(query_key);
+      continue;
+    }
   }
-  parse_query_token(token, v);
 }
 
-static void parse_query_token(const std::string& token, std::map<std::string, std::string>& v) {
-  std::size_t found = token.find("=");
-  if (found != std::string::npos) {
-    std::string key = token.substr(0, found);
-    std::string value = token.substr(found + 1);
-    v[key] = value;
+void LabelExtractionPlan::Extract(ngx_http_request_t *r, const ngx_str_t *caller_ip,
+                                  std::map<std::string, std::string>& labels) const {
+  if (m_need_method) {
+    labels[LABEL_KEY_METHOD].assign(reinterpret_cast<char *>(r->method_name.data), r->method_name.len);
   }
-}
 
-static void get_labels_from_request(ngx_http_request_t* r, const std::set<std::string>*& label_keys,
-                                      std::map<std::string, std::string>& keyword_map) {
-  if (label_keys == NULL) {
-    return;
-  }                                      
-  if (label_keys->find(LABEL_KEY_METHOD) != label_keys->end()) {
-    std::string method_name(reinterpret_cast<char *>(r->method_name.data), r->method_name.len);
-    keyword_map[LABEL_KEY_METHOD] = method_name;
-  }
-
-  std::set<std::string> rule_query_keys ;
-  std::set<std::string> rule_header_keys;
-  for (std::set<std::string>::iterator it = label_keys->begin(); it != label_keys->end(); it++) {
-    std::string label_key = *it;
-    if (label_key.rfind(LABEL_KEY_HEADER, 0) == 0) {
-        std::string rule_header_key = label_key.substr(LABEL_KEY_HEADER.length());
-        if (!rule_header_key.empty()) {
-          rule_header_keys.insert(rule_header_key);
-        }
-        continue;
-    }
-    if (label_key.rfind(LABEL_KEY_QUERY, 0) == 0) {
-        std::string rule_query_key = label_key.substr(LABEL_KEY_QUERY.length());
-        if (!rule_query_key.empty()) {
-          rule_query_keys.insert(rule_query_key);
-        }
-        continue;
-    }
-  }
-
-  ngx_http_headers_in_t headers_in = r->headers_in;
-  ngx_list_t *headers = &(headers_in.headers);
-  ngx_uint_t i;
-  ngx_list_part_t *part = &(headers->part);
-  ngx_table_elt_t *head;
-  std::string head_key;
-  std::string head_value;
-  std::string query_str;
-  // parse header
-  if (!rule_header_keys.empty()) {
-    for (part = &(headers->part); part != NULL; part = part->next) {
-      head = reinterpret_cast<ngx_table_elt_t*>(part->elts);
-      for (i = 0; i < part->nelts; ++i) {
-        head_key = std::string(reinterpret_cast<char *>(head[i].key.data), head[i].key.len);
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-          "deal with head_key: %s", head_key.c_str());
+  if (m_need_caller_ip && caller_ip != NULL && caller_ip->len > 0) {
+    labels[LABEL_KEY_CALLER_IP].assign(reinterpret_cast<char *>(caller_ip->data), caller_ip->len);
+  }
 
-        if (rule_header_keys.find(head_key) != rule_header_keys.end()) {
-          head_value = std::string(reinterpret_cast<char *>(head[i].value.data), head[i].value.len);
-          ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "deal with head_key: %s, head_value: %s, is keyword.", head_key.c_str(),
-            head_value.c_str());
-          keyword_map[LABEL_KEY_HEADER + head_key] = head_value;
+  // parse header，直接比较nginx解析时计算好的小写hash，避免逐个复制header
+  if (!m_header_keys.empty()) {
+    ngx_list_part_t *part;
+    ngx_table_elt_t *head;
+    ngx_uint_t i;
+    for (part = &r->headers_in.headers.part; part != NULL; part = part->next) {
+      head = reinterpret_cast<ngx_table_elt_t *>(part->elts);
+      for (i = 0; i < part->nelts; ++i) {
+        if (head[i].hash == 0) {
+          continue;
+        }
+        for (std::vector<HeaderLabelKey>::const_iterator it = m_header_keys.begin(); it != m_header_keys.end(); ++it) {
+          if (head[i].hash == it->hash && head[i].key.len == it->lowcase_key.size()
+              && ngx_strncmp(head[i].lowcase_key, it->lowcase_key.data(), head[i].key.len) == 0) {
+            labels[it->label_key].assign(reinterpret_cast<char *>(head[i].value.data), head[i].value.len);
+            break;
+          }
         }
       }
     }
   }
+
   // parse query
-  std::map<std::string, std::string> query_values;
-  if (!rule_query_keys.empty()) {
-    query_str = std::string(reinterpret_cast<char *>(r->args.data), r->args.len);
-    if (!query_str.empty()) {
-      split_query(query_str, query_values);
-      std::map<std::string, std::string>::iterator found;
-      for (std::set<std::string>::iterator it = rule_query_keys.begin(); it != rule_query_keys.end(); it++) {
-        std::string rule_query_key = *it;
-        found = query_values.find(rule_query_key);
-        if (found != query_values.end()) {
-          keyword_map[LABEL_KEY_QUERY + rule_query_key] = found->second;
+  if (!m_query_keys.empty() && r->args.len > 0) {
+    ngx_str_t value;
+    for (std::vector<QueryLabelKey>::const_iterator it = m_query_keys.begin(); it != m_query_keys.end(); ++it) {
+      if (ngx_http_arg(r, reinterpret_cast<u_char *>(const_cast<char *>(it->key.data())), it->key.size(), &value) == NGX_OK) {
+        labels[it->label_key].assign(reinterpret_cast<char *>(value.data), value.len);
+      }
+    }
+  }
+}
+
+LimitServiceMap* LimitServiceRegistry::Create(ngx_pool_t* pool) {
+  ngx_pool_cleanup_t* cln = ngx_pool_cleanup_add(pool, 0);
+  if (cln == NULL) {
+    return NULL;
+  }
+  LimitServiceMap* services = new LimitServiceMap();
+  cln->handler = Release;
+  cln->data = services;
+  m_services = services;
+  return services;
+}
+
+void LimitServiceRegistry::Release(void* data) {
+  LimitServiceMap* services = reinterpret_cast<LimitServiceMap*>(data);
+  for (LimitServiceMap::iterator it = services->begin(); it != services->end(); ++it) {
+    delete it->second->agent_label_keys;
+    delete it->second;
+  }
+  // 配置检查失败时新cycle立即释放，不再指向已释放的服务表
+  LimitServiceRegistry& registry = Instance();
+  if (registry.m_services == services) {
+    registry.m_services = &registry.m_empty;
+  }
+  delete services;
+}
+
+LimitServiceContext* LimitServiceRegistry::Get(const std::string& service_namespace, const std::string& service_name) {
+  std::string key = service_namespace + "/" + service_name;
+  std::map<std::string, LimitServiceContext*>::iterator it = m_services->find(key);
+  if (it != m_services->end()) {
+    return it->second;
+  }
+  LimitServiceContext* service = new LimitServiceContext();
+  service->stat_index = m_services->size();
+  service->service_key.namespace_ = service_namespace;
+  service->service_key.name_ = service_name;
+  (*m_services)[key] = service;
+  return service;
+}
+
+void LimitServiceRegistry::Invalidate() {
+  for (std::map<std::string, LimitServiceContext*>::iterator it = m_services->begin(); it != m_services->end(); ++it) {
+    it->second->label_plan.Build(NULL);
+  }
+}
+
+bool QuotaLeaseTable::TryAcquire(const std::string& key, int64_t cost, ngx_msec_t now) {
+  std::map<std::string, QuotaLease>::iterator it = m_leases.find(key);
+  if (it == m_leases.end()) {
+    if (m_leases.size() >= NGX_HTTP_POLARIS_LIMIT_MAX_LEASES) {
+      // 清理已过期的租约，仍然没有空间时不再为新key租用
+      for (it = m_leases.begin(); it != m_leases.end(); ) {
+        if (static_cast<ngx_msec_int_t>(now - it->second.expire) >= 0) {
+          m_leases.erase(it++);
+        } else {
+          ++it;
+        }
+      }
+      if (m_leases.size() >= NGX_HTTP_POLARIS_LIMIT_MAX_LEASES) {
+        return false;
+      }
+    }
+    QuotaLease lease;
+    memset(&lease, 0, sizeof(lease));
+    lease.expire = now;
+    lease.window_start = now;
+    it = m_leases.insert(std::make_pair(key, lease)).first;
+  }
+
+  QuotaLease& lease = it->second;
+  lease.window_count += cost;
+  ngx_msec_t elapsed = now - lease.window_start;
+  if (elapsed >= 1000) {
+    double rate = static_cast<double>(lease.window_count) / elapsed;
+    lease.rate = lease.rate == 0 ? rate : (lease.rate + rate) / 2;    // 指数平滑
+    lease.window_start = now;
+    lease.window_count = 0;
+  }
+
+  if (lease.tokens < cost || static_cast<ngx_msec_int_t>(now - lease.expire) >= 0) {
+    lease.tokens = 0;                       // SDK不支持归还配额，过期或不足当前请求的配额直接作废
+    return false;
+  }
+  lease.tokens -= cost;
+  return true;
+}
+
+int64_t QuotaLeaseTable::NextLeaseSize(const std::string& key, ngx_uint_t percent) const {
+  std::map<std::string, QuotaLease>::const_iterator it = m_leases.find(key);
+  if (it == m_leases.end() || it->second.all_quota <= 0 || it->second.duration == 0) {
+    return 1;                               // 还不知道规则配额，先按单个请求获取
+  }
+  const QuotaLease& lease = it->second;
+  int64_t max_size = lease.all_quota * percent / 100;
+  // 租约按本地速率预计在规则周期的percent%内用完
+  int64_t size = static_cast<int64_t>(lease.rate * lease.duration * percent / 100) + 1;
+  if (size > max_size) {
+    size = max_size;
+  }
+  return size > 1 ? size : 1;
+}
+
+void QuotaLeaseTable::Grant(const std::string& key, int64_t amount, int64_t cost, ngx_uint_t percent,
+                            const polaris::QuotaResultInfo& info, ngx_msec_t now) {
+  std::map<std::string, QuotaLease>::iterator it = m_leases.find(key);
+  if (it == m_leases.end()) {
+    return;
+  }
+  QuotaLease& lease = it->second;
+  lease.all_quota = info.all_quota_;
+  lease.duration = info.duration_;
+  if (info.is_degrade_ || amount <= cost || info.duration_ == 0) {
+    return;                                 // 降级结果不代表远端配额，不作为租约
+  }
+  lease.tokens = amount - cost;
+  // 租约最长保留两倍的预计使用时间，且不跨越超过一个规则周期
+  uint64_t ttl = info.duration_ * percent * 2 / 100;
+  lease.expire = now + static_cast<ngx_msec_t>(ttl > 0 ? ttl : 1);
+}
+
+bool QuotaPressureTable::Shed(const std::string& key, ngx_uint_t reserve, ngx_msec_t now) const {
+  std::map<std::string, Pressure>::const_iterator it = m_pressures.find(key);
+  if (it == m_pressures.end() || static_cast<ngx_msec_int_t>(now - it->second.expire) >= 0) {
+    return false;
+  }
+  return it->second.left_quota * 100 < it->second.all_quota * static_cast<int64_t>(reserve);
+}
+
+void QuotaPressureTable::Update(const std::string& key, polaris::QuotaResultCode result,
+                                const polaris::QuotaResultInfo& info, ngx_msec_t now) {
+  if (info.is_degrade_ || info.all_quota_ <= 0 || info.duration_ == 0) {
+    return;                                 // 降级结果不代表远端配额
+  }
+
+  std::map<std::string, Pressure>::iterator it = m_pressures.find(key);
+  if (it == m_pressures.end()) {
+    if (m_pressures.size() >= NGX_HTTP_POLARIS_LIMIT_MAX_LEASES) {
+      for (it = m_pressures.begin(); it != m_pressures.end(); ) {
+        if (static_cast<ngx_msec_int_t>(now - it->second.expire) >= 0) {
+          m_pressures.erase(it++);
+        } else {
+          ++it;
         }
       }
+      if (m_pressures.size() >= NGX_HTTP_POLARIS_LIMIT_MAX_LEASES) {
+        return;
+      }
+    }
+    it = m_pressures.insert(std::make_pair(key, Pressure())).first;
+  }
+
+  Pressure& pressure = it->second;
+  pressure.left_quota = result == polaris::kQuotaResultLimited ? 0 : info.left_quota_;
+  pressure.all_quota = info.all_quota_;
+  pressure.expire = now + static_cast<ngx_msec_t>(info.duration_);
+}
+
+bool QuotaDegradeTable::Get(const std::string& key, int64_t& all_quota, uint64_t& duration) const {
+  std::map<std::string, Quota>::const_iterator it = m_quotas.find(key);
+  if (it == m_quotas.end()) {
+    return false;
+  }
+  all_quota = it->second.all_quota;
+  duration = it->second.duration;
+  return true;
+}
+
+void QuotaDegradeTable::Update(const std::string& key, const polaris::QuotaResultInfo& info) {
+  if (info.is_degrade_ || info.all_quota_ <= 0 || info.duration_ == 0) {
+    return;                                 // 降级结果不代表远端配额
+  }
+
+  std::map<std::string, Quota>::iterator it = m_quotas.find(key);
+  if (it == m_quotas.end()) {
+    if (m_quotas.size() >= NGX_HTTP_POLARIS_LIMIT_MAX_LEASES) {
+      return;                               // 规则配额不过期，记录满后新key超时时按fail=处理
     }
+    it = m_quotas.insert(std::make_pair(key, Quota())).first;
+  }
+  it->second.all_quota = info.all_quota_;
+  it->second.duration = info.duration_;
+}
+
+void QuotaLeaseTable::Revoke(const std::string& key) {
+  std::map<std::string, QuotaLease>::iterator it = m_leases.find(key);
+  if (it != m_leases.end()) {
+    it->second.tokens = 0;
   }
 }
 
@@ -438,7 +3385,10 @@ std::string resolveNgxLogDir(ngx_log_t *logger) {
   return filename_str.substr(0, pos);
 }
 
-void LimitApiWrapper::Init(ngx_log_t *logger) {
+void LimitApiWrapper::Init(ngx_log_t *logger, const std::string& path, const std::string& config, time_t mtime) {
+  m_config_path = path;
+  m_polaris_config = config;
+  m_config_mtime = mtime;
   ngx_log_error(NGX_LOG_NOTICE, logger, 0, "[PolarisRateLimiting] start to init polaris limit api, polaris config %s", m_polaris_config.c_str());
   std::string logDir = resolveNgxLogDir(logger);
   if (logDir.size() == 0) {
@@ -448,13 +3398,74 @@ void LimitApiWrapper::Init(ngx_log_t *logger) {
   polaris::SetLogDir(logDir);
 
   std::string err_msg("");
-  m_limit = polaris::LimitApi::CreateFromString(m_polaris_config, err_msg);
-  if (NULL == m_limit) {
+  polaris::LimitApi* limit = polaris::LimitApi::CreateFromString(m_polaris_config, err_msg);
+  m_limit.store(limit, std::memory_order_release);
+  if (NULL == limit) {
     ngx_log_error(NGX_LOG_ERR, logger, 0, "[PolarisRateLimiting] fail to create limit api, err: %s", err_msg.c_str());
   } else {
     ngx_log_error(NGX_LOG_NOTICE, logger, 0, "[PolarisRateLimiting] success to init polaris limit api");
   }
-  m_created = true;
+}
+
+std::string LimitApiWrapper::DefaultConfigPath() {
+  return get_polaris_conf_path();
+}
+
+void LimitApiWrapper::CheckConfigUpdate(ngx_log_t *logger) {
+  struct stat st;
+
+  ReapRetired(logger, false);
+
+  if (stat(m_config_path.c_str(), &st) != 0 || st.st_mtime == m_config_mtime) {
+    return;
+  }
+
+  std::string content;
+  LoadPolarisConfig(m_config_path, content, m_config_mtime);
+  if (content == m_polaris_config) {
+    return;
+  }
+
+  ngx_log_error(NGX_LOG_NOTICE, logger, 0, "[PolarisRateLimiting] polaris config %s changed, recreate limit api", m_config_path.c_str());
+  std::string err_msg("");
+  polaris::LimitApi* limit = polaris::LimitApi::CreateFromString(content, err_msg);
+  if (NULL == limit) {
+    ngx_log_error(NGX_LOG_ERR, logger, 0, "[PolarisRateLimiting] fail to create limit api, keep the old one, err: %s", err_msg.c_str());
+    return;
+  }
+
+  // 线程池中可能还有任务在使用旧的LimitApi，超过获取配额的超时时间后再销毁
+  polaris::LimitApi* old_limit = m_limit.exchange(limit, std::memory_order_acq_rel);
+  if (NULL != old_limit) {
+    m_retired.push_back(std::make_pair(old_limit, ngx_current_msec + NGX_HTTP_POLARIS_LIMIT_RETIRE_DELAY));
+  }
+  m_polaris_config = content;
+  LimitServiceRegistry::Instance().Invalidate();
+  ngx_log_error(NGX_LOG_NOTICE, logger, 0, "[PolarisRateLimiting] success to reload polaris limit api");
+}
+
+void LimitApiWrapper::ReapRetired(ngx_log_t *logger, bool all) {
+  std::vector<std::pair<polaris::LimitApi*, ngx_msec_t> >::iterator it = m_retired.begin();
+  while (it != m_retired.end()) {
+    if (all || static_cast<ngx_msec_int_t>(ngx_current_msec - it->second) >= 0) {
+      delete it->first;
+      it = m_retired.erase(it);
+      ngx_log_error(NGX_LOG_INFO, logger, 0, "[PolarisRateLimiting] retired polaris limit api destroyed");
+    } else {
+      ++it;
+    }
+  }
+}
+
+void LimitApiWrapper::Destroy(ngx_log_t *logger) {
+  // 线程池在core模块的exit_process中已经退出，代理线程在调用前已停止，这里没有正在使用LimitApi的线程
+  ReapRetired(logger, true);
+  polaris::LimitApi* limit = m_limit.exchange(NULL, std::memory_order_acq_rel);
+  if (NULL == limit) {
+    return;
+  }
+  delete limit;
+  ngx_log_error(NGX_LOG_NOTICE, logger, 0, "[PolarisRateLimiting] polaris limit api destroyed");
 }
 
 /// @brief 将文件内容读入字符串中
@@ -463,8 +3474,8 @@ std::string readFileIntoString(const std::string& path) {
     return std::string((std::istreambuf_iterator<char>(input_file)), std::istreambuf_iterator<char>());
 }
 
-/// @brief 支持环境变量展开
-static std::string expand_environment_variables( const std::string &s ) {
+/// @brief 支持环境变量展开，展开过的变量记录在env中，worker中重新展开时沿用master的值
+static std::string expand_environment_variables( const std::string &s, std::map<std::string, std::string>& env ) {
     if( s.find( "${" ) == std::string::npos ) return s;
 
     std::string pre  = s.substr( 0, s.find( "${" ) );
@@ -477,20 +3488,30 @@ static std::string expand_environment_variables( const std::string &s ) {
 
     post = post.substr( post.find( '}' ) + 1 );
 
-    const char *v = getenv( variable.c_str() );
-    if( v != NULL ) value = std::string( v );
+    std::map<std::string, std::string>::iterator it = env.find( variable );
+    if( it != env.end() ) {
+        value = it->second;
+    } else {
+        const char *v = getenv( variable.c_str() );
+        if( v != NULL ) value = std::string( v );
+        env[variable] = value;
+    }
 
-    return expand_environment_variables( pre + value + post );
+    return expand_environment_variables( pre + value + post, env );
 }
 
-void LimitApiWrapper::LoadPolarisConfig() {
-  std::string conf_path = get_polaris_conf_path();
-  std::string content("");
-  if (exist_file(conf_path)) {
-    content = readFileIntoString(conf_path);
+void LimitApiWrapper::LoadPolarisConfig(const std::string& path, std::string& content, time_t& mtime) {
+  struct stat st;
+  content.clear();
+  mtime = 0;
+  if (exist_file(path)) {
+    content = readFileIntoString(path);
+    if (stat(path.c_str(), &st) == 0) {
+      mtime = st.st_mtime;
+    }
   }
   if (content.size() == 0) {
     content = defaultConfigContent;
   }
-  m_polaris_config = expand_environment_variables(content);
+  content = expand_environment_variables(content, m_env);
 }
\ No newline at end of file
@@ -21,13 +21,22 @@ extern "C" {
 }
 
 #include "polaris/limit.h"
+#include "ngx_polaris_limit_shm.h"
+#include "ngx_polaris_limit_rule.h"
+#include "ngx_polaris_limit_stat.h"
+#include "ngx_polaris_limit_agent.h"
 #include <iostream>
 #include <string>
 #include <unistd.h>
 #include <fstream>
 #include <cstring>
 #include <cstdlib>
-#include <mutex>
+#include <cmath>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 
 static const char KEY_ENABLE[] = "enable=";
 static const uint32_t KEY_ENABLE_SIZE = sizeof(KEY_ENABLE) - 1;
@@ -35,6 +44,100 @@ static const char KEY_NAMESPACE[] = "namespace=";
 static const uint32_t KEY_NAMESPACE_SIZE = sizeof(KEY_NAMESPACE) - 1;
 static const char KEY_SERVICE_NAME[] = "service=";
 static const uint32_t KEY_SERVICE_NAME_SIZE = sizeof(KEY_SERVICE_NAME) - 1;
+static const char KEY_MODE[] = "mode=";
+static const uint32_t KEY_MODE_SIZE = sizeof(KEY_MODE) - 1;
+static const char KEY_ZONE[] = "zone=";
+static const uint32_t KEY_ZONE_SIZE = sizeof(KEY_ZONE) - 1;
+static const char KEY_RATE[] = "rate=";
+static const uint32_t KEY_RATE_SIZE = sizeof(KEY_RATE) - 1;
+static const char KEY_BURST[] = "burst=";
+static const uint32_t KEY_BURST_SIZE = sizeof(KEY_BURST) - 1;
+static const char KEY_TENANT[] = "tenant=";
+static const uint32_t KEY_TENANT_SIZE = sizeof(KEY_TENANT) - 1;
+static const char KEY_TENANT_SHARE[] = "tenant_share=";
+static const uint32_t KEY_TENANT_SHARE_SIZE = sizeof(KEY_TENANT_SHARE) - 1;
+static const char KEY_TENANT_BORROW[] = "tenant_borrow=";
+static const uint32_t KEY_TENANT_BORROW_SIZE = sizeof(KEY_TENANT_BORROW) - 1;
+static const char KEY_EARLY[] = "early=";
+static const uint32_t KEY_EARLY_SIZE = sizeof(KEY_EARLY) - 1;
+static const char KEY_HOLD[] = "hold=";
+static const uint32_t KEY_HOLD_SIZE = sizeof(KEY_HOLD) - 1;
+static const char KEY_HEAVY_KEY[] = "heavy_key=";
+static const uint32_t KEY_HEAVY_KEY_SIZE = sizeof(KEY_HEAVY_KEY) - 1;
+static const char KEY_HEAVY_SHARE[] = "heavy_share=";
+static const uint32_t KEY_HEAVY_SHARE_SIZE = sizeof(KEY_HEAVY_SHARE) - 1;
+static const char KEY_LIMIT_KEY[] = "key=";
+static const uint32_t KEY_LIMIT_KEY_SIZE = sizeof(KEY_LIMIT_KEY) - 1;
+static const char KEY_ASYNC[] = "async=";
+static const uint32_t KEY_ASYNC_SIZE = sizeof(KEY_ASYNC) - 1;
+static const char KEY_THREAD_POOL[] = "thread_pool=";
+static const uint32_t KEY_THREAD_POOL_SIZE = sizeof(KEY_THREAD_POOL) - 1;
+static const char KEY_TIMEOUT[] = "timeout=";
+static const uint32_t KEY_TIMEOUT_SIZE = sizeof(KEY_TIMEOUT) - 1;
+static const char KEY_FAIL[] = "fail=";
+static const uint32_t KEY_FAIL_SIZE = sizeof(KEY_FAIL) - 1;
+static const char KEY_LEASE[] = "lease=";
+static const uint32_t KEY_LEASE_SIZE = sizeof(KEY_LEASE) - 1;
+static const char KEY_DEGRADE_NODES[] = "degrade_nodes=";
+static const uint32_t KEY_DEGRADE_NODES_SIZE = sizeof(KEY_DEGRADE_NODES) - 1;
+static const char KEY_BYPASS[] = "bypass=";
+static const uint32_t KEY_BYPASS_SIZE = sizeof(KEY_BYPASS) - 1;
+static const char KEY_BLOCK[] = "block=";
+static const uint32_t KEY_BLOCK_SIZE = sizeof(KEY_BLOCK) - 1;
+static const char KEY_CONCURRENCY[] = "concurrency=";
+static const uint32_t KEY_CONCURRENCY_SIZE = sizeof(KEY_CONCURRENCY) - 1;
+static const char KEY_PRIORITY[] = "priority=";
+static const uint32_t KEY_PRIORITY_SIZE = sizeof(KEY_PRIORITY) - 1;
+static const char KEY_PRIORITY_RESERVE[] = "priority_reserve=";
+static const uint32_t KEY_PRIORITY_RESERVE_SIZE = sizeof(KEY_PRIORITY_RESERVE) - 1;
+static const char KEY_SHED_TARGET[] = "shed_target=";
+static const uint32_t KEY_SHED_TARGET_SIZE = sizeof(KEY_SHED_TARGET) - 1;
+static const char KEY_SHED_INTERVAL[] = "shed_interval=";
+static const uint32_t KEY_SHED_INTERVAL_SIZE = sizeof(KEY_SHED_INTERVAL) - 1;
+static const char KEY_COST[] = "cost=";
+static const uint32_t KEY_COST_SIZE = sizeof(KEY_COST) - 1;
+static const char KEY_DELAY[] = "delay=";
+static const uint32_t KEY_DELAY_SIZE = sizeof(KEY_DELAY) - 1;
+static const char KEY_QUEUE[] = "queue=";
+static const uint32_t KEY_QUEUE_SIZE = sizeof(KEY_QUEUE) - 1;
+
+#define NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE      0           // 通过polaris.limiter集群限流
+#define NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL       1           // 通过共享内存在本机限流
+#define NGX_HTTP_POLARIS_LIMIT_MODE_CONCURRENCY 2           // 通过共享内存限制本机并发，上限随上游耗时自适应
+
+#define NGX_HTTP_POLARIS_LIMIT_FAIL_DEFAULT     0           // 超时放通，其他错误返回限流状态码
+#define NGX_HTTP_POLARIS_LIMIT_FAIL_OPEN        1           // 出错时放通
+#define NGX_HTTP_POLARIS_LIMIT_FAIL_CLOSED      2           // 出错时返回限流状态码
+
+#define NGX_HTTP_POLARIS_LIMIT_DEFAULT_TIMEOUT  1000        // 异步拉取规则的默认等待时间，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_EARLY_SALT       0x7f4a7c159e3779b9ULL       // 提前拒绝的客户端key，与location的限流桶区分
+
+#define NGX_HTTP_POLARIS_LIMIT_MAX_COST         1000000     // 单个请求最多消耗的配额数
+#define NGX_HTTP_POLARIS_LIMIT_MAX_LEASE        50          // 单次租用配额最多占规则总配额的百分比
+#define NGX_HTTP_POLARIS_LIMIT_MAX_LEASES       4096        // 每个服务在worker内最多保存的租约数
+
+#define NGX_HTTP_POLARIS_LIMIT_DEFAULT_QUEUE    100         // 每个worker中每个location默认最多排队的请求数
+#define NGX_HTTP_POLARIS_LIMIT_MAX_PRIORITIES   8           // 最多的优先级数
+
+#define NGX_HTTP_POLARIS_LIMIT_SHED_INTERVAL    100         // 排队时间持续超过目标多久后开始丢弃，单位毫秒
+#define NGX_HTTP_POLARIS_LIMIT_LAG_INTERVAL     100         // 检测事件循环延迟的定时器间隔，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_DELAY_STEP       50          // 远端未返回规则配额时重试获取配额的间隔，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_PREWARM_POLL      10          // 等待代理发布规则的定时器间隔，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_RULE_CHECK        1000        // 直接使用SDK时按规则内容确认版本的间隔，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_DEGRADE_RETRY     1000        // 远端超时后按本机份额限流的时间，之后重新访问远端，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_RETIRE_DELAY     60000       // 配置热更新后旧LimitApi延迟销毁的时间，单位毫秒
+
+#define NGX_HTTP_POLARIS_LIMIT_ACL_BYPASS       1           // 命中后直接放行
+#define NGX_HTTP_POLARIS_LIMIT_ACL_BLOCK        2           // 命中后直接返回限流状态码
+
+#define NGX_HTTP_POLARIS_LIMIT_STATUS_JSON      0           // 统计接口输出JSON
+#define NGX_HTTP_POLARIS_LIMIT_STATUS_PROMETHEUS 1          // 统计接口输出Prometheus文本格式
 
 static const std::string ENV_NAMESPACE = "polaris_nginx_namespace";
 static const std::string ENV_SERVICE = "polaris_nginx_service";
@@ -49,43 +152,229 @@ static const std::string LABEL_KEY_QUERY = "$query.";
 static const std::string LABEL_KEY_CALLER_IP = "$caller_ip";
 static const std::string PATH_SBIN = "sbin";
 static const std::string DEFAULT_POLARIS_LOG_DIR = "/tmp/polaris";
+static const std::string STATUS_ZONE_NAME = "polaris_rate_limiting_status";
+static const std::string AGENT_ZONE_NAME = "polaris_rate_limiting_agent";
 
-class LimitApiWrapper {
+/// @brief 规则中的header label，使用与ngx_table_elt_t相同的小写hash匹配请求头
+struct HeaderLabelKey {
+  ngx_uint_t    hash;                 // 小写header名的hash
+  std::string   lowcase_key;          // 小写header名
+  std::string   label_key;            // 规则中的label key，如 $header.X-User
+};
+
+/// @brief 规则中的query label
+struct QueryLabelKey {
+  std::string   key;                  // query参数名
+  std::string   label_key;            // 规则中的label key，如 $query.uid
+};
+
+/// @brief label提取计划，按规则版本构建一次，请求处理时直接按计划从请求中取值
+class LabelExtractionPlan {
+ public:
+  LabelExtractionPlan() : m_label_keys(NULL), m_need_method(false), m_need_caller_ip(false) {}
+
+  /// @brief 规则的label key集合与SDK规则数据同生命周期，指针变化即规则版本变化。
+  ///        指针相同时旧集合的地址可能已被新规则复用，直接使用SDK时还需按rule_version确认
+  bool IsStale(const std::set<std::string>* label_keys) const {
+    return m_label_keys != label_keys;
+  }
+
+  void Build(const std::set<std::string>* label_keys);
+
+  bool NeedCallerIp() const {
+    return m_need_caller_ip;
+  }
+
+  /// @brief caller_ip只在NeedCallerIp()时使用，可以为NULL
+  void Extract(ngx_http_request_t *r, const ngx_str_t *caller_ip, std::map<std::string, std::string>& labels) const;
+
+  size_t Size() const {
+    return m_header_keys.size() + m_query_keys.size() + (m_need_method ? 1 : 0) + (m_need_caller_ip ? 1 : 0);
+  }
+
+ private:
+  const std::set<std::string>*  m_label_keys;
+  bool                          m_need_method;
+  bool                          m_need_caller_ip;
+  std::vector<HeaderLabelKey>   m_header_keys;
+  std::vector<QueryLabelKey>    m_query_keys;
+};
+
+/// @brief 从远端批量租用的配额，只在worker的事件循环中访问
+struct QuotaLease {
+  int64_t       tokens;               // 剩余可用的租用配额
+  ngx_msec_t    expire;               // 租约过期时间，过期后剩余配额作废
+  ngx_msec_t    window_start;         // 本地速率统计窗口起点
+  uint64_t      window_count;         // 本地速率统计窗口内消耗的配额数
+  double        rate;                 // 平滑后的本地请求速率，每毫秒请求数
+  int64_t       all_quota;            // 规则一个周期内的总配额，0表示未知
+  uint64_t      duration;             // 规则周期，单位毫秒
+};
+
+/// @brief 按请求的method和labels保存租约，租用数量随本地速率调整
+class QuotaLeaseTable {
+ public:
+  /// @brief 统计本地消耗配额的速率，并从未过期的租约中扣减cost个配额
+  bool TryAcquire(const std::string& key, int64_t cost, ngx_msec_t now);
+
+  /// @brief 下次向远端租用的配额数，不超过规则总配额的percent%
+  int64_t NextLeaseSize(const std::string& key, ngx_uint_t percent) const;
+
+  /// @brief 远端批准了amount个配额，其中cost个已被当前请求使用
+  void Grant(const std::string& key, int64_t amount, int64_t cost, ngx_uint_t percent,
+             const polaris::QuotaResultInfo& info, ngx_msec_t now);
+
+  /// @brief 远端拒绝或出错，作废租约
+  void Revoke(const std::string& key);
+
+ private:
+  std::map<std::string, QuotaLease> m_leases;
+};
+
+/// @brief 按请求的method和labels记录远端最近返回的剩余配额，剩余配额不足时低优先级请求不再访问远端
+class QuotaPressureTable {
  public:
+  /// @brief 最近一次剩余配额低于总配额的reserve%时返回true，记录超过一个规则周期后失效
+  bool Shed(const std::string& key, ngx_uint_t reserve, ngx_msec_t now) const;
+
+  void Update(const std::string& key, polaris::QuotaResultCode result, const polaris::QuotaResultInfo& info, ngx_msec_t now);
+
+ private:
+  struct Pressure {
+    int64_t     left_quota;
+    int64_t     all_quota;
+    ngx_msec_t  expire;
+  };
+
+  std::map<std::string, Pressure> m_pressures;
+};
+
+/// @brief 按请求的method和labels记录远端最近返回的规则配额，远端不可达时按节点数分摊到本机
+class QuotaDegradeTable {
+ public:
+  /// @brief 返回最近一次获取到的规则配额，从未获取到时返回false
+  bool Get(const std::string& key, int64_t& all_quota, uint64_t& duration) const;
+
+  void Update(const std::string& key, const polaris::QuotaResultInfo& info);
+
+ private:
+  struct Quota {
+    int64_t     all_quota;
+    uint64_t    duration;
+  };
 
-  LimitApiWrapper() {
-    m_created = false;
+  std::map<std::string, Quota> m_quotas;
+};
+
+/// @brief 限流服务在worker内的状态，配置同一服务的location共享一份
+struct LimitServiceContext {
+  polaris::ServiceKey           service_key;
+  LabelExtractionPlan           label_plan;
+  RuleMatcher                   rule_matcher;         // 与label_plan同时按规则版本重建
+  QuotaLeaseTable               lease_table;
+  QuotaPressureTable            pressure_table;       // 按优先级保留配额
+  QuotaDegradeTable             degrade_table;        // 远端不可达时使用的规则配额
+  ngx_msec_t                    degrade_expire;       // 远端超时后在此之前不访问远端，0表示远端正常
+  ngx_uint_t                    stat_index;           // 在统计共享内存和代理规则中的下标
+  ngx_flag_t                    remote;               // 有location对该服务远端限流，worker启动时预先拉取规则
+  uint64_t                      rule_version;         // 构建rule_matcher时规则JSON的哈希，直接使用SDK时作为规则版本
+  ngx_msec_t                    rule_checked;         // 直接使用SDK时在此之后重新确认规则版本
+  ngx_atomic_uint_t             agent_version;        // 通过代理读取规则时，已读取的规则版本
+  std::set<std::string>        *agent_label_keys;     // 版本变化时整体替换，使label_plan判断为过期
+  std::string                   agent_rule;
+};
+
+typedef std::map<std::string, LimitServiceContext*> LimitServiceMap;
+
+/// @brief 每次加载配置创建一份服务表，只包含本次配置中的服务，随cycle的内存池释放。
+///        reload失败时master继续使用旧cycle，重新拉起的worker仍使用旧服务表，因此不能在原表上清空重建
+class LimitServiceRegistry {
+ public:
+  static LimitServiceRegistry& Instance() {
+    static LimitServiceRegistry registry;
+    return registry;
   }
 
-  void LoadPolarisConfig();
+  /// @brief create_main_conf中调用，创建新配置的服务表并作为当前表
+  LimitServiceMap* Create(ngx_pool_t* pool);
+
+  /// @brief worker启动时切换到所属cycle的服务表
+  void Use(LimitServiceMap* services) {
+    m_services = services;
+  }
 
-  void Init(ngx_log_t *ngx_log);
+  /// @brief 配置解析阶段调用，按命名空间和服务名获取服务状态，不存在时创建
+  LimitServiceContext* Get(const std::string& service_namespace, const std::string& service_name);
+
+  /// @brief LimitApi替换后规则数据的指针不再可比较，强制所有服务重建提取计划
+  void Invalidate();
+
+  size_t Size() const {
+    return m_services->size();
+  }
+
+  const std::map<std::string, LimitServiceContext*>& Services() const {
+    return *m_services;
+  }
+
+ private:
+  LimitServiceRegistry() : m_services(&m_empty) {}
+
+  static void Release(void* data);
+
+  LimitServiceMap*  m_services;
+  LimitServiceMap   m_empty;      // 没有http配置时使用
+};
+
+/// @brief 每个worker一个LimitApi，在init_process中创建，exit_process中销毁
+///        只在worker主线程中写入，线程池任务通过参数拿到指针
+///        启用polaris_rate_limiting_agent时只有代理worker创建，代理线程每次调用时读取指针，
+///        因此指针为原子变量，替换后旧的LimitApi延迟销毁，保证已读到旧指针的调用返回
+class LimitApiWrapper {
+ public:
+
+  LimitApiWrapper() : m_limit(NULL), m_config_mtime(0) {}
+
+  /// @brief 读取并展开配置文件，文件不存在或为空时使用默认配置，mtime为0
+  void LoadPolarisConfig(const std::string& path, std::string& content, time_t& mtime);
+
+  /// @brief 使用配置解析阶段读取的配置创建LimitApi，失败时保持未就绪状态
+  void Init(ngx_log_t *ngx_log, const std::string& path, const std::string& config, time_t mtime);
+
+  /// @brief 配置文件变化时创建新的LimitApi替换当前的，旧的延迟销毁
+  void CheckConfigUpdate(ngx_log_t *ngx_log);
+
+  void Destroy(ngx_log_t *ngx_log);
+
+  /// @brief nginx配置目录下的polaris.yaml，http和stream模块共用
+  static std::string DefaultConfigPath();
 
   static LimitApiWrapper& Instance() {
     static LimitApiWrapper limit_api;
     return limit_api;
   }
 
-  polaris::LimitApi* GetLimitApi(ngx_log_t *ngx_log) { 
-    if (m_created) {
-      return m_limit;
-    }
-    m_mtx.lock();
-    if (m_created) {
-      return m_limit;
-    }
-    Init(ngx_log);
-    m_mtx.unlock();
-    return m_limit;
+  /// @brief 返回NULL表示未就绪，调用方应放通请求
+  polaris::LimitApi* GetLimitApi() const {
+    return m_limit.load(std::memory_order_acquire);
   }
 
  private:
-  polaris::LimitApi* m_limit;
+  void ReapRetired(ngx_log_t *ngx_log, bool all);
+
+  std::atomic<polaris::LimitApi*> m_limit;
   std::string m_polaris_config;
-  std::mutex m_mtx;
-  bool m_created;
+  std::string m_config_path;
+  time_t m_config_mtime;
+  std::map<std::string, std::string> m_env;           // master中展开过的环境变量，worker中环境变量已被清理
+  std::vector<std::pair<polaris::LimitApi*, ngx_msec_t> > m_retired;
 };
 
 #define Limit_API_SINGLETON LimitApiWrapper::Instance()
 
+bool string2bool(const std::string& v);
+
+/// @brief 启用代理时非代理worker中返回代理，否则返回NULL。http模块的init_process先执行，stream模块据此转发远端限流
+ngx_polaris_limit_agent_ctx_t *ngx_http_polaris_limit_get_agent();
+
 #endif  // NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_HTTP_POLARIS_LIMIT_MODULE_H_
\ No newline at end of file
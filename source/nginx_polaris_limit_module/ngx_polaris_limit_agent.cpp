@@ -0,0 +1,506 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#include "ngx_polaris_limit_agent.h"
+
+#include <vector>
+
+#if (NGX_HAVE_POSIX_SEM)
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#endif
+
+/* 大小随服务数变化，服务数变化时reload会创建新的共享内存 */
+size_t ngx_polaris_limit_agent_zone_size(ngx_uint_t nservices) {
+#if (NGX_HAVE_POSIX_SEM)
+    size_t size;
+
+    size = NGX_POLARIS_LIMIT_AGENT_SLOTS * sizeof(ngx_polaris_limit_agent_slot_t)
+        + nservices * sizeof(ngx_polaris_limit_agent_rule_t);
+    return size + size / 64 + 8 * ngx_pagesize;     // slab页管理结构、控制结构和日志上下文的开销
+#else
+    return 8 * ngx_pagesize;
+#endif
+}
+
+#if (NGX_HAVE_POSIX_SEM)
+
+/* reload时服务数不变则沿用旧的请求槽，旧worker退出前仍可以得到应答 */
+ngx_int_t ngx_polaris_limit_agent_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_polaris_limit_agent_ctx_t      *octx = reinterpret_cast<ngx_polaris_limit_agent_ctx_t *>(data);
+    ngx_polaris_limit_agent_ctx_t      *ctx;
+    ngx_uint_t                          i;
+    size_t                              len;
+
+    ctx = reinterpret_cast<ngx_polaris_limit_agent_ctx_t *>(shm_zone->data);
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+
+    ctx->shpool = reinterpret_cast<ngx_slab_pool_t *>(shm_zone->shm.addr);
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = reinterpret_cast<ngx_polaris_limit_agent_shctx_t *>(ctx->shpool->data);
+        return NGX_OK;
+    }
+
+    ctx->sh = reinterpret_cast<ngx_polaris_limit_agent_shctx_t *>(
+        ngx_slab_calloc(ctx->shpool, sizeof(ngx_polaris_limit_agent_shctx_t)));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->nservices = ctx->nservices;
+    ctx->sh->slots = reinterpret_cast<ngx_polaris_limit_agent_slot_t *>(
+        ngx_slab_calloc(ctx->shpool, NGX_POLARIS_LIMIT_AGENT_SLOTS * sizeof(ngx_polaris_limit_agent_slot_t)));
+    ctx->sh->rules = reinterpret_cast<ngx_polaris_limit_agent_rule_t *>(
+        ngx_slab_calloc(ctx->shpool, ctx->nservices * sizeof(ngx_polaris_limit_agent_rule_t)));
+    if (ctx->sh->slots == NULL || ctx->sh->rules == NULL) {
+        return NGX_ERROR;
+    }
+
+    // 进程间共享的信号量，master中创建，所有worker继承
+    if (sem_init(&ctx->sh->request, 1, 0) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, shm_zone->shm.log, ngx_errno, "[PolarisRateLimiting] agent sem_init() failed");
+        return NGX_ERROR;
+    }
+    for (i = 0; i < NGX_POLARIS_LIMIT_AGENT_SLOTS; i++) {
+        if (sem_init(&ctx->sh->slots[i].done, 1, 0) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, shm_zone->shm.log, ngx_errno, "[PolarisRateLimiting] agent sem_init() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    len = sizeof(" in polaris_rate_limiting agent zone \"\"") + shm_zone->shm.name.len;
+    ctx->shpool->log_ctx = reinterpret_cast<u_char *>(ngx_slab_alloc(ctx->shpool, len));
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(ctx->shpool->log_ctx, " in polaris_rate_limiting agent zone \"%V\"%Z", &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/* 请求序列化为长度前缀的字段，超出槽位大小时返回false */
+static bool ngx_polaris_limit_agent_put(u_char *&p, u_char *end, const void *data, size_t len) {
+    if (static_cast<size_t>(end - p) < len) {
+        return false;
+    }
+    ngx_memcpy(p, data, len);
+    p += len;
+    return true;
+}
+
+static bool ngx_polaris_limit_agent_put_str(u_char *&p, u_char *end, const std::string& value) {
+    uint32_t len = static_cast<uint32_t>(value.size());
+    return ngx_polaris_limit_agent_put(p, end, &len, sizeof(len))
+        && ngx_polaris_limit_agent_put(p, end, value.data(), value.size());
+}
+
+static bool ngx_polaris_limit_agent_get(u_char *&p, u_char *end, void *data, size_t len) {
+    if (static_cast<size_t>(end - p) < len) {
+        return false;
+    }
+    ngx_memcpy(data, p, len);
+    p += len;
+    return true;
+}
+
+static bool ngx_polaris_limit_agent_get_str(u_char *&p, u_char *end, std::string& value) {
+    uint32_t len;
+    if (!ngx_polaris_limit_agent_get(p, end, &len, sizeof(len)) || static_cast<size_t>(end - p) < len) {
+        return false;
+    }
+    value.assign(reinterpret_cast<char *>(p), len);
+    p += len;
+    return true;
+}
+
+static size_t ngx_polaris_limit_agent_encode(const LimitAgentQuotaCall& call, u_char *buf, size_t size) {
+    u_char                             *p = buf;
+    u_char                             *end = buf + size;
+    uint32_t                            nlabels = static_cast<uint32_t>(call.labels.size());
+    uint64_t                            timeout = call.timeout;
+    u_char                              with_info = call.with_info ? 1 : 0;
+    std::map<std::string, std::string>::const_iterator it;
+
+    if (!ngx_polaris_limit_agent_put_str(p, end, call.service_namespace)
+        || !ngx_polaris_limit_agent_put_str(p, end, call.service_name)
+        || !ngx_polaris_limit_agent_put_str(p, end, call.method)
+        || !ngx_polaris_limit_agent_put(p, end, &nlabels, sizeof(nlabels))) {
+        return 0;
+    }
+    for (it = call.labels.begin(); it != call.labels.end(); ++it) {
+        if (!ngx_polaris_limit_agent_put_str(p, end, it->first) || !ngx_polaris_limit_agent_put_str(p, end, it->second)) {
+            return 0;
+        }
+    }
+    if (!ngx_polaris_limit_agent_put(p, end, &call.amount, sizeof(call.amount))
+        || !ngx_polaris_limit_agent_put(p, end, &call.cost, sizeof(call.cost))
+        || !ngx_polaris_limit_agent_put(p, end, &timeout, sizeof(timeout))
+        || !ngx_polaris_limit_agent_put(p, end, &with_info, sizeof(with_info))) {
+        return 0;
+    }
+    return p - buf;
+}
+
+static bool ngx_polaris_limit_agent_decode(u_char *buf, size_t len, LimitAgentQuotaCall& call) {
+    u_char                             *p = buf;
+    u_char                             *end = buf + len;
+    uint32_t                            nlabels;
+    uint64_t                            timeout;
+    u_char                              with_info;
+    std::string                         key;
+    std::string                         value;
+
+    if (!ngx_polaris_limit_agent_get_str(p, end, call.service_namespace)
+        || !ngx_polaris_limit_agent_get_str(p, end, call.service_name)
+        || !ngx_polaris_limit_agent_get_str(p, end, call.method)
+        || !ngx_polaris_limit_agent_get(p, end, &nlabels, sizeof(nlabels))) {
+        return false;
+    }
+    while (nlabels--) {
+        if (!ngx_polaris_limit_agent_get_str(p, end, key) || !ngx_polaris_limit_agent_get_str(p, end, value)) {
+            return false;
+        }
+        call.labels[key] = value;
+    }
+    if (!ngx_polaris_limit_agent_get(p, end, &call.amount, sizeof(call.amount))
+        || !ngx_polaris_limit_agent_get(p, end, &call.cost, sizeof(call.cost))
+        || !ngx_polaris_limit_agent_get(p, end, &timeout, sizeof(timeout))
+        || !ngx_polaris_limit_agent_get(p, end, &with_info, sizeof(with_info))) {
+        return false;
+    }
+    call.timeout = static_cast<ngx_msec_t>(timeout);
+    call.with_info = with_info != 0;
+    return true;
+}
+
+/* sem_timedwait使用CLOCK_REALTIME */
+static void ngx_polaris_limit_agent_deadline(struct timespec *ts, ngx_msec_t timeout) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += timeout / 1000;
+    ts->tv_nsec += (timeout % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static ngx_polaris_limit_agent_ctx_t   *ngx_polaris_limit_agent_ctx;
+static ngx_polaris_limit_agent_quota_pt ngx_polaris_limit_agent_quota;
+static ngx_polaris_limit_agent_rule_pt  ngx_polaris_limit_agent_rule;
+static ngx_log_t                       *ngx_polaris_limit_agent_log;
+static ngx_atomic_t                     ngx_polaris_limit_agent_stopped;
+static ngx_atomic_t                     ngx_polaris_limit_agent_running;
+
+/* 处理一个请求槽，worker已放弃等待时直接释放 */
+static void ngx_polaris_limit_agent_serve(ngx_polaris_limit_agent_slot_t *slot) {
+    LimitAgentQuotaCall                 call;
+    LimitAgentQuotaReply                reply = LimitAgentQuotaReply();
+
+    if (!ngx_atomic_cmp_set(&slot->state, NGX_POLARIS_LIMIT_AGENT_REQUEST, NGX_POLARIS_LIMIT_AGENT_SERVING)) {
+        return;
+    }
+
+    ngx_memzero(&reply.info, sizeof(reply.info));
+    reply.result = polaris::kQuotaResultOk;
+    if (slot->len <= NGX_POLARIS_LIMIT_AGENT_REQUEST_SIZE && ngx_polaris_limit_agent_decode(slot->request, slot->len, call)) {
+        reply.amount = call.amount;
+        ngx_polaris_limit_agent_quota(call, reply);
+    } else {
+        reply.ret = polaris::kReturnInvalidArgument;
+        reply.amount = 0;
+    }
+
+    slot->ret = reply.ret;
+    slot->result = reply.result;
+    slot->amount = reply.amount;
+    slot->left_quota = reply.info.left_quota_;
+    slot->all_quota = reply.info.all_quota_;
+    slot->duration = reply.info.duration_;
+    slot->degrade = reply.info.is_degrade_;
+    ngx_memory_barrier();
+
+    if (ngx_atomic_cmp_set(&slot->state, NGX_POLARIS_LIMIT_AGENT_SERVING, NGX_POLARIS_LIMIT_AGENT_DONE)) {
+        sem_post(&slot->done);
+        return;
+    }
+    slot->state = NGX_POLARIS_LIMIT_AGENT_FREE;
+}
+
+/* 规则变化时按seqlock写入共享内存，reload期间新旧代理可能同时发布，只有一个能进入写状态 */
+static void ngx_polaris_limit_agent_publish(ngx_uint_t index, const void*& published) {
+    ngx_polaris_limit_agent_rule_t     *r = &ngx_polaris_limit_agent_ctx->sh->rules[index];
+    ngx_atomic_uint_t                   version;
+    const void                         *current = NULL;
+    std::string                         name;
+    std::string                         keys;
+    std::string                         rule;
+
+    if (!ngx_polaris_limit_agent_rule(index, name, current, keys, rule) || current == published) {
+        return;
+    }
+    if (name.size() + keys.size() + rule.size() > NGX_POLARIS_LIMIT_AGENT_RULE_SIZE) {
+        ngx_log_error(NGX_LOG_WARN, ngx_polaris_limit_agent_log, 0,
+            "[PolarisRateLimiting] agent rule of %s is %uz bytes, over %d bytes, not published",
+            name.c_str(), name.size() + keys.size() + rule.size(), NGX_POLARIS_LIMIT_AGENT_RULE_SIZE);
+        published = current;
+        return;
+    }
+
+    version = r->version;
+    if ((version & 1) || !ngx_atomic_cmp_set(&r->version, version, version + 1)) {
+        return;                                                 // 另一个代理正在写入，下个周期再检查
+    }
+    ngx_memory_barrier();
+    r->name_len = name.size();
+    r->keys_len = keys.size();
+    r->rule_len = rule.size();
+    ngx_memcpy(r->data, name.data(), name.size());
+    ngx_memcpy(r->data + name.size(), keys.data(), keys.size());
+    ngx_memcpy(r->data + name.size() + keys.size(), rule.data(), rule.size());
+    ngx_memory_barrier();
+    r->version = version + 2;
+    published = current;
+}
+
+static void *ngx_polaris_limit_agent_thread(void *data) {
+    ngx_polaris_limit_agent_shctx_t    *sh = ngx_polaris_limit_agent_ctx->sh;
+    std::vector<const void *>           published(sh->nservices, static_cast<const void *>(NULL));
+    struct timespec                     ts;
+    struct timespec                     now;
+    time_t                              next_publish = 0;
+    sigset_t                            set;
+    ngx_uint_t                          i;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);                     // 信号由worker主线程处理
+
+    while (!ngx_polaris_limit_agent_stopped) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec * 1000 + now.tv_nsec / 1000000 >= next_publish) {
+            for (i = 0; i < sh->nservices; i++) {
+                ngx_polaris_limit_agent_publish(i, published[i]);
+            }
+            next_publish = now.tv_sec * 1000 + now.tv_nsec / 1000000 + NGX_POLARIS_LIMIT_AGENT_PUBLISH;
+        }
+
+        ngx_polaris_limit_agent_deadline(&ts, NGX_POLARIS_LIMIT_AGENT_PUBLISH);
+        if (sem_timedwait(&sh->request, &ts) == -1) {
+            continue;                                           // 超时或被信号中断
+        }
+        for (i = 0; i < NGX_POLARIS_LIMIT_AGENT_SLOTS; i++) {
+            if (sh->slots[i].state == NGX_POLARIS_LIMIT_AGENT_REQUEST) {
+                ngx_polaris_limit_agent_serve(&sh->slots[i]);
+            }
+        }
+    }
+    ngx_polaris_limit_agent_running = 0;
+    return NULL;
+}
+
+ngx_int_t ngx_polaris_limit_agent_start(ngx_polaris_limit_agent_ctx_t *ctx, ngx_polaris_limit_agent_quota_pt quota,
+    ngx_polaris_limit_agent_rule_pt rule, ngx_log_t *log) {
+    pthread_attr_t                      attr;
+    pthread_t                           tid;
+    int                                 err;
+
+    ngx_polaris_limit_agent_ctx = ctx;
+    ngx_polaris_limit_agent_quota = quota;
+    ngx_polaris_limit_agent_rule = rule;
+    ngx_polaris_limit_agent_log = log;
+    ngx_polaris_limit_agent_stopped = 0;
+    ngx_polaris_limit_agent_running = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&tid, &attr, ngx_polaris_limit_agent_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        ngx_polaris_limit_agent_running = 0;
+        ngx_log_error(NGX_LOG_ALERT, log, err, "[PolarisRateLimiting] agent pthread_create() failed");
+        return NGX_ERROR;
+    }
+    return NGX_OK;
+}
+
+/* 最多等待两个发布周期，SDK调用阻塞更久时返回NGX_BUSY，调用方不能再销毁LimitApi */
+ngx_int_t ngx_polaris_limit_agent_stop() {
+    ngx_uint_t                          n;
+
+    if (!ngx_polaris_limit_agent_running) {
+        return NGX_OK;
+    }
+    ngx_polaris_limit_agent_stopped = 1;
+    sem_post(&ngx_polaris_limit_agent_ctx->sh->request);
+
+    for (n = 0; n < NGX_POLARIS_LIMIT_AGENT_PUBLISH * 2 / 10; n++) {
+        if (!ngx_polaris_limit_agent_running) {
+            return NGX_OK;
+        }
+        ngx_msleep(10);
+    }
+    return NGX_BUSY;
+}
+
+polaris::ReturnCode ngx_polaris_limit_agent_get_quota(ngx_polaris_limit_agent_ctx_t *ctx, const LimitAgentQuotaCall& call,
+    LimitAgentQuotaReply& reply) {
+    ngx_polaris_limit_agent_shctx_t    *sh = ctx->sh;
+    ngx_polaris_limit_agent_slot_t     *slot = NULL;
+    u_char                              buf[NGX_POLARIS_LIMIT_AGENT_REQUEST_SIZE];
+    size_t                              len;
+    ngx_uint_t                          start;
+    ngx_uint_t                          i;
+    struct timespec                     ts;
+
+    len = ngx_polaris_limit_agent_encode(call, buf, sizeof(buf));
+    if (len == 0) {
+        return polaris::kReturnInvalidArgument;                 // labels过长
+    }
+
+    start = ngx_atomic_fetch_add(&sh->next, 1);
+    for (i = 0; i < NGX_POLARIS_LIMIT_AGENT_SLOTS; i++) {
+        slot = &sh->slots[(start + i) % NGX_POLARIS_LIMIT_AGENT_SLOTS];
+        if (slot->state == NGX_POLARIS_LIMIT_AGENT_FREE
+            && ngx_atomic_cmp_set(&slot->state, NGX_POLARIS_LIMIT_AGENT_FREE, NGX_POLARIS_LIMIT_AGENT_WRITING)) {
+            break;
+        }
+        slot = NULL;
+    }
+    if (slot == NULL) {
+        return polaris::kReturnTimeout;                         // 代理积压，按超时处理
+    }
+
+    ngx_memcpy(slot->request, buf, len);
+    slot->len = len;
+    ngx_memory_barrier();
+    slot->state = NGX_POLARIS_LIMIT_AGENT_REQUEST;
+    sem_post(&sh->request);
+
+    ngx_polaris_limit_agent_deadline(&ts, call.timeout);
+    while (sem_timedwait(&slot->done, &ts) == -1) {
+        if (ngx_errno == EINTR) {
+            continue;
+        }
+        // 等待超时，代理尚未处理时收回槽位，正在处理时由代理释放
+        if (ngx_atomic_cmp_set(&slot->state, NGX_POLARIS_LIMIT_AGENT_REQUEST, NGX_POLARIS_LIMIT_AGENT_FREE)
+            || ngx_atomic_cmp_set(&slot->state, NGX_POLARIS_LIMIT_AGENT_SERVING, NGX_POLARIS_LIMIT_AGENT_ABANDONED)) {
+            return polaris::kReturnTimeout;
+        }
+        while (sem_wait(&slot->done) == -1 && ngx_errno == EINTR) {
+            // 应答恰好在超时后写入，消耗掉对应的唤醒
+        }
+        break;
+    }
+
+    ngx_memory_barrier();
+    reply.ret = static_cast<polaris::ReturnCode>(slot->ret);
+    reply.result = static_cast<polaris::QuotaResultCode>(slot->result);
+    reply.amount = slot->amount;
+    reply.info.left_quota_ = slot->left_quota;
+    reply.info.all_quota_ = slot->all_quota;
+    reply.info.duration_ = slot->duration;
+    reply.info.is_degrade_ = slot->degrade != 0;
+    ngx_memory_barrier();
+    slot->state = NGX_POLARIS_LIMIT_AGENT_FREE;
+    return reply.ret;
+}
+
+ngx_int_t ngx_polaris_limit_agent_read_rule(ngx_polaris_limit_agent_ctx_t *ctx, ngx_uint_t index,
+    const polaris::ServiceKey& service_key, ngx_atomic_uint_t& version, std::string& label_keys, std::string& rule) {
+    ngx_polaris_limit_agent_rule_t     *r;
+    ngx_atomic_uint_t                   current;
+    size_t                              name_len;
+    size_t                              keys_len;
+    size_t                              rule_len;
+    ngx_uint_t                          tries;
+
+    if (ctx == NULL || ctx->sh == NULL || index >= ctx->sh->nservices) {
+        return NGX_AGAIN;
+    }
+    r = &ctx->sh->rules[index];
+
+    for (tries = 0; tries < 4; tries++) {
+        current = r->version;
+        if (current == 0) {
+            return NGX_AGAIN;                                   // 代理还没有拉取到规则
+        }
+        if (current == version) {
+            return NGX_DECLINED;
+        }
+        if (current & 1) {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+        name_len = r->name_len;
+        keys_len = r->keys_len;
+        rule_len = r->rule_len;
+        if (name_len + keys_len + rule_len > NGX_POLARIS_LIMIT_AGENT_RULE_SIZE) {
+            continue;                                           // 读到写入中的长度
+        }
+        if (name_len != service_key.namespace_.size() + 1 + service_key.name_.size()
+            || ngx_memcmp(r->data, service_key.namespace_.data(), service_key.namespace_.size()) != 0
+            || ngx_memcmp(r->data + name_len - service_key.name_.size(), service_key.name_.data(),
+                          service_key.name_.size()) != 0) {
+            ngx_memory_barrier();
+            if (r->version != current) {
+                continue;
+            }
+            return NGX_AGAIN;                                   // 新旧配置的服务下标不一致，等待本代配置的代理发布
+        }
+        label_keys.assign(reinterpret_cast<char *>(r->data + name_len), keys_len);
+        rule.assign(reinterpret_cast<char *>(r->data + name_len + keys_len), rule_len);
+        ngx_memory_barrier();
+        if (r->version == current) {
+            version = current;
+            return NGX_OK;
+        }
+    }
+    return version ? NGX_DECLINED : NGX_AGAIN;                  // 代理频繁写入，沿用上次读取的规则
+}
+
+#else
+
+ngx_int_t ngx_polaris_limit_agent_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    return NGX_ERROR;
+}
+
+ngx_int_t ngx_polaris_limit_agent_start(ngx_polaris_limit_agent_ctx_t *ctx, ngx_polaris_limit_agent_quota_pt quota,
+    ngx_polaris_limit_agent_rule_pt rule, ngx_log_t *log) {
+    return NGX_ERROR;
+}
+
+ngx_int_t ngx_polaris_limit_agent_stop() {
+    return NGX_OK;
+}
+
+polaris::ReturnCode ngx_polaris_limit_agent_get_quota(ngx_polaris_limit_agent_ctx_t *ctx, const LimitAgentQuotaCall& call,
+    LimitAgentQuotaReply& reply) {
+    return polaris::kReturnTimeout;
+}
+
+ngx_int_t ngx_polaris_limit_agent_read_rule(ngx_polaris_limit_agent_ctx_t *ctx, ngx_uint_t index,
+    const polaris::ServiceKey& service_key, ngx_atomic_uint_t& version, std::string& label_keys, std::string& rule) {
+    return NGX_AGAIN;
+}
+
+#endif
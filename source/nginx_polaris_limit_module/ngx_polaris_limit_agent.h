@@ -0,0 +1,144 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#ifndef NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_AGENT_H_
+#define NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_AGENT_H_
+
+extern "C" {
+    #include <ngx_config.h>
+    #include <ngx_core.h>
+}
+
+#include <map>
+#include <string>
+
+#include "polaris/limit.h"
+
+#if (NGX_HAVE_POSIX_SEM)
+#include <semaphore.h>
+#endif
+
+// 主机级限流代理：一个worker持有唯一的LimitApi，其他worker通过共享内存中的请求槽转发GetQuota，
+// 代理线程定期把各服务的规则发布到共享内存，worker从中读取label keys和规则
+
+#define NGX_POLARIS_LIMIT_AGENT_SLOTS           256         // 同时等待代理应答的请求数上限
+#define NGX_POLARIS_LIMIT_AGENT_REQUEST_SIZE    4096        // 序列化后的单个请求上限
+#define NGX_POLARIS_LIMIT_AGENT_RULE_SIZE       65536       // 每个服务发布的label keys和规则上限
+#define NGX_POLARIS_LIMIT_AGENT_PUBLISH         1000        // 代理线程检查规则变化的间隔，毫秒
+#define NGX_POLARIS_LIMIT_AGENT_WORKER          0           // 运行代理的worker编号
+
+typedef enum {
+    NGX_POLARIS_LIMIT_AGENT_FREE = 0,
+    NGX_POLARIS_LIMIT_AGENT_WRITING,                        // worker正在写入请求
+    NGX_POLARIS_LIMIT_AGENT_REQUEST,                        // 等待代理处理
+    NGX_POLARIS_LIMIT_AGENT_SERVING,                        // 代理正在调用SDK
+    NGX_POLARIS_LIMIT_AGENT_DONE,                           // 应答已写入，等待worker读取
+    NGX_POLARIS_LIMIT_AGENT_ABANDONED                       // worker等待超时，代理处理完后直接释放
+} ngx_polaris_limit_agent_state_e;
+
+/// @brief 转发给代理的一次配额请求，对应QuotaRequest中用到的字段
+struct LimitAgentQuotaCall {
+  std::string                           service_namespace;
+  std::string                           service_name;
+  std::string                           method;
+  std::map<std::string, std::string>    labels;
+  int64_t                               amount;
+  int64_t                               cost;               // 当前请求的代价，批量租用被拒绝时只获取cost个
+  ngx_msec_t                            timeout;
+  bool                                  with_info;
+
+  LimitAgentQuotaCall() : amount(1), cost(1), timeout(0), with_info(false) {}
+};
+
+/// @brief 代理的应答，amount为实际批准的数量
+struct LimitAgentQuotaReply {
+  polaris::ReturnCode                   ret;
+  polaris::QuotaResultCode              result;
+  polaris::QuotaResultInfo              info;
+  int64_t                               amount;
+};
+
+#if (NGX_HAVE_POSIX_SEM)
+
+typedef struct {
+    ngx_atomic_t                        state;              // ngx_polaris_limit_agent_state_e
+    sem_t                               done;               // 代理写入应答后唤醒等待的worker
+    int32_t                             ret;
+    int32_t                             result;
+    int64_t                             amount;
+    int64_t                             left_quota;
+    int64_t                             all_quota;
+    uint64_t                            duration;
+    ngx_uint_t                          degrade;
+    size_t                              len;
+    u_char                              request[NGX_POLARIS_LIMIT_AGENT_REQUEST_SIZE];
+} ngx_polaris_limit_agent_slot_t;
+
+/// @brief 一个服务发布的规则，version为奇数时代理正在写入
+typedef struct {
+    ngx_atomic_t                        version;
+    size_t                              name_len;           // 命名空间/服务名，reload后服务下标变化时不读取
+    size_t                              keys_len;           // label keys，以\n分隔
+    size_t                              rule_len;
+    u_char                              data[NGX_POLARIS_LIMIT_AGENT_RULE_SIZE];
+} ngx_polaris_limit_agent_rule_t;
+
+typedef struct {
+    sem_t                               request;            // 有新请求时唤醒代理线程
+    ngx_atomic_t                        next;               // worker选择起始槽位
+    ngx_uint_t                          nservices;
+    ngx_polaris_limit_agent_slot_t     *slots;
+    ngx_polaris_limit_agent_rule_t     *rules;
+} ngx_polaris_limit_agent_shctx_t;
+
+#else
+
+typedef struct {
+    ngx_uint_t                          nservices;
+} ngx_polaris_limit_agent_shctx_t;
+
+#endif
+
+typedef struct {
+    ngx_polaris_limit_agent_shctx_t    *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_uint_t                          nservices;          // 配置解析时确定的服务数
+} ngx_polaris_limit_agent_ctx_t;
+
+/// @brief 在代理线程中调用SDK获取配额
+typedef void (*ngx_polaris_limit_agent_quota_pt)(LimitAgentQuotaCall& call, LimitAgentQuotaReply& reply);
+
+/// @brief 在代理线程中读取第index个服务的规则，name为命名空间/服务名，version在规则变化时改变，返回false表示规则未就绪
+typedef bool (*ngx_polaris_limit_agent_rule_pt)(ngx_uint_t index, std::string& name, const void*& version,
+    std::string& label_keys, std::string& rule);
+
+size_t ngx_polaris_limit_agent_zone_size(ngx_uint_t nservices);
+
+ngx_int_t ngx_polaris_limit_agent_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/// @brief 在代理worker中启动代理线程
+ngx_int_t ngx_polaris_limit_agent_start(ngx_polaris_limit_agent_ctx_t *ctx, ngx_polaris_limit_agent_quota_pt quota,
+    ngx_polaris_limit_agent_rule_pt rule, ngx_log_t *log);
+
+/// @brief 通知代理线程退出并等待，返回NGX_BUSY表示线程仍在使用LimitApi
+ngx_int_t ngx_polaris_limit_agent_stop();
+
+/// @brief 转发配额请求并阻塞等待应答，超时或没有空闲槽位时返回kReturnTimeout，可以在线程中调用
+polaris::ReturnCode ngx_polaris_limit_agent_get_quota(ngx_polaris_limit_agent_ctx_t *ctx, const LimitAgentQuotaCall& call,
+    LimitAgentQuotaReply& reply);
+
+/// @brief 读取代理发布的规则，version未变化时不拷贝并返回NGX_DECLINED，未发布时返回NGX_AGAIN
+ngx_int_t ngx_polaris_limit_agent_read_rule(ngx_polaris_limit_agent_ctx_t *ctx, ngx_uint_t index,
+    const polaris::ServiceKey& service_key, ngx_atomic_uint_t& version, std::string& label_keys, std::string& rule);
+
+#endif  // NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_AGENT_H_
@@ -0,0 +1,688 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#include "ngx_polaris_limit_rule.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static const int JSON_MAX_DEPTH = 64;
+static const size_t REGEX_ERRSTR_SIZE = 256;
+
+static void SkipSpace(const char*& p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    ++p;
+  }
+}
+
+static void AppendUtf8(std::string& str, uint32_t code) {
+  if (code < 0x80) {
+    str += static_cast<char>(code);
+  } else if (code < 0x800) {
+    str += static_cast<char>(0xC0 | (code >> 6));
+    str += static_cast<char>(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    str += static_cast<char>(0xE0 | (code >> 12));
+    str += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    str += static_cast<char>(0x80 | (code & 0x3F));
+  } else {
+    str += static_cast<char>(0xF0 | (code >> 18));
+    str += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+    str += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+    str += static_cast<char>(0x80 | (code & 0x3F));
+  }
+}
+
+static bool ParseHex4(const char*& p, const char* end, uint32_t& code) {
+  if (end - p < 4) {
+    return false;
+  }
+  code = 0;
+  for (int i = 0; i < 4; ++i, ++p) {
+    char c = *p;
+    code <<= 4;
+    if (c >= '0' && c <= '9') {
+      code |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      code |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      code |= c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool JsonValue::Parse(const std::string& json, JsonValue& value) {
+  const char* p = json.c_str();
+  const char* end = p + json.size();
+  if (!value.ParseValue(p, end, 0)) {
+    return false;
+  }
+  SkipSpace(p, end);
+  return p == end;
+}
+
+bool JsonValue::ParseString(const char*& p, const char* end, std::string& str) {
+  if (p >= end || *p != '"') {
+    return false;
+  }
+  ++p;
+  while (p < end) {
+    char c = *p++;
+    if (c == '"') {
+      return true;
+    }
+    if (c != '\\') {
+      str += c;
+      continue;
+    }
+    if (p >= end) {
+      return false;
+    }
+    c = *p++;
+    switch (c) {
+      case '"': case '\\': case '/': str += c; break;
+      case 'b': str += '\b'; break;
+      case 'f': str += '\f'; break;
+      case 'n': str += '\n'; break;
+      case 'r': str += '\r'; break;
+      case 't': str += '\t'; break;
+      case 'u': {
+        uint32_t code;
+        if (!ParseHex4(p, end, code)) {
+          return false;
+        }
+        // 代理对组合为一个字符
+        if (code >= 0xD800 && code <= 0xDBFF && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+          const char* q = p + 2;
+          uint32_t low;
+          if (ParseHex4(q, end, low) && low >= 0xDC00 && low <= 0xDFFF) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            p = q;
+          }
+        }
+        AppendUtf8(str, code);
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+bool JsonValue::ParseValue(const char*& p, const char* end, int depth) {
+  if (depth > JSON_MAX_DEPTH) {
+    return false;
+  }
+  SkipSpace(p, end);
+  if (p >= end) {
+    return false;
+  }
+
+  switch (*p) {
+    case '{':
+      m_type = kObject;
+      ++p;
+      SkipSpace(p, end);
+      if (p < end && *p == '}') {
+        ++p;
+        return true;
+      }
+      for (;;) {
+        std::string key;
+        SkipSpace(p, end);
+        if (!ParseString(p, end, key)) {
+          return false;
+        }
+        SkipSpace(p, end);
+        if (p >= end || *p != ':') {
+          return false;
+        }
+        ++p;
+        m_object.push_back(std::make_pair(key, JsonValue()));
+        if (!m_object.back().second.ParseValue(p, end, depth + 1)) {
+          return false;
+        }
+        SkipSpace(p, end);
+        if (p < end && *p == ',') {
+          ++p;
+          continue;
+        }
+        if (p < end && *p == '}') {
+          ++p;
+          return true;
+        }
+        return false;
+      }
+
+    case '[':
+      m_type = kArray;
+      ++p;
+      SkipSpace(p, end);
+      if (p < end && *p == ']') {
+        ++p;
+        return true;
+      }
+      for (;;) {
+        m_array.push_back(JsonValue());
+        if (!m_array.back().ParseValue(p, end, depth + 1)) {
+          return false;
+        }
+        SkipSpace(p, end);
+        if (p < end && *p == ',') {
+          ++p;
+          continue;
+        }
+        if (p < end && *p == ']') {
+          ++p;
+          return true;
+        }
+        return false;
+      }
+
+    case '"':
+      m_type = kString;
+      return ParseString(p, end, m_string);
+
+    case 't':
+      if (end - p >= 4 && memcmp(p, "true", 4) == 0) {
+        m_type = kBool;
+        m_bool = true;
+        p += 4;
+        return true;
+      }
+      return false;
+
+    case 'f':
+      if (end - p >= 5 && memcmp(p, "false", 5) == 0) {
+        m_type = kBool;
+        m_bool = false;
+        p += 5;
+        return true;
+      }
+      return false;
+
+    case 'n':
+      if (end - p >= 4 && memcmp(p, "null", 4) == 0) {
+        m_type = kNull;
+        p += 4;
+        return true;
+      }
+      return false;
+
+    default: {
+      // 输入来自std::string，以'\0'结尾，strtod不会越界
+      char* num_end = NULL;
+      m_number = strtod(p, &num_end);
+      if (num_end == p || num_end > end) {
+        return false;
+      }
+      m_type = kNumber;
+      p = num_end;
+      return true;
+    }
+  }
+}
+
+const JsonValue* JsonValue::Find(const std::string& key) const {
+  for (std::vector<std::pair<std::string, JsonValue> >::const_iterator it = m_object.begin(); it != m_object.end(); ++it) {
+    if (it->first == key) {
+      return &it->second;
+    }
+  }
+  return NULL;
+}
+
+/* proto3 JSON中枚举可能是名字也可能是数字，缺省为EXACT */
+static RuleMatchString::Type ParseMatchType(const JsonValue* type) {
+  if (type == NULL) {
+    return RuleMatchString::kExact;
+  }
+  if (type->IsString()) {
+    const std::string& name = type->GetString();
+    if (name == "EXACT") {
+      return RuleMatchString::kExact;
+    }
+    if (name == "REGEX") {
+      return RuleMatchString::kRegex;
+    }
+    if (name == "IN") {
+      return RuleMatchString::kIn;
+    }
+    return RuleMatchString::kMatchAll;
+  }
+  double number = type->GetNumber(-1);
+  if (number == 0) {
+    return RuleMatchString::kExact;
+  }
+  if (number == 1) {
+    return RuleMatchString::kRegex;
+  }
+  return RuleMatchString::kMatchAll;
+}
+
+/* 没有配置值或值为*时匹配所有 */
+static void ParseMatchString(const JsonValue* match_string, RuleMatchString& match) {
+  match.type = RuleMatchString::kMatchAll;
+  match.value.clear();
+  if (match_string == NULL || !match_string->IsObject()) {
+    return;
+  }
+  const JsonValue* value = match_string->Find("value");
+  if (value != NULL && value->IsString() && !value->GetString().empty() && value->GetString() != "*") {
+    match.type = ParseMatchType(match_string->Find("type"));
+    match.value = value->GetString();
+  }
+}
+
+bool ParseRules(const std::string& json_rule, std::vector<RuleMatchSpec>& rules) {
+  JsonValue root;
+  if (!JsonValue::Parse(json_rule, root) || !root.IsObject()) {
+    return false;
+  }
+
+  const JsonValue* items = root.Find("rules");
+  if (items == NULL) {
+    return true;                      // proto3 JSON省略空数组，表示没有规则
+  }
+  if (!items->IsArray()) {
+    return false;
+  }
+
+  for (std::vector<JsonValue>::const_iterator it = items->GetArray().begin(); it != items->GetArray().end(); ++it) {
+    if (!it->IsObject()) {
+      return false;
+    }
+    const JsonValue* disable = it->Find("disable");
+    if (disable != NULL && disable->GetBool(false)) {
+      continue;
+    }
+
+    RuleMatchSpec rule;
+    ParseMatchString(it->Find("method"), rule.method);  // 规则没有配置method时匹配所有请求
+
+    const JsonValue* labels = it->Find("labels");
+    if (labels != NULL && labels->IsObject()) {
+      const std::vector<std::pair<std::string, JsonValue> >& items = labels->GetObject();
+      for (size_t i = 0; i < items.size(); ++i) {
+        RuleMatchString match;
+        ParseMatchString(&items[i].second, match);
+        if (match.type != RuleMatchString::kMatchAll) {
+          rule.labels.push_back(std::make_pair(items[i].first, match));
+        }
+      }
+    }
+    rules.push_back(rule);
+  }
+  return true;
+}
+
+/* 取以^锚定的正则的字面前缀，正则中有分支时无法确定前缀，返回false */
+static bool RegexLiteralPrefix(const std::string& regex, std::string& prefix) {
+  static const char kMeta[] = ".[]()*+?{}^$|";
+  static const char kQuantifier[] = "*?{";
+
+  if (regex.empty() || regex[0] != '^' || regex.find('|') != std::string::npos) {
+    return false;
+  }
+
+  size_t i = 1;
+  while (i < regex.size()) {
+    char literal;
+    size_t next;
+    if (regex[i] == '\\') {
+      if (i + 1 >= regex.size() || isalnum(static_cast<unsigned char>(regex[i + 1]))) {
+        break;                        // \d \w 等字符类
+      }
+      literal = regex[i + 1];
+      next = i + 2;
+    } else if (strchr(kMeta, regex[i]) != NULL) {
+      break;
+    } else {
+      literal = regex[i];
+      next = i + 1;
+    }
+    if (next < regex.size() && strchr(kQuantifier, regex[next]) != NULL) {
+      break;                          // 后面跟可为零次的量词时，该字符不一定出现
+    }
+    prefix += literal;
+    if (next < regex.size() && regex[next] == '+') {
+      break;
+    }
+    i = next;
+  }
+  return !prefix.empty();
+}
+
+/* 含反向引用的正则合并后分组编号会变化，只能单独匹配 */
+static bool RegexHasBackref(const std::string& regex) {
+  for (size_t i = 0; i + 1 < regex.size(); ++i) {
+    if (regex[i] == '\\') {
+      if ((regex[i + 1] >= '1' && regex[i + 1] <= '9') || regex[i + 1] == 'g' || regex[i + 1] == 'k') {
+        return true;
+      }
+      ++i;
+    }
+  }
+  return false;
+}
+
+/* 按逗号拆分IN的取值，去掉两端空格 */
+static void SplitIn(const std::string& value, std::vector<std::string>& items) {
+  size_t begin = 0;
+  while (begin <= value.size()) {
+    size_t end = value.find(',', begin);
+    if (end == std::string::npos) {
+      end = value.size();
+    }
+    size_t first = value.find_first_not_of(' ', begin);
+    size_t last = end > 0 ? value.find_last_not_of(' ', end - 1) : std::string::npos;
+    if (first != std::string::npos && first < end && last != std::string::npos && last >= first) {
+      items.push_back(value.substr(first, last - first + 1));
+    }
+    begin = end + 1;
+  }
+}
+
+RuleMatcher::~RuleMatcher() {
+  Clear();
+}
+
+void RuleMatcher::Clear() {
+#if (NGX_PCRE2)
+  for (std::vector<ngx_regex_t*>::iterator it = m_regexes.begin(); it != m_regexes.end(); ++it) {
+    pcre2_code_free(*it);             // 释放JIT代码，其余内存在m_pool中
+  }
+#endif
+  m_regexes.clear();
+  if (m_pool != NULL) {
+    ngx_destroy_pool(m_pool);
+    m_pool = NULL;
+  }
+  m_ready = false;
+  m_rules.clear();
+  m_match_all.clear();
+  m_exact.clear();
+  m_exact_index.clear();
+  m_prefix_count = 0;
+  m_trie.clear();
+  m_other_rules.clear();
+  m_others = NULL;
+}
+
+void RuleMatcher::BuildMatchAll() {
+  Clear();
+  m_rules.resize(1);
+  m_rules[0].method.type = RuleMatchString::kMatchAll;
+  m_rules[0].method.regex = NULL;
+  m_match_all.push_back(0);
+  m_ready = true;
+}
+
+ngx_regex_t* RuleMatcher::CompileRegex(const std::string& pattern, ngx_log_t* log) {
+#if (NGX_PCRE)
+  ngx_regex_compile_t   rc;
+  u_char                errstr[REGEX_ERRSTR_SIZE];
+
+  if (m_pool == NULL) {
+    m_pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+    if (m_pool == NULL) {
+      return NULL;
+    }
+  }
+
+  ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+  rc.pattern.len = pattern.size();
+  rc.pattern.data = reinterpret_cast<u_char*>(ngx_pnalloc(m_pool, pattern.size()));
+  if (rc.pattern.data == NULL) {
+    return NULL;
+  }
+  ngx_memcpy(rc.pattern.data, pattern.data(), pattern.size());
+  rc.pool = m_pool;
+  rc.err.len = REGEX_ERRSTR_SIZE;
+  rc.err.data = errstr;
+
+  if (ngx_regex_compile(&rc) != NGX_OK) {
+    ngx_log_error(NGX_LOG_WARN, log, 0, "[PolarisRateLimiting] fail to compile rule regex \"%s\": %V",
+        pattern.c_str(), &rc.err);
+    return NULL;
+  }
+#if (NGX_PCRE2)
+  pcre2_jit_compile(rc.regex, PCRE2_JIT_COMPLETE);     // 运行时编译的正则不会被nginx JIT，失败时解释执行
+#endif
+  m_regexes.push_back(rc.regex);
+  return rc.regex;
+#else
+  return NULL;
+#endif
+}
+
+bool RuleMatcher::Compile(const RuleMatchString& match, CompiledMatch& compiled, ngx_log_t* log) {
+  compiled.type = match.type;
+  compiled.value = match.value;
+  compiled.items.clear();
+  compiled.regex = NULL;
+  if (match.type == RuleMatchString::kIn) {
+    SplitIn(match.value, compiled.items);
+  }
+  if (match.type == RuleMatchString::kRegex) {
+    compiled.regex = CompileRegex(match.value, log);
+    if (compiled.regex == NULL) {
+      compiled.type = RuleMatchString::kMatchAll;
+      return false;
+    }
+  }
+  return true;
+}
+
+void RuleMatcher::Build(const std::vector<RuleMatchSpec>& rules, ngx_log_t* log) {
+  std::string others;
+
+  Clear();
+  m_trie.push_back(TrieNode());
+  m_rules.resize(rules.size());
+
+  for (size_t i = 0; i < rules.size(); ++i) {
+    uint32_t index = static_cast<uint32_t>(i);
+    CompiledRule& rule = m_rules[i];
+
+    for (size_t j = 0; j < rules[i].labels.size(); ++j) {
+      rule.labels.push_back(std::make_pair(rules[i].labels[j].first, CompiledMatch()));
+      Compile(rules[i].labels[j].second, rule.labels.back().second, log);
+    }
+
+    Compile(rules[i].method, rule.method, log);
+    std::string prefix;
+    switch (rule.method.type) {
+      case RuleMatchString::kExact:
+        ExactAdd(rule.method.value, index);
+        break;
+      case RuleMatchString::kIn:
+        for (size_t j = 0; j < rule.method.items.size(); ++j) {
+          ExactAdd(rule.method.items[j], index);
+        }
+        break;
+      case RuleMatchString::kRegex:
+        if (RegexLiteralPrefix(rule.method.value, prefix)) {
+          TrieAdd(prefix, index);                             // 前缀匹配后再校验完整正则
+        } else {
+          m_other_rules.push_back(index);
+          others += others.empty() ? "(?:" : "|(?:";
+          others += rule.method.value;
+          others += ")";
+        }
+        break;
+      default:
+        m_match_all.push_back(index);
+        break;
+    }
+  }
+
+  // 合并的分支正则只用于快速排除，有无法合并的正则时需要逐个匹配
+  bool mergeable = true;
+  for (size_t i = 0; i < m_other_rules.size(); ++i) {
+    mergeable = mergeable && !RegexHasBackref(m_rules[m_other_rules[i]].method.value);
+  }
+  if (mergeable && !others.empty()) {
+    m_others = CompileRegex(others, log);
+  }
+  m_ready = true;
+}
+
+void RuleMatcher::TrieAdd(const std::string& prefix, uint32_t rule) {
+  uint32_t node = 0;
+  for (size_t i = 0; i < prefix.size(); ++i) {
+    u_char c = static_cast<u_char>(prefix[i]);
+    std::map<u_char, uint32_t>::const_iterator it = m_trie[node].next.find(c);
+    if (it != m_trie[node].next.end()) {
+      node = it->second;
+      continue;
+    }
+    uint32_t child = static_cast<uint32_t>(m_trie.size());
+    m_trie.push_back(TrieNode());
+    m_trie[node].next[c] = child;
+    node = child;
+  }
+  m_trie[node].rules.push_back(rule);
+  ++m_prefix_count;
+}
+
+void RuleMatcher::ExactAdd(const std::string& value, uint32_t rule) {
+  u_char* data = reinterpret_cast<u_char*>(const_cast<char*>(value.data()));
+  ngx_uint_t key = ngx_hash_key(data, value.size());
+  const ExactEntry* entry = ExactFind(data, value.size(), key);
+  if (entry != NULL) {
+    m_exact[entry - &m_exact[0]].rules.push_back(rule);
+    return;
+  }
+  m_exact_index.insert(std::make_pair(key, static_cast<uint32_t>(m_exact.size())));
+  m_exact.push_back(ExactEntry());
+  m_exact.back().value = value;
+  m_exact.back().rules.push_back(rule);
+}
+
+const RuleMatcher::ExactEntry* RuleMatcher::ExactFind(const u_char* data, size_t len, ngx_uint_t key) const {
+  typedef std::unordered_multimap<ngx_uint_t, uint32_t>::const_iterator Iterator;
+  std::pair<Iterator, Iterator> range = m_exact_index.equal_range(key);
+  for (Iterator it = range.first; it != range.second; ++it) {
+    const ExactEntry& entry = m_exact[it->second];
+    if (entry.value.size() == len && ngx_memcmp(entry.value.data(), data, len) == 0) {
+      return &entry;
+    }
+  }
+  return NULL;
+}
+
+bool RuleMatcher::MatchValue(const CompiledMatch& match, const u_char* data, size_t len) const {
+  switch (match.type) {
+    case RuleMatchString::kExact:
+      return match.value.size() == len && ngx_memcmp(match.value.data(), data, len) == 0;
+    case RuleMatchString::kIn:
+      for (size_t i = 0; i < match.items.size(); ++i) {
+        if (match.items[i].size() == len && ngx_memcmp(match.items[i].data(), data, len) == 0) {
+          return true;
+        }
+      }
+      return false;
+    case RuleMatchString::kRegex: {
+#if (NGX_PCRE)
+      ngx_str_t str = {len, const_cast<u_char*>(data)};
+      return match.regex == NULL || ngx_regex_exec(match.regex, &str, NULL, 0) >= 0;
+#else
+      return true;
+#endif
+    }
+    default:
+      return true;
+  }
+}
+
+void RuleMatcher::MatchMethod(const u_char* data, size_t len, RuleCandidates& candidates) const {
+  candidates.Clear();
+  if (!m_ready) {
+    candidates.Add(0);                // 未构建时按可能匹配处理，不能用于MatchLabels
+    return;
+  }
+
+  for (size_t i = 0; i < m_match_all.size(); ++i) {
+    candidates.Add(m_match_all[i]);
+  }
+
+  if (!m_exact.empty()) {
+    const ExactEntry* entry = ExactFind(data, len, ngx_hash_key(const_cast<u_char*>(data), len));
+    if (entry != NULL) {
+      for (size_t i = 0; i < entry->rules.size(); ++i) {
+        candidates.Add(entry->rules[i]);
+      }
+    }
+  }
+
+  if (m_prefix_count > 0) {
+    uint32_t node = 0;
+    for (size_t i = 0; ; ++i) {
+      for (size_t j = 0; j < m_trie[node].rules.size(); ++j) {
+        uint32_t rule = m_trie[node].rules[j];
+        if (MatchValue(m_rules[rule].method, data, len)) {
+          candidates.Add(rule);
+        }
+      }
+      if (i == len) {
+        break;
+      }
+      std::map<u_char, uint32_t>::const_iterator it = m_trie[node].next.find(data[i]);
+      if (it == m_trie[node].next.end()) {
+        break;
+      }
+      node = it->second;
+    }
+  }
+
+  if (!m_other_rules.empty()) {
+#if (NGX_PCRE)
+    ngx_str_t str = {len, const_cast<u_char*>(data)};
+    if (m_others != NULL && ngx_regex_exec(m_others, &str, NULL, 0) < 0) {
+      return;                         // 分支正则不匹配时所有正则都不匹配
+    }
+#endif
+    for (size_t i = 0; i < m_other_rules.size(); ++i) {
+      if (MatchValue(m_rules[m_other_rules[i]].method, data, len)) {
+        candidates.Add(m_other_rules[i]);
+      }
+    }
+  }
+}
+
+bool RuleMatcher::MatchLabels(const RuleCandidates& candidates,
+                              const std::map<std::string, std::string>& labels) const {
+  if (!m_ready || candidates.overflow) {
+    return true;                      // 超出容量的候选规则没有记录，按可能匹配处理
+  }
+  for (size_t i = 0; i < candidates.size; ++i) {
+    const CompiledRule& rule = m_rules[candidates.rules[i]];
+    bool matched = true;
+    for (size_t j = 0; j < rule.labels.size() && matched; ++j) {
+      std::map<std::string, std::string>::const_iterator it = labels.find(rule.labels[j].first);
+      if (it == labels.end()) {
+        continue;                     // 没有提取到的label交给SDK判断
+      }
+      matched = MatchValue(rule.labels[j].second, reinterpret_cast<const u_char*>(it->second.data()), it->second.size());
+    }
+    if (matched) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,179 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#ifndef NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_RULE_H_
+#define NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_RULE_H_
+
+extern "C" {
+    #include <ngx_config.h>
+    #include <ngx_core.h>
+}
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// @brief 只支持解析SDK返回的限流规则所需的JSON子集
+class JsonValue {
+ public:
+  enum Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+  JsonValue() : m_type(kNull), m_bool(false), m_number(0) {}
+
+  /// @brief 解析失败返回false，value内容不确定
+  static bool Parse(const std::string& json, JsonValue& value);
+
+  Type GetType() const { return m_type; }
+  bool IsObject() const { return m_type == kObject; }
+  bool IsArray() const { return m_type == kArray; }
+  bool IsString() const { return m_type == kString; }
+
+  bool GetBool(bool def) const { return m_type == kBool ? m_bool : def; }
+  double GetNumber(double def) const { return m_type == kNumber ? m_number : def; }
+  const std::string& GetString() const { return m_string; }
+  const std::vector<JsonValue>& GetArray() const { return m_array; }
+  const std::vector<std::pair<std::string, JsonValue> >& GetObject() const { return m_object; }
+
+  /// @brief 对象中不存在key时返回NULL
+  const JsonValue* Find(const std::string& key) const;
+
+ private:
+  bool ParseValue(const char*& p, const char* end, int depth);
+  static bool ParseString(const char*& p, const char* end, std::string& str);
+
+  Type                                            m_type;
+  bool                                            m_bool;
+  double                                          m_number;
+  std::string                                     m_string;
+  std::vector<JsonValue>                          m_array;
+  std::vector<std::pair<std::string, JsonValue> > m_object;
+};
+
+/// @brief 限流规则中的匹配方式，与polaris MatchString一致，无法识别的方式按匹配所有处理
+struct RuleMatchString {
+  enum Type { kMatchAll, kExact, kRegex, kIn };
+
+  Type          type;
+  std::string   value;
+};
+
+/// @brief 一条启用的限流规则的method和labels匹配条件
+struct RuleMatchSpec {
+  RuleMatchString                                        method;
+  std::vector<std::pair<std::string, RuleMatchString> >  labels;
+};
+
+/// @brief method匹配的规则下标，固定容量分配在栈上，请求处理中不申请内存。
+///        超出容量时置overflow，按可能匹配处理
+struct RuleCandidates {
+  static const size_t kCapacity = 64;
+
+  RuleCandidates() : size(0), overflow(false) {}
+
+  void Clear() { size = 0; overflow = false; }
+  bool Empty() const { return size == 0 && !overflow; }
+  void Add(uint32_t rule) {
+    if (size < kCapacity) {
+      rules[size++] = rule;
+    } else {
+      overflow = true;
+    }
+  }
+
+  uint32_t  rules[kCapacity];
+  size_t    size;
+  bool      overflow;
+};
+
+/// @brief 从FetchRule返回的JSON中解析所有启用规则的匹配条件
+bool ParseRules(const std::string& json_rule, std::vector<RuleMatchSpec>& rules);
+
+/// @brief 把规则集编译为一个匹配器，按请求的uri和labels判断是否有规则匹配，耗时只与输入长度有关。
+///        精确method放入哈希表，锚定的正则按字面前缀放入前缀树后再校验，其余正则合并为一个分支正则。
+///        缺少label或无法编译的条件按可能匹配处理，只会多访问远端，不会漏掉规则
+class RuleMatcher {
+ public:
+  RuleMatcher() : m_ready(false), m_pool(NULL), m_others(NULL) {}
+  ~RuleMatcher();
+
+  bool IsReady() const { return m_ready; }
+
+  void Build(const std::vector<RuleMatchSpec>& rules, ngx_log_t* log);
+
+  /// @brief 规则不可解析时所有请求都可能匹配
+  void BuildMatchAll();
+
+  /// @brief 返回method匹配的规则下标，为空表示没有规则匹配
+  void MatchMethod(const u_char* data, size_t len, RuleCandidates& candidates) const;
+
+  /// @brief candidates中是否有规则的labels匹配
+  bool MatchLabels(const RuleCandidates& candidates, const std::map<std::string, std::string>& labels) const;
+
+  size_t ExactCount() const { return m_exact.size(); }
+  size_t PrefixCount() const { return m_prefix_count; }
+  size_t RegexCount() const { return m_other_rules.size(); }
+  bool MatchAll() const { return !m_match_all.empty() && m_match_all.size() == m_rules.size(); }
+
+ private:
+  /// @brief 精确method及其规则，按ngx_hash_key的值索引，查找时直接对请求的uri计算哈希，不构造string
+  struct ExactEntry {
+    std::string                 value;
+    std::vector<uint32_t>       rules;
+  };
+
+  struct TrieNode {
+    std::map<u_char, uint32_t>  next;
+    std::vector<uint32_t>       rules;            // 字面前缀到此节点为止的规则
+  };
+
+  /// @brief 编译后的匹配条件，regex为NULL且type为kRegex时表示编译失败，按匹配所有处理
+  struct CompiledMatch {
+    RuleMatchString::Type       type;
+    std::string                 value;
+    std::vector<std::string>    items;            // IN拆分后的取值
+    ngx_regex_t*                regex;
+  };
+
+  struct CompiledRule {
+    CompiledMatch                                       method;
+    std::vector<std::pair<std::string, CompiledMatch> > labels;
+  };
+
+  RuleMatcher(const RuleMatcher&);
+  RuleMatcher& operator=(const RuleMatcher&);
+
+  void Clear();
+  bool Compile(const RuleMatchString& match, CompiledMatch& compiled, ngx_log_t* log);
+  ngx_regex_t* CompileRegex(const std::string& pattern, ngx_log_t* log);
+  bool MatchValue(const CompiledMatch& match, const u_char* data, size_t len) const;
+  void TrieAdd(const std::string& prefix, uint32_t rule);
+  void ExactAdd(const std::string& value, uint32_t rule);
+  const ExactEntry* ExactFind(const u_char* data, size_t len, ngx_uint_t key) const;
+
+  bool                                                        m_ready;
+  ngx_pool_t*                                                 m_pool;         // 正则的内存，重建时整体释放
+  std::vector<ngx_regex_t*>                                   m_regexes;
+  std::vector<CompiledRule>                                   m_rules;
+  std::vector<uint32_t>                                       m_match_all;    // method匹配所有请求的规则
+  std::vector<ExactEntry>                                     m_exact;
+  std::unordered_multimap<ngx_uint_t, uint32_t>               m_exact_index;  // 哈希值 -> m_exact下标
+  size_t                                                      m_prefix_count;
+  std::vector<TrieNode>                                       m_trie;         // m_trie[0]为根节点
+  std::vector<uint32_t>                                       m_other_rules;  // 无法取前缀的正则规则
+  ngx_regex_t*                                                m_others;       // m_other_rules的正则合并成的分支正则
+};
+
+#endif  // NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_RULE_H_
@@ -0,0 +1,739 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#include "ngx_polaris_limit_shm.h"
+
+#include <math.h>
+
+static const char KEY_ZONE[] = "zone=";
+static const uint32_t KEY_ZONE_SIZE = sizeof(KEY_ZONE) - 1;
+
+/* 按slab中剩余的空闲页计算数组长度，占用不超过空闲内存的1/parts，取2的幂且不小于min */
+static ngx_uint_t ngx_polaris_limit_zone_entries(ngx_slab_pool_t *shpool, size_t size, ngx_uint_t min, ngx_uint_t parts) {
+    ngx_uint_t                          n, entries;
+
+    n = shpool->pfree * ngx_pagesize / parts / size;
+    entries = min;
+    while (entries * 2 <= n) {
+        entries *= 2;
+    }
+    return entries;
+}
+
+/* 只分配uses中需要且尚未分配的数组，每个数组按还需分配的数组数平分剩余空闲页，
+   并留出一份给reload后新增的使用方式。reload时旧worker只访问它们已在使用的数组 */
+static ngx_int_t ngx_polaris_limit_zone_alloc(ngx_polaris_limit_shm_ctx_t *ctx) {
+    ngx_polaris_limit_shctx_t          *sh = ctx->sh;
+    ngx_uint_t                          parts = 1;
+
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_GCRA) && sh->buckets == NULL) {
+        parts++;
+    }
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_CONCURRENCY) && sh->slots == NULL) {
+        parts++;
+    }
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_HEAVY) && sh->sketch == NULL) {
+        parts++;
+    }
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_VERDICT) && sh->verdicts == NULL) {
+        parts++;
+    }
+
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_GCRA) && sh->buckets == NULL) {
+        sh->nbuckets = ngx_polaris_limit_zone_entries(ctx->shpool, sizeof(ngx_polaris_limit_bucket_t),
+            NGX_POLARIS_LIMIT_BUCKET_PROBES, parts--);
+        sh->buckets = reinterpret_cast<ngx_polaris_limit_bucket_t *>(
+            ngx_slab_calloc(ctx->shpool, sh->nbuckets * sizeof(ngx_polaris_limit_bucket_t)));
+        if (sh->buckets == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_CONCURRENCY) && sh->slots == NULL) {
+        sh->nslots = ngx_polaris_limit_zone_entries(ctx->shpool, sizeof(ngx_polaris_limit_concurrency_t),
+            NGX_POLARIS_LIMIT_BUCKET_PROBES, parts--);
+        sh->slots = reinterpret_cast<ngx_polaris_limit_concurrency_t *>(
+            ngx_slab_calloc(ctx->shpool, sh->nslots * sizeof(ngx_polaris_limit_concurrency_t)));
+        if (sh->slots == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    // Count-Min Sketch的计数器数量固定，与key的数量无关
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_HEAVY) && sh->sketch == NULL) {
+        sh->sketch_width = ngx_polaris_limit_zone_entries(ctx->shpool,
+            NGX_POLARIS_LIMIT_HEAVY_DEPTH * sizeof(ngx_atomic_t), 64, parts--);
+        sh->sketch = reinterpret_cast<ngx_atomic_t *>(
+            ngx_slab_calloc(ctx->shpool, NGX_POLARIS_LIMIT_HEAVY_DEPTH * sh->sketch_width * sizeof(ngx_atomic_t)));
+        if (sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    // 提前拒绝的记录与限流桶分开，淘汰时不会互相继承时间
+    if ((ctx->uses & NGX_POLARIS_LIMIT_USE_VERDICT) && sh->verdicts == NULL) {
+        sh->nverdicts = ngx_polaris_limit_zone_entries(ctx->shpool, sizeof(ngx_polaris_limit_verdict_t),
+            NGX_POLARIS_LIMIT_BUCKET_PROBES, parts--);
+        sh->verdicts = reinterpret_cast<ngx_polaris_limit_verdict_t *>(
+            ngx_slab_calloc(ctx->shpool, sh->nverdicts * sizeof(ngx_polaris_limit_verdict_t)));
+        if (sh->verdicts == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* 初始化共享内存，reload时沿用旧的共享内存，保留限流状态，只补充新配置增加的使用方式需要的数组。
+   控制结构和日志上下文先分配，其余数组按剩余空闲页分配，最小的zone也能放下 */
+ngx_int_t ngx_polaris_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_polaris_limit_shm_ctx_t        *octx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(data);
+    ngx_polaris_limit_shm_ctx_t        *ctx;
+    size_t                              len;
+
+    ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(shm_zone->data);
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return ngx_polaris_limit_zone_alloc(ctx);
+    }
+
+    ctx->shpool = reinterpret_cast<ngx_slab_pool_t *>(shm_zone->shm.addr);
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = reinterpret_cast<ngx_polaris_limit_shctx_t *>(ctx->shpool->data);
+        return ngx_polaris_limit_zone_alloc(ctx);
+    }
+
+    ctx->sh = reinterpret_cast<ngx_polaris_limit_shctx_t *>(
+        ngx_slab_calloc(ctx->shpool, sizeof(ngx_polaris_limit_shctx_t)));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->shpool->data = ctx->sh;
+
+    len = sizeof(" in polaris_rate_limiting_zone \"\"") + shm_zone->shm.name.len;
+    ctx->shpool->log_ctx = reinterpret_cast<u_char *>(ngx_slab_alloc(ctx->shpool, len));
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(ctx->shpool->log_ctx, " in polaris_rate_limiting_zone \"%V\"%Z", &shm_zone->shm.name);
+
+    return ngx_polaris_limit_zone_alloc(ctx);
+}
+
+ngx_polaris_limit_shm_ctx_t *ngx_polaris_limit_zone_use(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone, ngx_uint_t uses) {
+    ngx_polaris_limit_shm_ctx_t        *ctx;
+
+    ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(shm_zone->data);
+    if (ctx == NULL) {
+        ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(ngx_pcalloc(cf->pool, sizeof(ngx_polaris_limit_shm_ctx_t)));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        shm_zone->data = ctx;
+    }
+    ctx->uses |= uses;
+    return ctx;
+}
+
+/* 解析 zone=name:size */
+char *ngx_polaris_limit_parse_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_str_t *name, ssize_t *size) {
+    u_char                             *p;
+    ngx_str_t                           s;
+
+    if (ngx_strncmp(value->data, KEY_ZONE, KEY_ZONE_SIZE) != 0) {
+        return const_cast<char *>("invalid polaris rate limiting zone");
+    }
+
+    name->data = value->data + KEY_ZONE_SIZE;
+    p = ngx_strlchr(name->data, value->data + value->len, ':');
+    if (p == NULL) {
+        return const_cast<char *>("invalid polaris rate limiting zone size");
+    }
+    name->len = p - name->data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+    *size = ngx_parse_size(&s);
+
+    if (name->len == 0 || *size == NGX_ERROR) {
+        return const_cast<char *>("invalid polaris rate limiting zone size");
+    }
+
+    if (*size < static_cast<ssize_t>(8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] zone \"%V\" is too small", value);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 解析 10r/s 或 600r/m，结果为每秒请求数乘以1000 */
+ngx_int_t ngx_polaris_limit_parse_rate(ngx_str_t *value, ngx_uint_t *rate) {
+    ngx_int_t                           n;
+    ngx_int_t                           scale = 1;
+    size_t                              len = value->len;
+    u_char                             *p;
+
+    if (len < 4) {
+        return NGX_ERROR;
+    }
+
+    p = value->data + len - 3;
+    if (ngx_strncmp(p, "r/s", 3) == 0) {
+        scale = 1;
+        len -= 3;
+    } else if (ngx_strncmp(p, "r/m", 3) == 0) {
+        scale = 60;
+        len -= 3;
+    }
+
+    n = ngx_atoi(value->data, len);
+    if (n <= 0) {
+        return NGX_ERROR;
+    }
+
+    *rate = n * 1000 / scale;
+    return *rate > 0 ? NGX_OK : NGX_ERROR;
+}
+
+uint64_t ngx_polaris_limit_hash_key(uint64_t salt, u_char *data, size_t len) {
+    uint64_t key = (static_cast<uint64_t>(ngx_murmur_hash2(data, len)) << 32) | ngx_crc32_short(data, len);
+    key ^= salt;
+    return key == 0 ? 1 : key;
+}
+
+/* 查找key对应的桶，探测范围内没有空槽时淘汰理论到达时间最早的桶 */
+static ngx_polaris_limit_bucket_t *ngx_polaris_limit_lookup_bucket(ngx_polaris_limit_shctx_t *sh, uint64_t key) {
+    ngx_polaris_limit_bucket_t         *bucket;
+    ngx_polaris_limit_bucket_t         *victim = NULL;
+    ngx_atomic_uint_t                   old;
+    ngx_uint_t                          i;
+    ngx_uint_t                          mask = sh->nbuckets - 1;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_BUCKET_PROBES; i++) {
+        bucket = &sh->buckets[(key + i) & mask];
+        old = bucket->key;
+        if (old == key) {
+            return bucket;
+        }
+        if (old == 0) {
+            if (ngx_atomic_cmp_set(&bucket->key, 0, key) || bucket->key == key) {
+                return bucket;
+            }
+            continue;
+        }
+        if (victim == NULL || bucket->tat < victim->tat) {
+            victim = bucket;
+        }
+    }
+
+    // 被淘汰的桶如果未过期，新key会继承其理论到达时间，只会偏向多限流
+    old = victim->key;
+    ngx_atomic_cmp_set(&victim->key, old, key);
+    return victim;
+}
+
+void ngx_polaris_limit_gcra_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    ngx_uint_t cost, ngx_uint_t reserve, ngx_msec_t max_delay, ngx_polaris_limit_result_t *result) {
+    ngx_polaris_limit_bucket_t         *bucket;
+    ngx_atomic_uint_t                   old;
+    uint64_t                            interval;
+    uint64_t                            tolerance;
+    uint64_t                            now;
+    uint64_t                            tat;
+    uint64_t                            new_tat;
+    uint64_t                            excess;
+
+    interval = 1000000000ULL / gcra->rate;                  // 两次请求之间的间隔，单位微秒
+    tolerance = interval + interval * gcra->burst * (100 - reserve) / 100;    // 低优先级请求只能使用部分burst
+    now = static_cast<uint64_t>(ngx_current_msec) * 1000;
+
+    bucket = ngx_polaris_limit_lookup_bucket(ctx->sh, key);
+
+    for ( ;; ) {
+        old = bucket->tat;
+        tat = old > now ? old : now;
+        new_tat = tat + interval * cost;
+
+        excess = new_tat - now > tolerance ? new_tat - now - tolerance : 0;     // 超出burst的部分，需要等待
+
+        if (excess > static_cast<uint64_t>(max_delay) * 1000) {
+            result->limited = 1;
+            result->retry_after = static_cast<ngx_msec_t>((excess + 999) / 1000);
+            result->remaining = 0;
+            result->delay = 0;
+            return;
+        }
+
+        if (ngx_atomic_cmp_set(&bucket->tat, old, new_tat)) {
+            result->limited = 0;
+            result->retry_after = 0;
+            result->remaining = excess ? 0 : static_cast<ngx_uint_t>((tolerance - (new_tat - now)) / interval);
+            result->delay = static_cast<ngx_msec_t>((excess + 999) / 1000);
+            return;
+        }
+    }
+}
+
+/* 回滚已推进的理论到达时间，桶在此期间被其他key占用时只会偏向多放行一个请求 */
+void ngx_polaris_limit_gcra_release(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    ngx_uint_t cost) {
+    ngx_polaris_limit_bucket_t         *bucket;
+    ngx_atomic_uint_t                   old;
+    uint64_t                            interval;
+    uint64_t                            now;
+    uint64_t                            tat;
+
+    interval = 1000000000ULL / gcra->rate;
+    now = static_cast<uint64_t>(ngx_current_msec) * 1000;
+
+    bucket = ngx_polaris_limit_lookup_bucket(ctx->sh, key);
+
+    do {
+        old = bucket->tat;
+        if (old <= now) {
+            return;                                         // 已经过期，不需要回滚
+        }
+        tat = old - now > interval * cost ? old - interval * cost : now;
+    } while (!ngx_atomic_cmp_set(&bucket->tat, old, tat));
+}
+
+/* 先在租户桶中获取，再在全局桶中获取，全局桶被限流时回滚租户桶，两级都通过时等待时间取较大值 */
+void ngx_polaris_limit_tree_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    uint64_t tenant_key, ngx_polaris_limit_gcra_t *tenant_gcra, ngx_uint_t cost, ngx_uint_t reserve, ngx_uint_t borrow,
+    ngx_msec_t max_delay, ngx_polaris_limit_result_t *result) {
+    ngx_polaris_limit_result_t          tenant;
+
+    ngx_polaris_limit_gcra_acquire(ctx, tenant_key, tenant_gcra, cost, reserve, max_delay, &tenant);
+
+    if (tenant.limited) {
+        if (borrow == NGX_CONF_UNSET_UINT) {
+            *result = tenant;
+            return;
+        }
+        // 租户份额用完后借用全局桶的空闲配额，只能使用部分burst且不排队，避免挤占其他租户
+        ngx_polaris_limit_gcra_acquire(ctx, key, gcra, cost, ngx_max(reserve, 100 - borrow), 0, result);
+        if (result->limited) {
+            result->retry_after = ngx_min(result->retry_after, tenant.retry_after);
+        }
+        return;
+    }
+
+    ngx_polaris_limit_gcra_acquire(ctx, key, gcra, cost, reserve, max_delay, result);
+    if (result->limited) {
+        ngx_polaris_limit_gcra_release(ctx, tenant_key, tenant_gcra, cost);
+        return;
+    }
+
+    result->remaining = ngx_min(result->remaining, tenant.remaining);
+    result->delay = ngx_max(result->delay, tenant.delay);
+}
+
+/* 重置槽的自适应状态，新key从上限开始按耗时梯度降低，调用方持有slot->lock */
+static void ngx_polaris_limit_concurrency_reset(ngx_polaris_limit_concurrency_t *slot, uint64_t key,
+    ngx_polaris_limit_concurrency_conf_t *conf) {
+    slot->key = key;
+    slot->inflight = 0;
+    slot->estimated_limit = static_cast<double>(conf->max);
+    slot->limit = conf->max;
+    slot->long_rtt = 0;
+    slot->window_rtt = 0;
+    slot->window_count = 0;
+    slot->window_inflight = 0;
+}
+
+/* 查找key对应的槽，探测范围内没有时占用空槽或没有请求的槽 */
+static ngx_polaris_limit_concurrency_t *ngx_polaris_limit_lookup_slot(ngx_polaris_limit_shctx_t *sh, uint64_t key,
+    ngx_polaris_limit_concurrency_conf_t *conf) {
+    ngx_polaris_limit_concurrency_t    *slot;
+    ngx_uint_t                          i;
+    ngx_uint_t                          mask = sh->nslots - 1;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_BUCKET_PROBES; i++) {
+        slot = &sh->slots[(key + i) & mask];
+        if (slot->key == key) {
+            return slot;
+        }
+    }
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_BUCKET_PROBES; i++) {
+        slot = &sh->slots[(key + i) & mask];
+        if (slot->inflight != 0 || !ngx_trylock(&slot->lock)) {
+            continue;
+        }
+        if (slot->key == key) {
+            ngx_unlock(&slot->lock);
+            return slot;
+        }
+        if (slot->inflight == 0) {
+            ngx_polaris_limit_concurrency_reset(slot, key, conf);   // 被占用的槽没有请求，不影响计数
+            ngx_unlock(&slot->lock);
+            return slot;
+        }
+        ngx_unlock(&slot->lock);
+    }
+    return NULL;
+}
+
+ngx_int_t ngx_polaris_limit_concurrency_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key,
+    ngx_polaris_limit_concurrency_conf_t *conf, ngx_uint_t reserve, ngx_polaris_limit_concurrency_t **slot,
+    ngx_polaris_limit_result_t *result) {
+    ngx_polaris_limit_concurrency_t    *s;
+    ngx_atomic_uint_t                   inflight;
+    ngx_atomic_uint_t                   limit;
+
+    ngx_memzero(result, sizeof(ngx_polaris_limit_result_t));
+
+    s = ngx_polaris_limit_lookup_slot(ctx->sh, key, conf);
+    if (s == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ngx_spinlock(&s->lock, 1, 1024);
+    if (s->key != key) {
+        ngx_unlock(&s->lock);                                   // 刚被其他key占用
+        return NGX_DECLINED;
+    }
+
+    inflight = s->inflight;
+    limit = s->limit - s->limit * reserve / 100;
+    if (inflight >= limit) {
+        ngx_unlock(&s->lock);
+        result->limited = 1;
+        return NGX_BUSY;
+    }
+
+    s->inflight = inflight + 1;
+    if (s->inflight > s->window_inflight) {
+        s->window_inflight = s->inflight;
+    }
+    ngx_unlock(&s->lock);
+
+    result->remaining = limit - inflight - 1;
+    *slot = s;
+    return NGX_OK;
+}
+
+/* 按Gradient2算法调整上限：短期耗时高于长期耗时时按比例降低，请求未占满一半上限时不提高 */
+void ngx_polaris_limit_concurrency_release(ngx_polaris_limit_concurrency_t *slot,
+    ngx_polaris_limit_concurrency_conf_t *conf, uint64_t rtt) {
+    double                              short_rtt;
+    double                              gradient;
+    double                              estimated;
+    double                              limit;
+
+    ngx_spinlock(&slot->lock, 1, 1024);
+
+    slot->inflight--;
+    slot->window_rtt += rtt;
+    if (++slot->window_count < NGX_POLARIS_LIMIT_GRADIENT_WINDOW) {
+        ngx_unlock(&slot->lock);
+        return;
+    }
+
+    short_rtt = static_cast<double>(slot->window_rtt) / slot->window_count;
+    if (short_rtt < 1) {
+        short_rtt = 1;
+    }
+
+    if (slot->long_rtt == 0) {
+        slot->long_rtt = short_rtt;
+    } else {
+        slot->long_rtt += (short_rtt - slot->long_rtt) / NGX_POLARIS_LIMIT_GRADIENT_LONG;
+        if (slot->long_rtt / short_rtt > 2) {
+            slot->long_rtt *= 0.95;                             // 耗时明显下降后更快地跟随
+        }
+    }
+
+    estimated = slot->estimated_limit;
+    if (slot->window_inflight >= estimated / 2) {
+        gradient = NGX_POLARIS_LIMIT_GRADIENT_TOLERANCE * slot->long_rtt / short_rtt;
+        gradient = ngx_max(0.5, ngx_min(1.0, gradient));
+        limit = estimated * gradient + sqrt(estimated);         // 允许sqrt(limit)个请求排队
+        estimated = estimated * (1 - NGX_POLARIS_LIMIT_GRADIENT_SMOOTHING) + limit * NGX_POLARIS_LIMIT_GRADIENT_SMOOTHING;
+        estimated = ngx_max(static_cast<double>(conf->min), ngx_min(static_cast<double>(conf->max), estimated));
+        slot->estimated_limit = estimated;
+        slot->limit = static_cast<ngx_atomic_uint_t>(estimated);
+    }
+
+    slot->window_rtt = 0;
+    slot->window_count = 0;
+    slot->window_inflight = slot->inflight;
+    ngx_unlock(&slot->lock);
+}
+
+/* 已有记录时只延长结束时间；没有时占用空槽，或淘汰探测范围内结束最早的记录，新key覆盖被淘汰记录的结束时间 */
+void ngx_polaris_limit_verdict_set(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_msec_t hold) {
+    ngx_polaris_limit_verdict_t        *verdict;
+    ngx_polaris_limit_verdict_t        *victim = NULL;
+    ngx_atomic_uint_t                   old;
+    ngx_msec_t                          until;
+    ngx_uint_t                          i;
+    ngx_uint_t                          mask = ctx->sh->nverdicts - 1;
+
+    until = ngx_current_msec + hold;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_BUCKET_PROBES; i++) {
+        verdict = &ctx->sh->verdicts[(key + i) & mask];
+        old = verdict->key;
+        if (old == key) {
+            goto found;
+        }
+        if (old == 0) {
+            if (ngx_atomic_cmp_set(&verdict->key, 0, key) || verdict->key == key) {
+                goto found;
+            }
+            continue;
+        }
+        if (victim == NULL || static_cast<ngx_msec_int_t>(verdict->until - victim->until) < 0) {
+            victim = verdict;
+        }
+    }
+
+    if (victim == NULL) {
+        return;
+    }
+    old = victim->key;
+    if (ngx_atomic_cmp_set(&victim->key, old, key)) {
+        victim->until = until;
+    }
+    return;
+
+found:
+
+    do {
+        old = verdict->until;
+        if (old != 0 && static_cast<ngx_msec_int_t>(old - until) >= 0) {
+            return;
+        }
+    } while (!ngx_atomic_cmp_set(&verdict->until, old, until));
+}
+
+ngx_msec_t ngx_polaris_limit_verdict_get(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key) {
+    ngx_polaris_limit_verdict_t        *verdict;
+    ngx_msec_int_t                      left;
+    ngx_uint_t                          i;
+    ngx_uint_t                          mask = ctx->sh->nverdicts - 1;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_BUCKET_PROBES; i++) {
+        verdict = &ctx->sh->verdicts[(key + i) & mask];
+        if (verdict->key == key) {
+            left = static_cast<ngx_msec_int_t>(static_cast<ngx_msec_t>(verdict->until) - ngx_current_msec);
+            return left > 0 ? static_cast<ngx_msec_t>(left) : 0;
+        }
+        if (verdict->key == 0) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* 每行用双重哈希取一个计数器 */
+static void ngx_polaris_limit_sketch_index(ngx_polaris_limit_shctx_t *sh, uint64_t key, ngx_uint_t *index) {
+    uint64_t                            h2 = (key >> 32) | 1;
+    ngx_uint_t                          i;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_HEAVY_DEPTH; i++) {
+        index[i] = i * sh->sketch_width + ((key + i * h2) & (sh->sketch_width - 1));
+    }
+}
+
+static ngx_atomic_uint_t ngx_polaris_limit_sketch_estimate(ngx_polaris_limit_shctx_t *sh, ngx_uint_t *index) {
+    ngx_atomic_uint_t                   min = sh->sketch[index[0]];
+    ngx_uint_t                          i;
+
+    for (i = 1; i < NGX_POLARIS_LIMIT_HEAVY_DEPTH; i++) {
+        min = ngx_min(min, sh->sketch[index[i]]);
+    }
+    return min;
+}
+
+/* 保守更新，只增加等于最小值的计数器，减少哈希冲突带来的高估 */
+static ngx_atomic_uint_t ngx_polaris_limit_sketch_add(ngx_polaris_limit_shctx_t *sh, ngx_uint_t *index) {
+    ngx_atomic_uint_t                   min = ngx_polaris_limit_sketch_estimate(sh, index);
+    ngx_uint_t                          i;
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_HEAVY_DEPTH; i++) {
+        if (sh->sketch[index[i]] == min) {
+            (void) ngx_atomic_cmp_set(&sh->sketch[index[i]], min, min + 1);
+        }
+    }
+    return min + 1;
+}
+
+/* 所有计数减半，统计的是近期流量。每个计数器用CAS减半，不会覆盖其他worker并发的增加；
+   堆中的count同比例减半，堆序不变 */
+static void ngx_polaris_limit_sketch_decay(ngx_polaris_limit_shctx_t *sh) {
+    ngx_atomic_uint_t                   last = sh->sketch_decay;
+    ngx_atomic_uint_t                   old;
+    ngx_uint_t                          i;
+    ngx_uint_t                          n;
+
+    if (ngx_current_msec - last < NGX_POLARIS_LIMIT_HEAVY_DECAY
+        || !ngx_atomic_cmp_set(&sh->sketch_decay, last, ngx_current_msec)) {
+        return;
+    }
+
+    n = NGX_POLARIS_LIMIT_HEAVY_DEPTH * sh->sketch_width;
+    for (i = 0; i < n; i++) {
+        do {
+            old = sh->sketch[i];
+        } while (old != 0 && !ngx_atomic_cmp_set(&sh->sketch[i], old, old >> 1));
+    }
+
+    ngx_spinlock(&sh->heavy_lock, 1, 1024);
+    for (i = 0; i < sh->nheavy; i++) {
+        sh->heavy[i].count >>= 1;
+    }
+    ngx_unlock(&sh->heavy_lock);
+}
+
+static void ngx_polaris_limit_heavy_swap(ngx_polaris_limit_shctx_t *sh, ngx_uint_t a, ngx_uint_t b) {
+    ngx_polaris_limit_heavy_t           tmp;
+
+    ngx_memcpy(&tmp, &sh->heavy[a], sizeof(ngx_polaris_limit_heavy_t));
+    ngx_memcpy(&sh->heavy[a], &sh->heavy[b], sizeof(ngx_polaris_limit_heavy_t));
+    ngx_memcpy(&sh->heavy[b], &tmp, sizeof(ngx_polaris_limit_heavy_t));
+}
+
+static void ngx_polaris_limit_heavy_sift_down(ngx_polaris_limit_shctx_t *sh, ngx_uint_t i) {
+    ngx_uint_t                          child;
+
+    for ( ;; ) {
+        child = 2 * i + 1;
+        if (child >= sh->nheavy) {
+            return;
+        }
+        if (child + 1 < sh->nheavy && sh->heavy[child + 1].count < sh->heavy[child].count) {
+            child++;
+        }
+        if (sh->heavy[i].count <= sh->heavy[child].count) {
+            return;
+        }
+        ngx_polaris_limit_heavy_swap(sh, i, child);
+        i = child;
+    }
+}
+
+static void ngx_polaris_limit_heavy_sift_up(ngx_polaris_limit_shctx_t *sh, ngx_uint_t i) {
+    while (i > 0 && sh->heavy[(i - 1) / 2].count > sh->heavy[i].count) {
+        ngx_polaris_limit_heavy_swap(sh, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/* 已在堆中时更新计数，否则加入或替换堆顶计数最小的key，调用方持有heavy_lock */
+static void ngx_polaris_limit_heavy_update(ngx_polaris_limit_shctx_t *sh, uint64_t key, ngx_atomic_uint_t count,
+    u_char *data, size_t len) {
+    ngx_polaris_limit_heavy_t          *h;
+    ngx_uint_t                          i;
+
+    for (i = 0; i < sh->nheavy; i++) {
+        if (sh->heavy[i].key == key) {
+            if (count > sh->heavy[i].count) {
+                sh->heavy[i].count = count;
+                ngx_polaris_limit_heavy_sift_down(sh, i);
+            }
+            return;
+        }
+    }
+
+    if (sh->nheavy < NGX_POLARIS_LIMIT_HEAVY_TOPK) {
+        i = sh->nheavy++;
+    } else if (count > sh->heavy[0].count) {
+        i = 0;
+    } else {
+        return;
+    }
+
+    h = &sh->heavy[i];
+    h->key = key;
+    h->count = count;
+    h->reported = 0;
+    h->len = ngx_min(len, NGX_POLARIS_LIMIT_HEAVY_KEY_LEN);
+    ngx_memcpy(h->data, data, h->len);
+
+    if (i == 0) {
+        ngx_polaris_limit_heavy_sift_down(sh, 0);
+    } else {
+        ngx_polaris_limit_heavy_sift_up(sh, i);
+    }
+}
+
+/* 不加锁查找，堆调整期间可能漏判一次 */
+static ngx_polaris_limit_heavy_t *ngx_polaris_limit_heavy_find(ngx_polaris_limit_shctx_t *sh, uint64_t key) {
+    ngx_uint_t                          i;
+
+    for (i = 0; i < sh->nheavy && i < NGX_POLARIS_LIMIT_HEAVY_TOPK; i++) {
+        if (sh->heavy[i].key == key) {
+            return &sh->heavy[i];
+        }
+    }
+    return NULL;
+}
+
+/* 总流量也记在sketch中，以salt本身作为key，不同location的份额互不影响 */
+ngx_int_t ngx_polaris_limit_heavy_check(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t salt, u_char *data, size_t len,
+    ngx_uint_t share, ngx_flag_t *first) {
+    ngx_polaris_limit_shctx_t          *sh = ctx->sh;
+    ngx_polaris_limit_heavy_t          *h;
+    ngx_uint_t                          index[NGX_POLARIS_LIMIT_HEAVY_DEPTH];
+    ngx_uint_t                          total_index[NGX_POLARIS_LIMIT_HEAVY_DEPTH];
+    ngx_atomic_uint_t                   count;
+    ngx_atomic_uint_t                   total;
+    ngx_atomic_uint_t                   allowed;
+    uint64_t                            key;
+
+    *first = 0;
+    ngx_polaris_limit_sketch_decay(sh);
+
+    key = ngx_polaris_limit_hash_key(salt, data, len);
+    ngx_polaris_limit_sketch_index(sh, key, index);
+    ngx_polaris_limit_sketch_index(sh, salt == 0 ? 1 : salt, total_index);
+
+    // 被限流的请求也计数，统计的是到达的流量，否则被限流的key计数衰减后会被固定在很低的速率
+    total = ngx_polaris_limit_sketch_add(sh, total_index);
+    count = ngx_polaris_limit_sketch_add(sh, index);
+
+    // 堆未满或超过堆顶时才加锁，多数key只访问sketch
+    if (sh->nheavy < NGX_POLARIS_LIMIT_HEAVY_TOPK || count > sh->heavy[0].count) {
+        ngx_spinlock(&sh->heavy_lock, 1, 1024);
+        ngx_polaris_limit_heavy_update(sh, key, count, data, len);
+        ngx_unlock(&sh->heavy_lock);
+    }
+
+    // 流量全部来自这个key时没有可以保护的其他key
+    if (total < NGX_POLARIS_LIMIT_HEAVY_MIN_TOTAL || count >= total || count * 100 <= share * total) {
+        return NGX_DECLINED;
+    }
+
+    h = ngx_polaris_limit_heavy_find(sh, key);
+    if (h == NULL) {
+        return NGX_DECLINED;
+    }
+
+    // 按比例放行，使该key被放行的请求约为总流量的share%
+    allowed = share * total / 100;
+    if (static_cast<ngx_atomic_uint_t>(ngx_random()) % count < allowed) {
+        return NGX_DECLINED;
+    }
+
+    if (!h->reported) {
+        h->reported = 1;
+        *first = 1;
+    }
+    return NGX_BUSY;
+}
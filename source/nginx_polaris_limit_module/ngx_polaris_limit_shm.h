@@ -0,0 +1,161 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#ifndef NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_SHM_H_
+#define NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_SHM_H_
+
+extern "C" {
+    #include <ngx_config.h>
+    #include <ngx_core.h>
+}
+
+#define NGX_POLARIS_LIMIT_BUCKET_PROBES     8               // 哈希槽冲突时最多探测的槽数
+
+#define NGX_POLARIS_LIMIT_USE_GCRA          0x01            // 速率限流桶
+#define NGX_POLARIS_LIMIT_USE_CONCURRENCY   0x02            // 并发限流槽
+#define NGX_POLARIS_LIMIT_USE_HEAVY         0x04            // Count-Min Sketch
+#define NGX_POLARIS_LIMIT_USE_VERDICT       0x08            // 提前拒绝的客户端记录
+
+#define NGX_POLARIS_LIMIT_GRADIENT_WINDOW   10              // 每收集这么多个耗时样本调整一次并发上限
+#define NGX_POLARIS_LIMIT_GRADIENT_LONG     600             // 长期耗时指数平均的窗口，单位为调整次数
+#define NGX_POLARIS_LIMIT_GRADIENT_TOLERANCE 1.5            // 短期耗时超过长期耗时的1.5倍才开始降低上限
+#define NGX_POLARIS_LIMIT_GRADIENT_SMOOTHING 0.2            // 新上限的权重
+
+#define NGX_POLARIS_LIMIT_HEAVY_DEPTH       4               // Count-Min Sketch的行数
+#define NGX_POLARIS_LIMIT_HEAVY_TOPK        32              // 保留计数最高的key数，只有其中的key会被限流
+#define NGX_POLARIS_LIMIT_HEAVY_KEY_LEN     64              // top-K中保存的key前缀，用于日志
+#define NGX_POLARIS_LIMIT_HEAVY_DECAY       1000            // 计数减半的间隔，单位毫秒
+#define NGX_POLARIS_LIMIT_HEAVY_MIN_TOTAL   100             // 衰减后的总请求数低于此值时不判断份额
+
+/// @brief 本地限流桶，key和tat都使用原子操作更新，不需要加锁
+typedef struct {
+    ngx_atomic_t                        key;                // 限流key的hash，0表示空槽
+    ngx_atomic_t                        tat;                // GCRA理论到达时间，单位微秒
+} ngx_polaris_limit_bucket_t;
+
+/// @brief 提前拒绝的客户端记录，与限流桶分开存放，until为限流期的结束时间，单位毫秒
+typedef struct {
+    ngx_atomic_t                        key;                // 客户端key的hash，0表示空槽
+    ngx_atomic_t                        until;
+} ngx_polaris_limit_verdict_t;
+
+/// @brief 并发限流槽，key和inflight原子更新，其余字段在lock保护下更新
+typedef struct {
+    ngx_atomic_t                        key;                // 限流key的hash，0表示空槽
+    ngx_atomic_t                        inflight;           // 正在处理的请求数
+    ngx_atomic_t                        limit;              // 当前并发上限，读取时不加锁
+    ngx_atomic_t                        lock;
+    double                              estimated_limit;    // 未取整的并发上限
+    double                              long_rtt;           // 长期耗时的指数平均，单位微秒
+    uint64_t                            window_rtt;         // 本窗口耗时之和
+    ngx_uint_t                          window_count;       // 本窗口样本数
+    ngx_uint_t                          window_inflight;    // 本窗口内最大并发
+} ngx_polaris_limit_concurrency_t;
+
+/// @brief top-K中的一个key，count为加入或更新时的估计值
+typedef struct {
+    ngx_atomic_t                        key;
+    ngx_atomic_uint_t                   count;
+    ngx_uint_t                          reported;           // 已记录过被限流的日志
+    size_t                              len;
+    u_char                              data[NGX_POLARIS_LIMIT_HEAVY_KEY_LEN];
+} ngx_polaris_limit_heavy_t;
+
+typedef struct {
+    ngx_uint_t                          nbuckets;           // 桶数量，2的幂
+    ngx_polaris_limit_bucket_t         *buckets;
+    ngx_uint_t                          nslots;             // 并发限流槽数量，2的幂
+    ngx_polaris_limit_concurrency_t    *slots;
+    ngx_uint_t                          nverdicts;          // 提前拒绝记录数量，2的幂
+    ngx_polaris_limit_verdict_t        *verdicts;
+    ngx_uint_t                          sketch_width;       // Count-Min Sketch每行的计数器数，2的幂
+    ngx_atomic_t                       *sketch;             // NGX_POLARIS_LIMIT_HEAVY_DEPTH * sketch_width
+    ngx_atomic_t                        sketch_decay;       // 上次计数减半的时间
+    ngx_atomic_t                        heavy_lock;
+    ngx_uint_t                          nheavy;
+    ngx_polaris_limit_heavy_t           heavy[NGX_POLARIS_LIMIT_HEAVY_TOPK];   // 按count的最小堆
+} ngx_polaris_limit_shctx_t;
+
+/// @brief 限流共享内存，所有worker共享。uses为本次配置中引用该zone的指令需要的结构，只分配这些结构
+typedef struct {
+    ngx_polaris_limit_shctx_t          *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_uint_t                          uses;               // NGX_POLARIS_LIMIT_USE_*
+} ngx_polaris_limit_shm_ctx_t;
+
+/// @brief 本地限流参数，rate为每秒请求数乘以1000，与limit_req一致
+typedef struct {
+    ngx_uint_t                          rate;
+    ngx_uint_t                          burst;
+} ngx_polaris_limit_gcra_t;
+
+/// @brief 自适应并发限流参数，上限在[min, max]之间按耗时梯度调整
+typedef struct {
+    ngx_uint_t                          min;
+    ngx_uint_t                          max;
+} ngx_polaris_limit_concurrency_conf_t;
+
+typedef struct {
+    ngx_uint_t                          limited;            // 是否被限流
+    ngx_msec_t                          retry_after;        // 被限流时距离下次可通过的时间，单位毫秒
+    ngx_uint_t                          remaining;          // 通过后桶内剩余的请求数
+    ngx_msec_t                          delay;              // 通过时需要等待的时间，单位毫秒
+} ngx_polaris_limit_result_t;
+
+ngx_int_t ngx_polaris_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/// @brief 记录指令对zone的使用方式，zone可能在定义之前被引用，此时先创建控制结构，失败返回NULL
+ngx_polaris_limit_shm_ctx_t *ngx_polaris_limit_zone_use(ngx_conf_t *cf, ngx_shm_zone_t *shm_zone, ngx_uint_t uses);
+
+char *ngx_polaris_limit_parse_zone(ngx_conf_t *cf, ngx_str_t *value, ngx_str_t *name, ssize_t *size);
+
+ngx_int_t ngx_polaris_limit_parse_rate(ngx_str_t *value, ngx_uint_t *rate);
+
+uint64_t ngx_polaris_limit_hash_key(uint64_t salt, u_char *data, size_t len);
+
+/// @brief 按GCRA算法从共享内存桶中获取cost个令牌，超出burst但在max_delay内时预占之后的令牌并返回等待时间
+///        reserve为burst中为更高优先级请求保留的百分比
+void ngx_polaris_limit_gcra_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    ngx_uint_t cost, ngx_uint_t reserve, ngx_msec_t max_delay, ngx_polaris_limit_result_t *result);
+
+/// @brief 归还gcra_acquire获取的cost个令牌，用于多级限流中下一级被限流时回滚
+void ngx_polaris_limit_gcra_release(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    ngx_uint_t cost);
+
+/// @brief 在租户桶和全局桶中同时获取cost个令牌，任一级被限流时都不消耗。
+///        borrow不为NGX_CONF_UNSET_UINT时，租户超出份额后可以使用全局桶burst的borrow%
+void ngx_polaris_limit_tree_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_polaris_limit_gcra_t *gcra,
+    uint64_t tenant_key, ngx_polaris_limit_gcra_t *tenant_gcra, ngx_uint_t cost, ngx_uint_t reserve, ngx_uint_t borrow,
+    ngx_msec_t max_delay, ngx_polaris_limit_result_t *result);
+
+/// @brief 占用一个并发槽，超过上限去掉reserve%后的并发数时返回NGX_BUSY，没有可用的槽时返回NGX_DECLINED且不计数
+ngx_int_t ngx_polaris_limit_concurrency_acquire(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key,
+    ngx_polaris_limit_concurrency_conf_t *conf, ngx_uint_t reserve, ngx_polaris_limit_concurrency_t **slot,
+    ngx_polaris_limit_result_t *result);
+
+/// @brief 释放并发槽，rtt为本次请求的上游耗时，单位微秒
+void ngx_polaris_limit_concurrency_release(ngx_polaris_limit_concurrency_t *slot,
+    ngx_polaris_limit_concurrency_conf_t *conf, uint64_t rtt);
+
+/// @brief 记录被限流的客户端，hold毫秒内在请求早期直接拒绝，使用单独的哈希表，不影响限流桶
+void ngx_polaris_limit_verdict_set(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key, ngx_msec_t hold);
+
+/// @brief 客户端仍在限流期内时返回剩余的毫秒数，否则返回0，查找时不占用新的桶
+ngx_msec_t ngx_polaris_limit_verdict_get(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t key);
+
+/// @brief 按salt区分的流量中统计key的份额，所有到达的请求都计数。超过share%、在top-K中且还有其他key的流量时，
+///        按比例返回NGX_BUSY，使该key被放行的部分约为share%。key第一次被限流时first为1，用于记录日志
+ngx_int_t ngx_polaris_limit_heavy_check(ngx_polaris_limit_shm_ctx_t *ctx, uint64_t salt, u_char *data, size_t len,
+    ngx_uint_t share, ngx_flag_t *first);
+
+#endif  // NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_SHM_H_
@@ -0,0 +1,145 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#include "ngx_polaris_limit_stat.h"
+
+#include <time.h>
+
+/* 大小随服务数严格变化，服务数变化时reload会创建新的共享内存 */
+size_t ngx_polaris_limit_stat_zone_size(ngx_uint_t nservices) {
+    size_t size;
+
+    size = nservices * NGX_POLARIS_LIMIT_STAT_SHARDS * sizeof(ngx_polaris_limit_stat_t);
+    return size + size / 64 + 8 * ngx_pagesize;     // slab页管理结构、控制结构和日志上下文的开销
+}
+
+/* reload时服务数不变则沿用旧的统计 */
+ngx_int_t ngx_polaris_limit_stat_init_zone(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_polaris_limit_stat_ctx_t       *octx = reinterpret_cast<ngx_polaris_limit_stat_ctx_t *>(data);
+    ngx_polaris_limit_stat_ctx_t       *ctx;
+    size_t                              len;
+
+    ctx = reinterpret_cast<ngx_polaris_limit_stat_ctx_t *>(shm_zone->data);
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+
+    ctx->shpool = reinterpret_cast<ngx_slab_pool_t *>(shm_zone->shm.addr);
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = reinterpret_cast<ngx_polaris_limit_stat_shctx_t *>(ctx->shpool->data);
+        return NGX_OK;
+    }
+
+    ctx->sh = reinterpret_cast<ngx_polaris_limit_stat_shctx_t *>(
+        ngx_slab_alloc(ctx->shpool, sizeof(ngx_polaris_limit_stat_shctx_t)));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+    ctx->shpool->data = ctx->sh;
+
+    ctx->sh->nservices = ctx->nservices;
+    ctx->sh->stats = reinterpret_cast<ngx_polaris_limit_stat_t *>(
+        ngx_slab_calloc(ctx->shpool, ctx->nservices * NGX_POLARIS_LIMIT_STAT_SHARDS * sizeof(ngx_polaris_limit_stat_t)));
+    if (ctx->sh->stats == NULL) {
+        return NGX_ERROR;
+    }
+
+    len = sizeof(" in polaris_rate_limiting status zone \"\"") + shm_zone->shm.name.len;
+    ctx->shpool->log_ctx = reinterpret_cast<u_char *>(ngx_slab_alloc(ctx->shpool, len));
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_sprintf(ctx->shpool->log_ctx, " in polaris_rate_limiting status zone \"%V\"%Z", &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+ngx_polaris_limit_stat_t *ngx_polaris_limit_stat_get(ngx_polaris_limit_stat_ctx_t *ctx, ngx_uint_t index) {
+    if (ctx == NULL || ctx->sh == NULL || index >= ctx->sh->nservices) {
+        return NULL;
+    }
+    return &ctx->sh->stats[index * NGX_POLARIS_LIMIT_STAT_SHARDS + ngx_worker % NGX_POLARIS_LIMIT_STAT_SHARDS];
+}
+
+static void ngx_polaris_limit_histogram_merge(ngx_polaris_limit_histogram_t *dst, ngx_polaris_limit_histogram_t *src) {
+    ngx_uint_t                          i;
+
+    dst->sum += src->sum;
+    for (i = 0; i < NGX_POLARIS_LIMIT_STAT_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+void ngx_polaris_limit_stat_merge(ngx_polaris_limit_stat_ctx_t *ctx, ngx_uint_t index, ngx_polaris_limit_stat_t *out) {
+    ngx_polaris_limit_stat_t           *stat;
+    ngx_uint_t                          i, j;
+
+    ngx_memzero(out, sizeof(ngx_polaris_limit_stat_t));
+    if (ctx == NULL || ctx->sh == NULL || index >= ctx->sh->nservices) {
+        return;
+    }
+
+    for (i = 0; i < NGX_POLARIS_LIMIT_STAT_SHARDS; i++) {
+        stat = &ctx->sh->stats[index * NGX_POLARIS_LIMIT_STAT_SHARDS + i];
+        for (j = 0; j < NGX_POLARIS_LIMIT_STAT_NCOUNTERS; j++) {
+            out->counters[j] += stat->counters[j];
+        }
+        ngx_polaris_limit_histogram_merge(&out->quota_latency, &stat->quota_latency);
+        ngx_polaris_limit_histogram_merge(&out->rule_latency, &stat->rule_latency);
+    }
+}
+
+/* 对数线性分桶：32微秒以下每微秒一个桶，之后每个2的幂区间分为8个桶 */
+ngx_uint_t ngx_polaris_limit_stat_bucket(uint64_t us) {
+    ngx_uint_t                          exp;
+
+    if (us < NGX_POLARIS_LIMIT_STAT_LINEAR) {
+        return static_cast<ngx_uint_t>(us);
+    }
+
+    exp = 63 - __builtin_clzll(us);
+    if (exp > NGX_POLARIS_LIMIT_STAT_MAX_EXP) {
+        return NGX_POLARIS_LIMIT_STAT_BUCKETS - 1;
+    }
+
+    return NGX_POLARIS_LIMIT_STAT_LINEAR + (exp - 5) * NGX_POLARIS_LIMIT_STAT_SUB_COUNT
+        + ((us >> (exp - NGX_POLARIS_LIMIT_STAT_SUB_BITS)) & (NGX_POLARIS_LIMIT_STAT_SUB_COUNT - 1));
+}
+
+uint64_t ngx_polaris_limit_stat_bucket_upper(ngx_uint_t index) {
+    ngx_uint_t                          exp, sub;
+
+    if (index < NGX_POLARIS_LIMIT_STAT_LINEAR) {
+        return index;
+    }
+
+    exp = 5 + (index - NGX_POLARIS_LIMIT_STAT_LINEAR) / NGX_POLARIS_LIMIT_STAT_SUB_COUNT;
+    sub = (index - NGX_POLARIS_LIMIT_STAT_LINEAR) % NGX_POLARIS_LIMIT_STAT_SUB_COUNT;
+    return ((static_cast<uint64_t>(NGX_POLARIS_LIMIT_STAT_SUB_COUNT + sub + 1)) << (exp - NGX_POLARIS_LIMIT_STAT_SUB_BITS)) - 1;
+}
+
+void ngx_polaris_limit_stat_record(ngx_polaris_limit_histogram_t *hist, uint64_t us) {
+    (void) ngx_atomic_fetch_add(&hist->sum, us);
+    (void) ngx_atomic_fetch_add(&hist->buckets[ngx_polaris_limit_stat_bucket(us)], 1);
+}
+
+uint64_t ngx_polaris_limit_stat_now_us() {
+    struct timespec                     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,100 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+#ifndef NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_STAT_H_
+#define NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_STAT_H_
+
+extern "C" {
+    #include <ngx_config.h>
+    #include <ngx_core.h>
+}
+
+#define NGX_POLARIS_LIMIT_STAT_SHARDS       8               // 按worker分片，减少原子操作冲突
+#define NGX_POLARIS_LIMIT_STAT_SUB_BITS     3               // 每个2的幂区间分为8个桶，相对误差不超过12.5%
+#define NGX_POLARIS_LIMIT_STAT_SUB_COUNT    (1 << NGX_POLARIS_LIMIT_STAT_SUB_BITS)
+#define NGX_POLARIS_LIMIT_STAT_LINEAR       (NGX_POLARIS_LIMIT_STAT_SUB_COUNT * 4)      // 32微秒以下按1微秒分桶
+#define NGX_POLARIS_LIMIT_STAT_MAX_EXP      27              // 超过2^28微秒的耗时记入最后一个桶
+#define NGX_POLARIS_LIMIT_STAT_BUCKETS                                                    \
+    (NGX_POLARIS_LIMIT_STAT_LINEAR + (NGX_POLARIS_LIMIT_STAT_MAX_EXP - 4) * NGX_POLARIS_LIMIT_STAT_SUB_COUNT)
+
+typedef enum {
+    NGX_POLARIS_LIMIT_STAT_PASSED = 0,
+    NGX_POLARIS_LIMIT_STAT_LIMITED,
+    NGX_POLARIS_LIMIT_STAT_TIMEOUT,
+    NGX_POLARIS_LIMIT_STAT_ERROR,
+    NGX_POLARIS_LIMIT_STAT_DELAYED,                         // 超出配额后排队等待过的请求
+    NGX_POLARIS_LIMIT_STAT_SHED,                            // 排队时间过长被丢弃的请求
+    NGX_POLARIS_LIMIT_STAT_DEGRADED,                        // 远端不可达时按本机份额判断的请求
+    NGX_POLARIS_LIMIT_STAT_NCOUNTERS
+} ngx_polaris_limit_stat_counter_e;
+
+/// @brief 单调递增的耗时直方图，单位微秒
+typedef struct {
+    ngx_atomic_t                        sum;
+    ngx_atomic_t                        buckets[NGX_POLARIS_LIMIT_STAT_BUCKETS];
+} ngx_polaris_limit_histogram_t;
+
+/// @brief 一个服务在一个分片上的统计
+typedef struct {
+    ngx_atomic_t                        counters[NGX_POLARIS_LIMIT_STAT_NCOUNTERS];
+    ngx_polaris_limit_histogram_t       quota_latency;      // GetQuota耗时
+    ngx_polaris_limit_histogram_t       rule_latency;       // FetchRuleLabelKeys耗时
+} ngx_polaris_limit_stat_t;
+
+typedef struct {
+    ngx_uint_t                          nservices;
+    ngx_polaris_limit_stat_t           *stats;              // nservices * NGX_POLARIS_LIMIT_STAT_SHARDS
+} ngx_polaris_limit_stat_shctx_t;
+
+typedef struct {
+    ngx_polaris_limit_stat_shctx_t     *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_uint_t                          nservices;          // 配置解析时确定的服务数
+} ngx_polaris_limit_stat_ctx_t;
+
+size_t ngx_polaris_limit_stat_zone_size(ngx_uint_t nservices);
+
+ngx_int_t ngx_polaris_limit_stat_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+
+/// @brief 当前worker对应分片上的统计，index超出范围时返回NULL
+ngx_polaris_limit_stat_t *ngx_polaris_limit_stat_get(ngx_polaris_limit_stat_ctx_t *ctx, ngx_uint_t index);
+
+/// @brief 汇总所有分片，可以在线程中调用
+void ngx_polaris_limit_stat_merge(ngx_polaris_limit_stat_ctx_t *ctx, ngx_uint_t index, ngx_polaris_limit_stat_t *out);
+
+void ngx_polaris_limit_stat_record(ngx_polaris_limit_histogram_t *hist, uint64_t us);
+
+ngx_uint_t ngx_polaris_limit_stat_bucket(uint64_t us);
+
+/// @brief 桶内最大耗时，单位微秒
+uint64_t ngx_polaris_limit_stat_bucket_upper(ngx_uint_t index);
+
+/// @brief 单调时钟，单位微秒，可以在线程中调用
+uint64_t ngx_polaris_limit_stat_now_us();
+
+#define ngx_polaris_limit_stat_count(stat, counter)                                       \
+    do {                                                                                  \
+        if (stat) {                                                                       \
+            (void) ngx_atomic_fetch_add(&(stat)->counters[counter], 1);                   \
+        }                                                                                 \
+    } while (0)
+
+/// start为ngx_polaris_limit_stat_now_us()的返回值，hist为quota_latency或rule_latency
+#define ngx_polaris_limit_stat_latency(stat, hist, start)                                 \
+    do {                                                                                  \
+        if (stat) {                                                                       \
+            ngx_polaris_limit_stat_record(&(stat)->hist, ngx_polaris_limit_stat_now_us() - (start)); \
+        }                                                                                 \
+    } while (0)
+
+#endif  // NGINX_MODULE_POLARIS_NGINX_POLARIS_LIMIT_MODULE_NGX_POLARIS_LIMIT_STAT_H_
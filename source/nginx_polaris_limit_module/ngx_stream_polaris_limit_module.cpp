@@ -0,0 +1,754 @@
+//  Copyright (C) 2019 THL A29 Limited, a Tencent company. All rights reserved.
+//
+//  Licensed under the BSD 3-Clause License (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//
+//  https://opensource.org/licenses/BSD-3-Clause
+//
+//  Unless required by applicable law or agreed to in writing, software distributed
+//  under the License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
+//  CONDITIONS OF ANY KIND, either express or implied. See the License for the specific
+//  language governing permissions and limitations under the License.
+//
+
+extern "C" {
+    #include <ngx_config.h>
+    #include <ngx_core.h>
+    #include <ngx_stream.h>
+}
+
+#include "ngx_http_polaris_limit_module.h"
+
+static const char KEY_METHOD[] = "method=";
+static const uint32_t KEY_METHOD_SIZE = sizeof(KEY_METHOD) - 1;
+static const char KEY_CONN[] = "conn=";
+static const uint32_t KEY_CONN_SIZE = sizeof(KEY_CONN) - 1;
+static const char KEY_IP_RATE[] = "ip_rate=";
+static const uint32_t KEY_IP_RATE_SIZE = sizeof(KEY_IP_RATE) - 1;
+static const char KEY_IP_BURST[] = "ip_burst=";
+static const uint32_t KEY_IP_BURST_SIZE = sizeof(KEY_IP_BURST) - 1;
+static const char KEY_IP_CONN[] = "ip_conn=";
+static const uint32_t KEY_IP_CONN_SIZE = sizeof(KEY_IP_CONN) - 1;
+
+typedef struct {
+    ngx_str_t                           config_path;                        // 配置解析时读取的polaris.yaml
+    ngx_str_t                           polaris_config;
+    time_t                              config_mtime;
+    ngx_flag_t                          remote;                             // 是否有server使用远端限流
+    ngx_flag_t                          enabled;                            // 是否有server启用限流，否则不挂载phase处理函数
+} ngx_stream_polaris_limit_main_conf_t;
+
+typedef struct {
+    ngx_flag_t                          enable;
+
+    ngx_uint_t                          mode;                               // 限流模式，不支持并发自适应
+
+    ngx_str_t                           service_namespace;
+
+    ngx_str_t                           service_name;
+
+    ngx_str_t                           method;                             // 远端限流规则中匹配的method，为空时不设置
+
+    ngx_msec_t                          timeout;                            // 获取配额的时间预算，0表示使用默认值
+
+    ngx_uint_t                          fail;                               // 获取配额出错时的处理方式
+
+    ngx_shm_zone_t                     *shm_zone;
+
+    ngx_polaris_limit_gcra_t            gcra;                               // 服务的新建连接速率
+
+    ngx_polaris_limit_gcra_t            ip_gcra;                            // 每个客户端IP的新建连接速率
+
+    ngx_polaris_limit_concurrency_conf_t conn;                              // 服务的并发连接数，min与max相同
+
+    ngx_polaris_limit_concurrency_conf_t ip_conn;                           // 每个客户端IP的并发连接数
+
+    uint64_t                            salt;                               // 区分不同server的限流桶
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;                        // 远端限流获取配额使用的线程池
+#endif
+} ngx_stream_polaris_limit_srv_conf_t;
+
+#define NGX_STREAM_POLARIS_LIMIT_ASYNC_QUOTA    1                           // 线程池中获取配额
+#define NGX_STREAM_POLARIS_LIMIT_ASYNC_DONE     2
+
+/// @brief 远端限流时连接上的状态，线程返回后重新运行phase读取结果
+typedef struct {
+    ngx_uint_t                          async_state;
+    ngx_thread_task_t                  *task;
+} ngx_stream_polaris_limit_ctx_t;
+
+/// @brief 投递到线程池的配额请求，启用http代理的worker中通过agent转发agent_call，否则直接调用limit_api
+typedef struct {
+    polaris::LimitApi                  *limit_api;
+    polaris::QuotaRequest              *quota_request;
+    ngx_polaris_limit_agent_ctx_t      *agent;
+    LimitAgentQuotaCall                *agent_call;
+    polaris::ReturnCode                 ret;
+    polaris::QuotaResultCode            result;
+} ngx_stream_polaris_limit_task_ctx_t;
+
+/// @brief 连接关闭时归还占用的并发槽
+typedef struct {
+    ngx_stream_polaris_limit_srv_conf_t *conf;
+    ngx_polaris_limit_concurrency_t    *slot;
+    ngx_polaris_limit_concurrency_t    *ip_slot;
+} ngx_stream_polaris_limit_cleanup_t;
+
+static ngx_int_t ngx_stream_polaris_limit_handler(ngx_stream_session_t *s);
+static ngx_int_t ngx_stream_polaris_limit_local(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf);
+#if (NGX_THREADS)
+static ngx_int_t ngx_stream_polaris_limit_remote(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf);
+static ngx_int_t ngx_stream_polaris_limit_verdict(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf,
+    polaris::ReturnCode ret, polaris::QuotaResultCode result);
+static void ngx_stream_polaris_limit_thread_handler(void *data, ngx_log_t *log);
+static void ngx_stream_polaris_limit_thread_event_handler(ngx_event_t *ev);
+#endif
+static uint64_t ngx_stream_polaris_limit_ip_key(ngx_connection_t *c, uint64_t salt);
+static void ngx_stream_polaris_limit_cleanup(void *data);
+static char *ngx_stream_polaris_limit_conf_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_stream_polaris_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_stream_polaris_limit_init(ngx_conf_t *cf);
+static void *ngx_stream_polaris_limit_create_main_conf(ngx_conf_t *cf);
+static void *ngx_stream_polaris_limit_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_stream_polaris_limit_init_process(ngx_cycle_t *cycle);
+
+static ngx_command_t ngx_stream_polaris_limit_commands[] = {
+    { ngx_string("polaris_stream_rate_limiting"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_ANY,
+      ngx_stream_polaris_limit_conf_set,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("polaris_stream_rate_limiting_zone"),
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_stream_polaris_limit_zone,
+      0,
+      0,
+      NULL },
+    ngx_null_command
+};
+
+static ngx_stream_module_t ngx_stream_polaris_limit_module_ctx = {
+    NULL,                                       /* preconfiguration */
+    ngx_stream_polaris_limit_init,              /* postconfiguration */
+
+    ngx_stream_polaris_limit_create_main_conf,  /* create main configuration */
+    NULL,                                       /* init main configuration */
+
+    ngx_stream_polaris_limit_create_srv_conf,   /* create server configuration */
+    NULL                                        /* merge server configuration */
+};
+
+ngx_module_t ngx_stream_polaris_limit_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_polaris_limit_module_ctx,       /* module context */
+    ngx_stream_polaris_limit_commands,          /* module directives */
+    NGX_STREAM_MODULE,                          /* module type */
+    NULL,                                       /* init master */
+    NULL,                                       /* init module */
+    ngx_stream_polaris_limit_init_process,      /* init process */
+    NULL,                                       /* init thread */
+    NULL,                                       /* exit thread */
+    NULL,                                       /* exit process */
+    NULL,                                       /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+/* 在建立上游连接之前按连接限流，被限流的连接直接关闭 */
+static ngx_int_t ngx_stream_polaris_limit_handler(ngx_stream_session_t *s) {
+    ngx_stream_polaris_limit_srv_conf_t *pscf;
+
+    pscf = reinterpret_cast<ngx_stream_polaris_limit_srv_conf_t *>(
+        ngx_stream_get_module_srv_conf(s, ngx_stream_polaris_limit_module));
+    if (!pscf->enable) {
+        return NGX_DECLINED;
+    }
+
+    if (pscf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL) {
+        return ngx_stream_polaris_limit_local(s, pscf);
+    }
+#if (NGX_THREADS)
+    return ngx_stream_polaris_limit_remote(s, pscf);
+#else
+    return NGX_DECLINED;                                        // 配置解析时已拒绝
+#endif
+}
+
+/* 先占用服务和客户端IP的并发槽，再从两级速率桶中获取令牌，任一项被限流时回滚已占用的部分 */
+static ngx_int_t ngx_stream_polaris_limit_local(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf) {
+    ngx_connection_t                   *c = s->connection;
+    ngx_polaris_limit_shm_ctx_t        *shm_ctx;
+    ngx_polaris_limit_result_t          result;
+    ngx_stream_polaris_limit_cleanup_t *plc;
+    ngx_pool_cleanup_t                 *cln;
+    uint64_t                            key;
+    uint64_t                            ip_key;
+
+    shm_ctx = reinterpret_cast<ngx_polaris_limit_shm_ctx_t *>(pscf->shm_zone->data);
+    key = ngx_polaris_limit_hash_key(pscf->salt, NULL, 0);
+    ip_key = ngx_stream_polaris_limit_ip_key(c, key);
+
+    cln = ngx_pool_cleanup_add(c->pool, sizeof(ngx_stream_polaris_limit_cleanup_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+    plc = reinterpret_cast<ngx_stream_polaris_limit_cleanup_t *>(cln->data);
+    plc->conf = pscf;
+    plc->slot = NULL;
+    plc->ip_slot = NULL;
+    cln->handler = ngx_stream_polaris_limit_cleanup;
+
+    if (pscf->conn.max
+        && ngx_polaris_limit_concurrency_acquire(shm_ctx, key, &pscf->conn, 0, &plc->slot, &result) == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "[PolarisRateLimiting] limiting connections by service, %ui",
+            pscf->conn.max);
+        return NGX_STREAM_SERVICE_UNAVAILABLE;
+    }
+
+    if (pscf->ip_conn.max
+        && ngx_polaris_limit_concurrency_acquire(shm_ctx, ip_key, &pscf->ip_conn, 0, &plc->ip_slot, &result) == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "[PolarisRateLimiting] limiting connections by client %V, %ui",
+            &c->addr_text, pscf->ip_conn.max);
+        return NGX_STREAM_SERVICE_UNAVAILABLE;              // 已占用的服务并发槽在cleanup中归还
+    }
+
+    result.limited = 0;
+    if (pscf->gcra.rate && pscf->ip_gcra.rate) {
+        ngx_polaris_limit_tree_acquire(shm_ctx, key, &pscf->gcra, ip_key, &pscf->ip_gcra, 1, 0, NGX_CONF_UNSET_UINT, 0, &result);
+    } else if (pscf->gcra.rate) {
+        ngx_polaris_limit_gcra_acquire(shm_ctx, key, &pscf->gcra, 1, 0, 0, &result);
+    } else if (pscf->ip_gcra.rate) {
+        ngx_polaris_limit_gcra_acquire(shm_ctx, ip_key, &pscf->ip_gcra, 1, 0, 0, &result);
+    }
+
+    if (result.limited) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "[PolarisRateLimiting] limiting new connection from %V, retry after %M",
+            &c->addr_text, result.retry_after);
+        return NGX_STREAM_SERVICE_UNAVAILABLE;
+    }
+    return NGX_DECLINED;
+}
+
+#if (NGX_THREADS)
+
+/* 按polaris限流规则获取配额，客户端地址作为$caller_ip标签。
+   GetQuota在线程池中调用，连接挂起在preaccess阶段，不阻塞事件循环。
+   http启用代理时非代理worker没有LimitApi，与http请求一样转发给代理worker */
+static ngx_int_t ngx_stream_polaris_limit_remote(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf) {
+    ngx_connection_t                   *c = s->connection;
+    ngx_stream_polaris_limit_ctx_t     *ctx;
+    ngx_stream_polaris_limit_task_ctx_t *tctx;
+    ngx_thread_task_t                  *task;
+    polaris::LimitApi                  *limit_api = NULL;
+    polaris::QuotaRequest              *quota_request = NULL;
+    ngx_polaris_limit_agent_ctx_t      *agent;
+    LimitAgentQuotaCall                *agent_call = NULL;
+    std::map<std::string, std::string>  labels;
+
+    ctx = reinterpret_cast<ngx_stream_polaris_limit_ctx_t *>(ngx_stream_get_module_ctx(s, ngx_stream_polaris_limit_module));
+    if (ctx != NULL) {
+        if (ctx->async_state == NGX_STREAM_POLARIS_LIMIT_ASYNC_QUOTA) {
+            return NGX_AGAIN;                                   // 等待线程返回时客户端的读事件重新运行了phase
+        }
+        tctx = reinterpret_cast<ngx_stream_polaris_limit_task_ctx_t *>(ctx->task->ctx);
+        return ngx_stream_polaris_limit_verdict(s, pscf, tctx->ret, tctx->result);
+    }
+
+    agent = ngx_http_polaris_limit_get_agent();
+    if (agent == NULL) {
+        limit_api = Limit_API_SINGLETON.GetLimitApi();
+        if (limit_api == NULL) {
+            return NGX_DECLINED;                                // 未就绪时放通
+        }
+    }
+
+    ctx = reinterpret_cast<ngx_stream_polaris_limit_ctx_t *>(ngx_pcalloc(c->pool, sizeof(ngx_stream_polaris_limit_ctx_t)));
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+    task = ngx_thread_task_alloc(c->pool, sizeof(ngx_stream_polaris_limit_task_ctx_t));
+    if (task == NULL) {
+        return NGX_ERROR;
+    }
+
+    labels[LABEL_KEY_CALLER_IP] = std::string(reinterpret_cast<char *>(c->addr_text.data), c->addr_text.len);
+    if (agent != NULL) {
+        agent_call = new LimitAgentQuotaCall();
+        agent_call->service_namespace.assign(reinterpret_cast<char *>(pscf->service_namespace.data), pscf->service_namespace.len);
+        agent_call->service_name.assign(reinterpret_cast<char *>(pscf->service_name.data), pscf->service_name.len);
+        agent_call->method.assign(reinterpret_cast<char *>(pscf->method.data), pscf->method.len);
+        agent_call->labels.swap(labels);
+        agent_call->timeout = pscf->timeout ? pscf->timeout : NGX_HTTP_POLARIS_LIMIT_DEFAULT_TIMEOUT;
+    } else {
+        quota_request = new polaris::QuotaRequest();
+        quota_request->SetServiceNamespace(std::string(reinterpret_cast<char *>(pscf->service_namespace.data),
+            pscf->service_namespace.len));
+        quota_request->SetServiceName(std::string(reinterpret_cast<char *>(pscf->service_name.data), pscf->service_name.len));
+        if (pscf->method.len) {
+            quota_request->SetMethod(std::string(reinterpret_cast<char *>(pscf->method.data), pscf->method.len));
+        }
+        quota_request->SetLabels(labels);
+        quota_request->SetTimeout(pscf->timeout ? pscf->timeout : NGX_HTTP_POLARIS_LIMIT_DEFAULT_TIMEOUT);
+    }
+
+    tctx = reinterpret_cast<ngx_stream_polaris_limit_task_ctx_t *>(task->ctx);
+    tctx->limit_api = limit_api;
+    tctx->quota_request = quota_request;
+    tctx->agent = agent;
+    tctx->agent_call = agent_call;
+    task->handler = ngx_stream_polaris_limit_thread_handler;
+    task->event.data = s;
+    task->event.handler = ngx_stream_polaris_limit_thread_event_handler;
+
+    if (ngx_thread_task_post(pscf->thread_pool, task) != NGX_OK) {
+        // 线程池队列已满，与超时同样处理
+        delete quota_request;
+        delete agent_call;
+        return ngx_stream_polaris_limit_verdict(s, pscf, polaris::kReturnTimeout, polaris::kQuotaResultOk);
+    }
+
+    ctx->async_state = NGX_STREAM_POLARIS_LIMIT_ASYNC_QUOTA;
+    ctx->task = task;
+    ngx_stream_set_ctx(s, ctx, ngx_stream_polaris_limit_module);
+    return NGX_AGAIN;
+}
+
+/* 在线程池中执行，可以阻塞等待SDK返回 */
+static void ngx_stream_polaris_limit_thread_handler(void *data, ngx_log_t *log) {
+    ngx_stream_polaris_limit_task_ctx_t *tctx = reinterpret_cast<ngx_stream_polaris_limit_task_ctx_t *>(data);
+    LimitAgentQuotaReply                reply = LimitAgentQuotaReply();
+
+    if (tctx->agent_call == NULL) {
+        tctx->ret = tctx->limit_api->GetQuota(*tctx->quota_request, tctx->result);
+        return;
+    }
+
+    tctx->ret = ngx_polaris_limit_agent_get_quota(tctx->agent, *tctx->agent_call, reply);
+    tctx->result = reply.result;
+}
+
+/* 线程返回后在事件循环中执行，重新运行phase */
+static void ngx_stream_polaris_limit_thread_event_handler(ngx_event_t *ev) {
+    ngx_stream_session_t               *s = reinterpret_cast<ngx_stream_session_t *>(ev->data);
+    ngx_stream_polaris_limit_ctx_t     *ctx;
+    ngx_stream_polaris_limit_task_ctx_t *tctx;
+
+    ctx = reinterpret_cast<ngx_stream_polaris_limit_ctx_t *>(ngx_stream_get_module_ctx(s, ngx_stream_polaris_limit_module));
+    tctx = reinterpret_cast<ngx_stream_polaris_limit_task_ctx_t *>(ctx->task->ctx);
+    delete tctx->quota_request;
+    tctx->quota_request = NULL;
+    delete tctx->agent_call;
+    tctx->agent_call = NULL;
+    ctx->async_state = NGX_STREAM_POLARIS_LIMIT_ASYNC_DONE;
+
+    ngx_stream_core_run_phases(s);
+}
+
+/* 按获取配额的结果放行或关闭连接 */
+static ngx_int_t ngx_stream_polaris_limit_verdict(ngx_stream_session_t *s, ngx_stream_polaris_limit_srv_conf_t *pscf,
+    polaris::ReturnCode ret, polaris::QuotaResultCode result) {
+    ngx_connection_t                   *c = s->connection;
+
+    if (ret != polaris::kReturnOk) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "[PolarisRateLimiting] fail to get quota for connection, return is: %d", ret);
+        if (pscf->fail == NGX_HTTP_POLARIS_LIMIT_FAIL_CLOSED
+            || (pscf->fail == NGX_HTTP_POLARIS_LIMIT_FAIL_DEFAULT && ret != polaris::kReturnTimeout)) {
+            return NGX_STREAM_SERVICE_UNAVAILABLE;
+        }
+        return NGX_DECLINED;
+    }
+
+    if (result == polaris::kQuotaResultLimited) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "[PolarisRateLimiting] limiting connection from %V by polaris rule",
+            &c->addr_text);
+        return NGX_STREAM_SERVICE_UNAVAILABLE;
+    }
+    return NGX_DECLINED;
+}
+
+#endif
+
+/* 客户端IP的桶在服务桶的key下区分，只使用地址部分 */
+static uint64_t ngx_stream_polaris_limit_ip_key(ngx_connection_t *c, uint64_t salt) {
+    switch (c->sockaddr->sa_family) {
+    case AF_INET:
+        return ngx_polaris_limit_hash_key(salt,
+            reinterpret_cast<u_char *>(&reinterpret_cast<struct sockaddr_in *>(c->sockaddr)->sin_addr), sizeof(struct in_addr));
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        return ngx_polaris_limit_hash_key(salt,
+            reinterpret_cast<u_char *>(&reinterpret_cast<struct sockaddr_in6 *>(c->sockaddr)->sin6_addr), sizeof(struct in6_addr));
+#endif
+    default:
+        return ngx_polaris_limit_hash_key(salt, c->addr_text.data, c->addr_text.len);
+    }
+}
+
+static void ngx_stream_polaris_limit_cleanup(void *data) {
+    ngx_stream_polaris_limit_cleanup_t *plc = reinterpret_cast<ngx_stream_polaris_limit_cleanup_t *>(data);
+
+    if (plc->slot != NULL) {
+        ngx_polaris_limit_concurrency_release(plc->slot, &plc->conf->conn, 0);
+    }
+    if (plc->ip_slot != NULL) {
+        ngx_polaris_limit_concurrency_release(plc->ip_slot, &plc->conf->ip_conn, 0);
+    }
+}
+
+/* 解析 polaris_stream_rate_limiting 的参数，与http模块的key=value格式一致 */
+static char *ngx_stream_polaris_limit_conf_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_stream_polaris_limit_srv_conf_t *pscf = reinterpret_cast<ngx_stream_polaris_limit_srv_conf_t *>(conf);
+    ngx_str_t                          *value;
+    ngx_uint_t                          i;
+    ngx_int_t                           n;
+    ngx_flag_t                          has_enable = 0;
+    const char                         *env_value;
+    ngx_str_t                           thread_pool_name = ngx_string("default");
+    ngx_stream_polaris_limit_main_conf_t *pmcf;
+
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, KEY_ENABLE, KEY_ENABLE_SIZE) == 0) {
+            ngx_str_t enable_str = {value[i].len - KEY_ENABLE_SIZE, &value[i].data[KEY_ENABLE_SIZE]};
+            std::string enable(reinterpret_cast<char *>(enable_str.data), enable_str.len);
+            pscf->enable = string2bool(enable) ? 1 : 0;
+            has_enable = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_NAMESPACE, KEY_NAMESPACE_SIZE) == 0) {
+            pscf->service_namespace.len = value[i].len - KEY_NAMESPACE_SIZE;
+            pscf->service_namespace.data = &value[i].data[KEY_NAMESPACE_SIZE];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_SERVICE_NAME, KEY_SERVICE_NAME_SIZE) == 0) {
+            pscf->service_name.len = value[i].len - KEY_SERVICE_NAME_SIZE;
+            pscf->service_name.data = &value[i].data[KEY_SERVICE_NAME_SIZE];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_METHOD, KEY_METHOD_SIZE) == 0) {
+            pscf->method.len = value[i].len - KEY_METHOD_SIZE;
+            pscf->method.data = &value[i].data[KEY_METHOD_SIZE];
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_MODE, KEY_MODE_SIZE) == 0) {
+            ngx_str_t mode_str = {value[i].len - KEY_MODE_SIZE, &value[i].data[KEY_MODE_SIZE]};
+            if (mode_str.len == 5 && ngx_strncmp(mode_str.data, "local", 5) == 0) {
+                pscf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL;
+            } else if (mode_str.len == 6 && ngx_strncmp(mode_str.data, "remote", 6) == 0) {
+                pscf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_REMOTE;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid mode \"%V\", only local or remote",
+                    &mode_str);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_ZONE, KEY_ZONE_SIZE) == 0) {
+            ngx_str_t zone_name = {value[i].len - KEY_ZONE_SIZE, &value[i].data[KEY_ZONE_SIZE]};
+            pscf->shm_zone = ngx_shared_memory_add(cf, &zone_name, 0, &ngx_stream_polaris_limit_module);
+            if (pscf->shm_zone == NULL) {
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_RATE, KEY_RATE_SIZE) == 0) {
+            ngx_str_t rate_str = {value[i].len - KEY_RATE_SIZE, &value[i].data[KEY_RATE_SIZE]};
+            if (ngx_polaris_limit_parse_rate(&rate_str, &pscf->gcra.rate) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid rate \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_IP_RATE, KEY_IP_RATE_SIZE) == 0) {
+            ngx_str_t rate_str = {value[i].len - KEY_IP_RATE_SIZE, &value[i].data[KEY_IP_RATE_SIZE]};
+            if (ngx_polaris_limit_parse_rate(&rate_str, &pscf->ip_gcra.rate) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid ip_rate \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_BURST, KEY_BURST_SIZE) == 0) {
+            n = ngx_atoi(value[i].data + KEY_BURST_SIZE, value[i].len - KEY_BURST_SIZE);
+            if (n < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid burst \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            pscf->gcra.burst = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_IP_BURST, KEY_IP_BURST_SIZE) == 0) {
+            n = ngx_atoi(value[i].data + KEY_IP_BURST_SIZE, value[i].len - KEY_IP_BURST_SIZE);
+            if (n < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid ip_burst \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            pscf->ip_gcra.burst = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_CONN, KEY_CONN_SIZE) == 0) {
+            n = ngx_atoi(value[i].data + KEY_CONN_SIZE, value[i].len - KEY_CONN_SIZE);
+            if (n <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid conn \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            pscf->conn.min = pscf->conn.max = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_IP_CONN, KEY_IP_CONN_SIZE) == 0) {
+            n = ngx_atoi(value[i].data + KEY_IP_CONN_SIZE, value[i].len - KEY_IP_CONN_SIZE);
+            if (n <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid ip_conn \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            pscf->ip_conn.min = pscf->ip_conn.max = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_TIMEOUT, KEY_TIMEOUT_SIZE) == 0) {
+            ngx_str_t timeout_str = {value[i].len - KEY_TIMEOUT_SIZE, &value[i].data[KEY_TIMEOUT_SIZE]};
+            ngx_msec_int_t timeout = ngx_parse_time(&timeout_str, 0);
+            if (timeout == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid timeout \"%V\"", &value[i]);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            pscf->timeout = static_cast<ngx_msec_t>(timeout);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_THREAD_POOL, KEY_THREAD_POOL_SIZE) == 0) {
+            thread_pool_name.len = value[i].len - KEY_THREAD_POOL_SIZE;
+            thread_pool_name.data = &value[i].data[KEY_THREAD_POOL_SIZE];
+            if (thread_pool_name.len == 0) {
+                return const_cast<char *>("invalid thread_pool");
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, KEY_FAIL, KEY_FAIL_SIZE) == 0) {
+            ngx_str_t fail_str = {value[i].len - KEY_FAIL_SIZE, &value[i].data[KEY_FAIL_SIZE]};
+            if (fail_str.len == 4 && ngx_strncmp(fail_str.data, "open", 4) == 0) {
+                pscf->fail = NGX_HTTP_POLARIS_LIMIT_FAIL_OPEN;
+            } else if (fail_str.len == 6 && ngx_strncmp(fail_str.data, "closed", 6) == 0) {
+                pscf->fail = NGX_HTTP_POLARIS_LIMIT_FAIL_CLOSED;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid fail \"%V\", only open or closed", &fail_str);
+                return static_cast<char *>(NGX_CONF_ERROR);
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] invalid parameter \"%V\"", &value[i]);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // 未配置的参数与http模块一样从环境变量读取
+    if (!has_enable) {
+        env_value = getenv(ENV_RATELIMIT_ENABLE.c_str());
+        pscf->enable = env_value != NULL && string2bool(std::string(env_value)) ? 1 : 0;
+    }
+
+    if (pscf->service_namespace.len == 0) {
+        env_value = getenv(ENV_NAMESPACE.c_str());
+        if (env_value == NULL) {
+            env_value = DEFAULT_NAMESPACE.c_str();
+        }
+        pscf->service_namespace.len = ngx_strlen(env_value);
+        pscf->service_namespace.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, pscf->service_namespace.len));
+        if (pscf->service_namespace.data == NULL) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        ngx_memcpy(pscf->service_namespace.data, env_value, pscf->service_namespace.len);
+    }
+
+    if (pscf->service_name.len == 0) {
+        env_value = getenv(ENV_SERVICE.c_str());
+        if (env_value == NULL) {
+            env_value = DEFAULT_SERVICE.c_str();
+        }
+        pscf->service_name.len = ngx_strlen(env_value);
+        pscf->service_name.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, pscf->service_name.len));
+        if (pscf->service_name.data == NULL) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        ngx_memcpy(pscf->service_name.data, env_value, pscf->service_name.len);
+    }
+
+    if (!pscf->enable) {
+        return static_cast<char *>(NGX_CONF_OK);
+    }
+
+    pmcf = reinterpret_cast<ngx_stream_polaris_limit_main_conf_t *>(
+        ngx_stream_conf_get_module_main_conf(cf, ngx_stream_polaris_limit_module));
+    pmcf->enabled = 1;
+
+    if (pscf->mode == NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL) {
+        if (pscf->shm_zone == NULL) {
+            return const_cast<char *>("local mode requires zone=");
+        }
+        if (pscf->gcra.rate == 0 && pscf->ip_gcra.rate == 0 && pscf->conn.max == 0 && pscf->ip_conn.max == 0) {
+            return const_cast<char *>("local mode requires rate=, ip_rate=, conn= or ip_conn=");
+        }
+        if (ngx_polaris_limit_zone_use(cf, pscf->shm_zone,
+                (pscf->gcra.rate || pscf->ip_gcra.rate ? NGX_POLARIS_LIMIT_USE_GCRA : 0)
+                | (pscf->conn.max || pscf->ip_conn.max ? NGX_POLARIS_LIMIT_USE_CONCURRENCY : 0)) == NULL)
+        {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        // 以配置位置和服务名区分限流桶，reload后保持不变
+        pscf->salt = (static_cast<uint64_t>(ngx_murmur_hash2(cf->conf_file->file.name.data, cf->conf_file->file.name.len)
+            ^ cf->conf_file->line) << 32) | ngx_crc32_short(pscf->service_name.data, pscf->service_name.len);
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use stream local mode, rate %ui.%03ui r/s, "
+            "ip rate %ui.%03ui r/s, conn %ui, ip conn %ui", pscf->gcra.rate / 1000, pscf->gcra.rate % 1000,
+            pscf->ip_gcra.rate / 1000, pscf->ip_gcra.rate % 1000, pscf->conn.max, pscf->ip_conn.max);
+    } else {
+#if (NGX_THREADS)
+        pscf->thread_pool = ngx_thread_pool_add(cf, &thread_pool_name);
+        if (pscf->thread_pool == NULL) {
+            return static_cast<char *>(NGX_CONF_ERROR);
+        }
+        pmcf->remote = 1;
+        ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0, "[PolarisRateLimiting] use stream remote mode, get quota in thread pool \"%V\"",
+            &thread_pool_name);
+#else
+        return const_cast<char *>("remote mode requires nginx built with --with-threads");
+#endif
+    }
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+/* 读取配置参数 polaris_stream_rate_limiting_zone name:size */
+static char *ngx_stream_polaris_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+    ngx_str_t                          *value;
+    ngx_str_t                           name;
+    ssize_t                             size;
+    ngx_shm_zone_t                     *shm_zone;
+    char                               *rv;
+
+    value = reinterpret_cast<ngx_str_t *>(cf->args->elts);
+
+    rv = ngx_polaris_limit_parse_zone(cf, &value[1], &name, &size);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_stream_polaris_limit_module);
+    if (shm_zone == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    // 控制结构可能已由之前引用该zone的指令创建，以init区分重复定义
+    if (shm_zone->init) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[PolarisRateLimiting] duplicate zone \"%V\"", &name);
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+
+    if (ngx_polaris_limit_zone_use(cf, shm_zone, 0) == NULL) {
+        return static_cast<char *>(NGX_CONF_ERROR);
+    }
+    shm_zone->init = ngx_polaris_limit_init_zone;
+
+    return static_cast<char *>(NGX_CONF_OK);
+}
+
+static ngx_int_t ngx_stream_polaris_limit_init(ngx_conf_t *cf) {
+    ngx_stream_handler_pt              *h;
+    ngx_stream_core_main_conf_t        *cmcf;
+    ngx_stream_polaris_limit_main_conf_t *pmcf;
+
+    pmcf = reinterpret_cast<ngx_stream_polaris_limit_main_conf_t *>(
+        ngx_stream_conf_get_module_main_conf(cf, ngx_stream_polaris_limit_module));
+    if (!pmcf->enabled) {
+        return NGX_OK;                                          // 没有启用限流的server，连接不经过本模块
+    }
+
+    cmcf = reinterpret_cast<ngx_stream_core_main_conf_t *>(
+        ngx_stream_conf_get_module_main_conf(cf, ngx_stream_core_module));
+
+    h = reinterpret_cast<ngx_stream_handler_pt *>(ngx_array_push(&cmcf->phases[NGX_STREAM_PREACCESS_PHASE].handlers));
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_stream_polaris_limit_handler;
+    return NGX_OK;
+}
+
+/* http块中没有远端限流时由stream模块读取polaris.yaml */
+static void *ngx_stream_polaris_limit_create_main_conf(ngx_conf_t *cf) {
+    ngx_stream_polaris_limit_main_conf_t *pmcf;
+    std::string                         path;
+    std::string                         content;
+
+    pmcf = reinterpret_cast<ngx_stream_polaris_limit_main_conf_t *>(
+        ngx_pcalloc(cf->pool, sizeof(ngx_stream_polaris_limit_main_conf_t)));
+    if (pmcf == NULL) {
+        return NULL;
+    }
+
+    path = LimitApiWrapper::DefaultConfigPath();
+    Limit_API_SINGLETON.LoadPolarisConfig(path, content, pmcf->config_mtime);
+
+    pmcf->config_path.len = path.size();
+    pmcf->config_path.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, path.size()));
+    pmcf->polaris_config.len = content.size();
+    pmcf->polaris_config.data = reinterpret_cast<u_char *>(ngx_pnalloc(cf->pool, content.size()));
+    if (pmcf->config_path.data == NULL || pmcf->polaris_config.data == NULL) {
+        return NULL;
+    }
+    ngx_memcpy(pmcf->config_path.data, path.data(), path.size());
+    ngx_memcpy(pmcf->polaris_config.data, content.data(), content.size());
+
+    return pmcf;
+}
+
+static void *ngx_stream_polaris_limit_create_srv_conf(ngx_conf_t *cf) {
+    ngx_stream_polaris_limit_srv_conf_t *conf;
+
+    conf = reinterpret_cast<ngx_stream_polaris_limit_srv_conf_t *>(
+        ngx_pcalloc(cf->pool, sizeof(ngx_stream_polaris_limit_srv_conf_t)));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->mode = NGX_HTTP_POLARIS_LIMIT_MODE_LOCAL;     // 连接限流默认在本机进行，不阻塞事件循环
+    return conf;
+}
+
+/* http模块的init_process先执行，已创建LimitApi时直接复用，LimitApi统一在http模块的exit_process中销毁。
+   http启用代理时非代理worker不创建LimitApi，远端限流转发给代理worker */
+static ngx_int_t ngx_stream_polaris_limit_init_process(ngx_cycle_t *cycle) {
+    ngx_stream_polaris_limit_main_conf_t *pmcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    pmcf = reinterpret_cast<ngx_stream_polaris_limit_main_conf_t *>(
+        ngx_stream_cycle_get_module_main_conf(cycle, ngx_stream_polaris_limit_module));
+    if (pmcf == NULL || !pmcf->remote || Limit_API_SINGLETON.GetLimitApi() != NULL
+        || ngx_http_polaris_limit_get_agent() != NULL)
+    {
+        return NGX_OK;
+    }
+
+    Limit_API_SINGLETON.Init(cycle->log,
+        std::string(reinterpret_cast<char *>(pmcf->config_path.data), pmcf->config_path.len),
+        std::string(reinterpret_cast<char *>(pmcf->polaris_config.data), pmcf->polaris_config.len),
+        pmcf->config_mtime);
+    return NGX_OK;
+}
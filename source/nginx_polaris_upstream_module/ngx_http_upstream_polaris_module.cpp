@@ -257,6 +257,14 @@ static ngx_int_t ngx_http_upstream_get_polaris_peer(ngx_peer_connection_t *pc, v
 
   int ret = polaris_get_addr(ctx);
 
+  // 异步拉取未完成时upstream中的server通常只是占位，不能转发过去
+  if (ctx->polaris_async && ret == polaris::kReturnTimeout) {
+    ngx_log_error(NGX_LOG_ERR, pc->log, 0,
+                  "polaris instances of %V/%V not ready with async=on, no instance for this request",
+                  &ctx->polaris_service_namespace, &ctx->polaris_service_name);
+    return NGX_BUSY;
+  }
+
   if (ret != 0) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "get polaris addr fail, use default server.");
     return bp->original_get_peer(pc, bp->data);
@@ -340,6 +348,9 @@ static void *ngx_http_upstream_polaris_create_conf(ngx_conf_t *cf) {
   conf->polaris_service_namespace_lengths = NULL;
   conf->polaris_service_namespace_values = NULL;
   conf->polaris_timeout = 1;
+  conf->polaris_async = false;
+  conf->polaris_local_lb = false;
+  conf->polaris_local_lb_slot = NULL;
   conf->polaris_lb_mode = 0;
   conf->polaris_dynamic_route_enabled = false;
   conf->metadata_route_failover_mode = 0;
@@ -505,6 +516,28 @@ static char *ngx_http_upstream_polaris_set_handler(ngx_conf_t *cf, ngx_command_t
       continue;
     }
 
+    // async=on: 实例缓存未就绪时不阻塞worker，在后台拉取，拉取完成前的请求直接返回502(no live upstreams)，
+    // 不会发往upstream中配置的占位server。缓存就绪后与同步模式一致，适合启动后可以容忍短暂失败的服务
+    if (ngx_strncmp(value[i].data, "async=", 6) == 0) {
+      ngx_str_t s = {value[i].len - 6, &value[i].data[6]};
+      if (ngx_strcmp(s.data, "on") == 0) {
+        dcf->polaris_async = true;
+      } else {
+        dcf->polaris_async = false;
+      }
+      continue;
+    }
+
+    if (ngx_strncmp(value[i].data, "local_lb=", 9) == 0) {
+      ngx_str_t s = {value[i].len - 9, &value[i].data[9]};
+      if (ngx_strcmp(s.data, "on") == 0) {
+        dcf->polaris_local_lb = true;
+      } else {
+        dcf->polaris_local_lb = false;
+      }
+      continue;
+    }
+
     if (ngx_strncmp(value[i].data, "mr=", 3) == 0) {
       ngx_str_t s = {value[i].len - 3, &value[i].data[3]};
       if (ngx_strcmp(s.data, "on") == 0) {
@@ -613,6 +646,16 @@ static char *ngx_http_upstream_polaris_set_handler(ngx_conf_t *cf, ngx_command_t
     return const_cast<char *>("dynamic route and metadata route can't be turned on at same time.");
   }
 
+  // 本地快照不区分请求的路由标签，只能用于不带路由的服务
+  if (dcf->polaris_local_lb && (dcf->polaris_dynamic_route_enabled || dcf->polaris_metadata_route_enabled)) {
+    return const_cast<char *>("local lb can't be turned on with dynamic route or metadata route.");
+  }
+
+  // 本地快照过期时同步从SDK刷新，不支持异步
+  if (dcf->polaris_local_lb && dcf->polaris_async) {
+    return const_cast<char *>("local lb can't be turned on with async.");
+  }
+
   if (dcf->polaris_dynamic_route_enabled) {
     std::string metadata_key_list;
     read_default_metadata_from_flie(cf, dcf, metadata_key_list);
@@ -665,10 +708,11 @@ static char *ngx_http_upstream_polaris_set_handler(ngx_conf_t *cf, ngx_command_t
 
   ngx_conf_log_error(
       NGX_LOG_NOTICE, cf, 0,
-      "init service_namespace:%s, service_name:%s, timeout: %.2f, mode: %d, "
-      "key: %s, dr: %d, mr_mode: %d, fail_status: %s,  max_tries: %d",
+      "init service_namespace:%s, service_name:%s, timeout: %.2f, async: %d, local_lb: %d, "
+      "mode: %d, key: %s, dr: %d, mr_mode: %d, fail_status: %s,  max_tries: %d",
       dcf->polaris_service_namespace.data, dcf->polaris_service_name.data, dcf->polaris_timeout,
-      dcf->polaris_lb_mode, dcf->polaris_lb_key.data, dcf->polaris_dynamic_route_enabled,
+      dcf->polaris_async, dcf->polaris_local_lb, dcf->polaris_lb_mode, dcf->polaris_lb_key.data,
+      dcf->polaris_dynamic_route_enabled,
       dcf->metadata_route_failover_mode, dcf->polaris_fail_status_list.data, dcf->max_tries);
 
   return NGX_CONF_OK;
@@ -24,6 +24,10 @@ using std::vector;
 #define POLARIS_RING_HASH       2
 #define POLARIS_L5_CST_HASH     3
 
+// for local_lb=on
+#define POLARIS_LOCAL_LB_REFRESH            1000    // 从SDK刷新实例快照的间隔，毫秒
+#define POLARIS_LOCAL_LB_VNODES             160     // 一致性hash环上每个实例的平均虚拟节点数，过少时各实例分到的key不均匀
+
 #define METADATA_ROUTE_FAILOVER_BY_NONE     0
 #define METADATA_ROUTE_FAILOVER_BY_ALL      1
 #define METADATA_ROUTE_FAILOVER_BY_NOT_KEY  2
@@ -42,6 +46,9 @@ typedef struct {
   ngx_array_t *polaris_service_name_values;
 
   float polaris_timeout;
+  ngx_int_t polaris_async;                                // 实例缓存未就绪时不阻塞worker，请求返回502
+  ngx_int_t polaris_local_lb;                             // 在worker内的实例快照上做负载均衡
+  void *polaris_local_lb_slot;                            // 服务名不含变量时缓存本worker的快照槽位
 
   ngx_str_t polaris_lb_key;
   ngx_int_t polaris_lb_mode;
@@ -77,6 +84,9 @@ typedef struct {
   ngx_str_t polaris_service_namespace;
   ngx_str_t polaris_service_name;
   ngx_int_t polaris_timeout;
+  ngx_int_t polaris_async;
+  ngx_int_t polaris_local_lb;
+  void *polaris_local_lb_slot;
   ngx_str_t polaris_lb_key;
   ngx_int_t polaris_lb_mode;
 
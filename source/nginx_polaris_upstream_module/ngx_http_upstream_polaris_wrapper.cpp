@@ -5,6 +5,7 @@
 
 #include <sstream>
 #include <algorithm>
+#include <map>
 #include "ngx_http_upstream_polaris_module.h"
 
 using std::string;
@@ -387,6 +388,8 @@ void set_metadata_route_failover_mode(ngx_http_upstream_polaris_srv_conf_t* srv,
   }
 }
 
+void set_polaris_local_lb_slot(ngx_http_upstream_polaris_srv_conf_t* srv, ngx_http_upstream_polaris_ctx_t* ctx);
+
 int polaris_init_params(ngx_http_upstream_polaris_srv_conf_t* srv, ngx_http_request_t* r,
                         ngx_http_upstream_polaris_ctx_t* ctx) {
   set_ctx_pool(ctx, r);
@@ -400,6 +403,13 @@ int polaris_init_params(ngx_http_upstream_polaris_srv_conf_t* srv, ngx_http_requ
 
   ctx->polaris_timeout = static_cast<int>(srv->polaris_timeout * 1000);
 
+  ctx->polaris_async = srv->polaris_async;
+
+  ctx->polaris_local_lb = srv->polaris_local_lb;
+  if (ctx->polaris_local_lb) {
+    set_polaris_local_lb_slot(srv, ctx);
+  }
+
   ctx->polaris_dynamic_route_enabled = srv->polaris_dynamic_route_enabled;
 
   ctx->polaris_metadata_route_enabled = srv->polaris_metadata_route_enabled;
@@ -435,6 +445,296 @@ void set_request_hash_str(ngx_http_upstream_polaris_ctx_t* ctx,
   }
 }
 
+/**
+ * 异步模式下每个服务在worker内最多有一个未完成的拉取，拉取完成前的请求直接返回超时，
+ * 由调用方拒绝请求，不阻塞worker，也不使用upstream中配置的占位server
+ */
+struct PendingDiscovery {
+  polaris::InstancesFuture* future;
+  ngx_msec_t deadline;
+};
+
+static std::map<std::string, PendingDiscovery> pending_discoveries;
+
+polaris::ReturnCode polaris_async_get_one_instance(ngx_http_upstream_polaris_ctx_t* ctx,
+                                                   polaris::ConsumerApi* consumer_api,
+                                                   const std::string& discovery_key,
+                                                   polaris::GetOneInstanceRequest& request,
+                                                   polaris::Instance& instance) {
+  std::map<std::string, PendingDiscovery>::iterator it = pending_discoveries.find(discovery_key);
+  if (it != pending_discoveries.end()) {
+    if (!it->second.future->IsDone()) {
+      if (static_cast<ngx_msec_int_t>(ngx_current_msec - it->second.deadline) < 0) {
+        return polaris::kReturnTimeout;
+      }
+      ngx_log_error(NGX_LOG_WARN, ctx->log, 0,
+                    "polaris async discovery of %s not done in %d ms, retry", discovery_key.c_str(),
+                    ctx->polaris_timeout);
+    }
+    delete it->second.future;
+    pending_discoveries.erase(it);
+  }
+
+  polaris::InstancesFuture* future = NULL;
+  polaris::ReturnCode ret = consumer_api->AsyncGetOneInstance(request, future);
+  if (ret != polaris::kReturnOk) {
+    return ret;
+  }
+
+  if (!future->IsDone()) {
+    PendingDiscovery pending;
+    pending.future = future;
+    pending.deadline = ngx_current_msec + ctx->polaris_timeout;
+    pending_discoveries[discovery_key] = pending;
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "polaris instance cache of %s is cold, fetch in background",
+                  discovery_key.c_str());
+    return polaris::kReturnTimeout;
+  }
+
+  // 缓存已就绪，立即返回负载均衡选出的实例
+  polaris::InstancesResponse* response = NULL;
+  ret = future->Get(0, response);
+  delete future;
+  if (ret == polaris::kReturnOk) {
+    std::vector<polaris::Instance>& instances = response->GetInstances();
+    if (instances.empty()) {
+      ret = polaris::kReturnInstanceNotFound;
+    } else {
+      instance = instances[0];
+    }
+  }
+  delete response;
+  return ret;
+}
+
+/**
+ * local_lb=on时每个worker缓存服务实例的只读快照，实例属性按列存放，选择实例时不再调用SDK。
+ * 加权随机使用alias method，O(1)；一致性hash在虚拟节点环上二分查找，O(log n)。
+ * 快照每POLARIS_LOCAL_LB_REFRESH毫秒从SDK刷新一次，revision变化时整体替换
+ */
+class LocalLbSnapshot {
+ public:
+  explicit LocalLbSnapshot(std::vector<polaris::Instance>& instances);
+
+  uint32_t SelectRandom() const;
+
+  uint32_t SelectHash(uint32_t hash) const;
+
+  std::string revision;
+  ngx_msec_t expire;
+
+  // 按实例下标对应
+  std::vector<struct sockaddr_in> addrs;
+  std::vector<std::string> hosts;
+  std::vector<int> ports;
+  std::vector<std::string> ids;
+
+ private:
+  // alias method：先等概率选列，再按threshold决定取本列还是alias
+  std::vector<uint32_t> thresholds;
+  std::vector<uint32_t> aliases;
+
+  // 一致性hash环，ring_hashes升序
+  std::vector<uint32_t> ring_hashes;
+  std::vector<uint32_t> ring_indexes;
+};
+
+LocalLbSnapshot::LocalLbSnapshot(std::vector<polaris::Instance>& instances) : expire(0) {
+  size_t n = instances.size();
+  uint64_t total = 0;
+  std::vector<uint64_t> weights(n);
+  for (size_t i = 0; i < n; ++i) {
+    weights[i] = instances[i].GetWeight();
+    total += weights[i];
+  }
+  if (total == 0) {
+    std::fill(weights.begin(), weights.end(), 1);
+    total = n;
+  }
+
+  addrs.resize(n);
+  hosts.resize(n);
+  ports.resize(n);
+  ids.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    hosts[i] = instances[i].GetHost();
+    ports[i] = instances[i].GetPort();
+    ids[i] = instances[i].GetId();
+    memset(&addrs[i], 0, sizeof(struct sockaddr_in));
+    addrs[i].sin_family      = AF_INET;
+    addrs[i].sin_port        = htons(ports[i]);
+    addrs[i].sin_addr.s_addr = inet_addr(hosts[i].c_str());
+  }
+
+  // Vose alias method，概率放大到2^31以便与ngx_random()直接比较
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    scaled[i] = static_cast<double>(weights[i]) * n / total;
+    if (scaled[i] < 1.0) {
+      small.push_back(i);
+    } else {
+      large.push_back(i);
+    }
+  }
+  thresholds.assign(n, 0x80000000u);
+  aliases.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    aliases[i] = i;
+  }
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back();
+    uint32_t l = large.back();
+    small.pop_back();
+    large.pop_back();
+    thresholds[s] = static_cast<uint32_t>(scaled[s] * 0x80000000u);
+    aliases[s] = l;
+    scaled[l] = scaled[l] + scaled[s] - 1.0;
+    if (scaled[l] < 1.0) {
+      small.push_back(l);
+    } else {
+      large.push_back(l);
+    }
+  }
+
+  // 虚拟节点数与权重成正比，每个实例至少一个
+  std::vector<std::pair<uint32_t, uint32_t> > ring;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t vnodes = std::max<uint64_t>(1, POLARIS_LOCAL_LB_VNODES * n * weights[i] / total);
+    for (uint64_t v = 0; v < vnodes; ++v) {
+      char node[NGX_INET_ADDRSTRLEN + 32];
+      int len = snprintf(node, sizeof(node), "%s:%d#%d", hosts[i].c_str(), ports[i], static_cast<int>(v));
+      ring.push_back(std::make_pair(ngx_murmur_hash2(reinterpret_cast<u_char*>(node), len),
+                                    static_cast<uint32_t>(i)));
+    }
+  }
+  std::sort(ring.begin(), ring.end());
+  ring_hashes.resize(ring.size());
+  ring_indexes.resize(ring.size());
+  for (size_t i = 0; i < ring.size(); ++i) {
+    ring_hashes[i] = ring[i].first;
+    ring_indexes[i] = ring[i].second;
+  }
+}
+
+uint32_t LocalLbSnapshot::SelectRandom() const {
+  uint32_t i = ngx_random() % thresholds.size();
+  return static_cast<uint32_t>(ngx_random()) < thresholds[i] ? i : aliases[i];
+}
+
+uint32_t LocalLbSnapshot::SelectHash(uint32_t hash) const {
+  std::vector<uint32_t>::const_iterator it = std::lower_bound(ring_hashes.begin(), ring_hashes.end(), hash);
+  if (it == ring_hashes.end()) {
+    it = ring_hashes.begin();
+  }
+  return ring_indexes[it - ring_hashes.begin()];
+}
+
+// 槽位在worker内不删除，std::map的元素地址不变，可以缓存槽位的地址
+static std::map<std::string, LocalLbSnapshot*> local_lb_snapshots;
+
+void* polaris_local_lb_slot(ngx_http_upstream_polaris_ctx_t* ctx) {
+  std::string snapshot_key(reinterpret_cast<char*>(ctx->polaris_service_namespace.data),
+    ctx->polaris_service_namespace.len);
+  snapshot_key += "#";
+  snapshot_key.append(reinterpret_cast<char*>(ctx->polaris_service_name.data), ctx->polaris_service_name.len);
+  return &local_lb_snapshots[snapshot_key];
+}
+
+void set_polaris_local_lb_slot(ngx_http_upstream_polaris_srv_conf_t* srv, ngx_http_upstream_polaris_ctx_t* ctx) {
+  if (srv->polaris_local_lb_slot != NULL) {
+    ctx->polaris_local_lb_slot = srv->polaris_local_lb_slot;
+    return;
+  }
+  ctx->polaris_local_lb_slot = polaris_local_lb_slot(ctx);
+  if (srv->polaris_service_namespace_lengths == NULL && srv->polaris_service_name_lengths == NULL) {
+    srv->polaris_local_lb_slot = ctx->polaris_local_lb_slot;
+  }
+}
+
+/**
+ * 快照不存在或已过期时从SDK拉取，拉取失败时继续使用旧快照
+ */
+LocalLbSnapshot* polaris_local_lb_snapshot(ngx_http_upstream_polaris_ctx_t* ctx,
+                                           const polaris::ServiceKey& service_key,
+                                           polaris::ReturnCode& ret) {
+  LocalLbSnapshot** slot = reinterpret_cast<LocalLbSnapshot**>(ctx->polaris_local_lb_slot);
+  LocalLbSnapshot* snapshot = *slot;
+  std::string snapshot_key = service_key.namespace_ + "#" + service_key.name_;
+  ret = polaris::kReturnOk;
+
+  polaris::GetInstancesRequest request(service_key);
+  request.SetTimeout(ctx->polaris_timeout);
+  polaris::InstancesResponse* response = NULL;
+  ret = CONSUMER_API_SINGLETON.GetConsumerApi()->GetInstances(request, response);
+  if (ret == polaris::kReturnOk && response->GetInstances().empty()) {
+    ret = polaris::kReturnInstanceNotFound;
+  }
+
+  if (ret != polaris::kReturnOk) {
+    if (snapshot != NULL) {
+      ngx_log_error(NGX_LOG_WARN, ctx->log, 0, "polaris refresh instances of %s fail, ret: %d, use last snapshot",
+                    snapshot_key.c_str(), ret);
+      ret = polaris::kReturnOk;
+      snapshot->expire = ngx_current_msec + POLARIS_LOCAL_LB_REFRESH;
+    }
+    delete response;
+    return snapshot;
+  }
+
+  if (snapshot == NULL || snapshot->revision != response->GetRevision()) {
+    LocalLbSnapshot* fresh = new LocalLbSnapshot(response->GetInstances());
+    fresh->revision = response->GetRevision();
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "polaris instance snapshot of %s updated, revision: %s, size: %d",
+                  snapshot_key.c_str(), fresh->revision.c_str(), static_cast<int>(fresh->ids.size()));
+    // 快照只在当前worker内使用，请求只在选择实例时读取，替换后旧快照可以直接释放
+    delete snapshot;
+    snapshot = fresh;
+    *slot = snapshot;
+  }
+  snapshot->expire = ngx_current_msec + POLARIS_LOCAL_LB_REFRESH;
+  delete response;
+  return snapshot;
+}
+
+int polaris_local_lb_get_addr(ngx_http_upstream_polaris_ctx_t* ctx) {
+  LocalLbSnapshot* snapshot = *reinterpret_cast<LocalLbSnapshot**>(ctx->polaris_local_lb_slot);
+  ctx->polaris_ret = polaris::kReturnOk;
+  memset(&ctx->addr, 0, sizeof(struct sockaddr_in));
+
+  // 快照未过期时直接选择，不构造服务名
+  if (snapshot == NULL || static_cast<ngx_msec_int_t>(ngx_current_msec - snapshot->expire) >= 0) {
+    polaris::ReturnCode ret;
+    polaris::ServiceKey service_key = {
+      std::string(reinterpret_cast<char*>(ctx->polaris_service_namespace.data), ctx->polaris_service_namespace.len),
+      std::string(reinterpret_cast<char*>(ctx->polaris_service_name.data), ctx->polaris_service_name.len)};
+    snapshot = polaris_local_lb_snapshot(ctx, service_key, ret);
+    ctx->polaris_ret = ret;
+    if (snapshot == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+                    "polaris get instances fail, namespace: %s, name: %s, ret: %d",
+                    service_key.namespace_.c_str(), service_key.name_.c_str(), ret);
+      return ret;
+    }
+  }
+
+  uint32_t i;
+  if (ctx->polaris_lb_mode > 0 && ctx->polaris_lb_key.len > 0) {
+    i = snapshot->SelectHash(ngx_murmur_hash2(ctx->polaris_lb_key.data, ctx->polaris_lb_key.len));
+  } else {
+    i = snapshot->SelectRandom();
+  }
+
+  ngx_memcpy(&ctx->addr, &snapshot->addrs[i], sizeof(struct sockaddr_in));
+  snprintf(ctx->ip, sizeof(ctx->ip), "%s", snapshot->hosts[i].c_str());
+  ctx->port = snapshot->ports[i];
+  snprintf(ctx->instance_id, sizeof(ctx->instance_id), "%s", snapshot->ids[i].c_str());
+  snprintf(ctx->name, sizeof(ctx->name), "%s:%d", ctx->ip, ctx->port);
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, ctx->log, 0, "polaris local lb select %s, instance id: %s",
+                ctx->name, ctx->instance_id);
+  return ctx->polaris_ret;
+}
+
 int polaris_get_addr(ngx_http_upstream_polaris_ctx_t* ctx) {
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
     "polaris dynamic route metadata list from ctx: %V", &ctx->polaris_dynamic_route_metadata_list);
@@ -442,10 +742,15 @@ int polaris_get_addr(ngx_http_upstream_polaris_ctx_t* ctx) {
     "polaris metadata route metadata list from ctx: %V", &ctx->polaris_metadata_route_metadata_list);
   memcpy(&ctx->polaris_start, ngx_timeofday(), sizeof(ngx_time_t));
 
+  if (ctx->polaris_local_lb) {
+    return polaris_local_lb_get_addr(ctx);
+  }
+
   std::string serviceNameSpace(reinterpret_cast<char*>(ctx->polaris_service_namespace.data),
     ctx->polaris_service_namespace.len);
   std::string serviceName(reinterpret_cast<char*>(ctx->polaris_service_name.data), ctx->polaris_service_name.len);
   polaris::ServiceKey serviceKey = {serviceNameSpace, serviceName};
+
   polaris::Instance instance;
   polaris::GetOneInstanceRequest request(serviceKey);
   request.SetTimeout(ctx->polaris_timeout);
@@ -463,11 +768,20 @@ int polaris_get_addr(ngx_http_upstream_polaris_ctx_t* ctx) {
     request.SetMetadataFailover(ctx->metadata_route_failover_mode);
   }
 
-  polaris::ReturnCode ret;
+  polaris::ConsumerApi* consumer_api;
   if (ctx->polaris_metadata_route_enabled) {
-    ret = METADATA_ROUTE_CONSUMER_API_SINGLETON.GetConsumerApi()->GetOneInstance(request, instance);
+    consumer_api = METADATA_ROUTE_CONSUMER_API_SINGLETON.GetConsumerApi();
   } else {
-    ret = CONSUMER_API_SINGLETON.GetConsumerApi()->GetOneInstance(request, instance);
+    consumer_api = CONSUMER_API_SINGLETON.GetConsumerApi();
+  }
+
+  polaris::ReturnCode ret;
+  if (ctx->polaris_async) {
+    std::string discovery_key = serviceNameSpace + "#" + serviceName +
+      (ctx->polaris_metadata_route_enabled ? "#mr" : "");
+    ret = polaris_async_get_one_instance(ctx, consumer_api, discovery_key, request, instance);
+  } else {
+    ret = consumer_api->GetOneInstance(request, instance);
   }
 
   ctx->polaris_ret = ret;
@@ -488,6 +802,10 @@ int polaris_get_addr(ngx_http_upstream_polaris_ctx_t* ctx) {
     ctx->addr.sin_port        = htons(ctx->port);
     ctx->addr.sin_addr.s_addr = inet_addr(ctx->ip);
     snprintf(ctx->name, sizeof(ctx->name), "%s:%d", ctx->ip, ctx->port);
+  } else if (ctx->polaris_async && ret == polaris::kReturnTimeout) {
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                  "polaris instances not ready, namespace: %s, name: %s",
+                  serviceNameSpace.c_str(), serviceName.c_str());
   } else {
     ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
                   "polaris get instance fail, namespace: %s, name: %s, ret: %d",